@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Builds the binary ROM database read by nesscape --romdb.
+
+Input is a CSV file, one ROM per line ('#' starts a comment):
+    crc32,sha1,mapper,submapper,mirroring,battery,region,prg_ram,prg_nvram,chr_ram
+
+    crc32      CRC32 of PRG + CHR (no header), hex
+    sha1       SHA-1 of PRG + CHR, hex, empty to match on CRC32 only
+    mirroring  h, v or 4
+    battery    0 or 1
+    region     ntsc, pal, multi or dendy
+    *_ram      sizes in bytes, 0 if absent (rounded up to NES 2.0 64 << n sizes)
+
+Or pass .nes files instead of a CSV to print CSV lines with their current headers.
+"""
+import struct
+import sys
+import zlib
+import hashlib
+
+MAGIC = b"NESROMDB"
+VERSION = 1
+REGIONS = { "ntsc": 0, "pal": 1, "multi": 2, "dendy": 3 }
+
+
+def ram_shift(size):
+    if size <= 0:
+        return 0
+    shift = 1
+    while (64 << shift) < size:
+        shift += 1
+    return shift
+
+
+def parse_line(line):
+    fields = [f.strip() for f in line.split(",")]
+    if len(fields) != 10:
+        raise ValueError("expected 10 fields: %s" % line)
+    crc, sha1, mapper, submapper, mirroring, battery, region, prg_ram, prg_nvram, chr_ram = fields
+    flags = { "h": 0, "v": 1, "4": 2 }[mirroring.lower()]
+    if int(battery):
+        flags |= 4
+    flags |= REGIONS[region.lower()] << 4
+    return struct.pack("<I20sHBBBBBB",
+        int(crc, 16), bytes.fromhex(sha1) if sha1 else bytes(20), int(mapper), int(submapper), flags,
+        ram_shift(int(prg_ram)), ram_shift(int(prg_nvram)), ram_shift(int(chr_ram)), 0)
+
+
+def describe_rom(path):
+    data = open(path, "rb").read()
+    prg, chr_ = data[4] * 16384, data[5] * 8192
+    body = data[16:16 + prg + chr_]
+    mapper = (data[7] & 0xF0) | (data[6] >> 4)
+    mirroring = "4" if data[6] & 8 else ("v" if data[6] & 1 else "h")
+    print("%08x,%s,%d,0,%s,%d,ntsc,%d,0,%d  # %s" % (zlib.crc32(body) & 0xFFFFFFFF, hashlib.sha1(body).hexdigest(),
+        mapper, mirroring, (data[6] >> 1) & 1, 8192, 0 if chr_ else 8192, path))
+
+
+def main():
+    if len(sys.argv) >= 2 and all(arg.lower().endswith(".nes") for arg in sys.argv[1:]):
+        for path in sys.argv[1:]:
+            describe_rom(path)
+        return
+
+    if len(sys.argv) != 3:
+        print("usage: make_romdb.py <entries.csv> <romdb.bin>\n       make_romdb.py <rom.nes>...")
+        sys.exit(1)
+
+    entries = []
+    for line in open(sys.argv[1]):
+        line = line.split("#")[0].strip()
+        if line:
+            entries.append(parse_line(line))
+    entries.sort(key=lambda entry: struct.unpack_from("<I", entry)[0])
+
+    with open(sys.argv[2], "wb") as out:
+        out.write(MAGIC + struct.pack("<II", VERSION, len(entries)))
+        for entry in entries:
+            out.write(entry)
+    print("%d entries written to %s" % (len(entries), sys.argv[2]))
+
+
+if __name__ == "__main__":
+    main()
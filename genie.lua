@@ -57,7 +57,7 @@ solution "nesscape"
 
       configuration "Debug"
          kind "ConsoleApp"
-         defines { "DEBUG", "WARNINGS" }
+         defines { "DEBUG", "WARNINGS", "BUS_TRACE" }
          flags { "Symbols", "StaticRuntime" }
 
       configuration "Release"
@@ -12,6 +12,19 @@ extern const uint8_t length_counter_lut[];
 
 struct apu_t
 {
+    enum CHANNEL
+    {
+        CH_PULSE_1  = 0,
+        CH_PULSE_2  = 1,
+        CH_TRIANGLE = 2,
+        CH_NOISE    = 3,
+        CH_DMC      = 4,
+        CH_COUNT    = 5
+    };
+
+    // Receives the isolated output of each channel, indexed by CHANNEL
+    typedef void (* stem_callback_t)(void* cookie, const float* stems);
+
     struct pulse_t {
         union
         { // 0x4000  /  0x4004
@@ -286,8 +299,23 @@ struct apu_t
         uint8_t data{0};
     } frame_counter;
 
+    struct mixer_t
+    {
+        float   gain[CH_COUNT]{1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
+        uint8_t mute_mask{0x00}; // Bit n set = CHANNEL n muted
+        bool    unity_gain{true};
+
+        // Optional per-channel stem output, only computed when a callback is set
+        stem_callback_t stem_callback{nullptr};
+        void*           stem_cookie{nullptr};
+        float           stems[CH_COUNT]{0};
+    } mix;
+
     void init(mem_t* mem);
     void mixer();
+    void set_channel_gain( CHANNEL channel, float gain );
+    void set_channel_mute( CHANNEL channel, bool mute );
+    bool channel_muted( CHANNEL channel ) const { return (mix.mute_mask >> channel) & 0x1; }
     void quarter_frame();
     void half_frame();
     float execute();
@@ -304,6 +332,8 @@ struct apu_t
     uint16_t cycle{0};
     uint8_t reset_frame_counter{0};
     bool frame_interrupt{false};
+    bool irq_lag[3]{false};
+    uint8_t irq_lag_index{0};
 
 };
 
@@ -0,0 +1,64 @@
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nes
+{
+
+/*
+*   Read-only .zip and .gz access for ROM images. open() only indexes the
+*   archive (the zip central directory or the gzip header), extract()
+*   inflates a single entry straight into the caller's buffer, so picking
+*   one ROM out of a multi-ROM zip never touches the others.
+*/
+
+struct archive_entry_t
+{
+    std::string name;
+    uint16_t method{0};          // 0 stored, 8 deflate
+    uint32_t crc32{0};
+    uint32_t compressed_size{0};
+    uint32_t size{0};            // Uncompressed
+    uint32_t offset{0};          // Compressed data, from the start of the archive
+};
+
+struct archive_t
+{
+    enum FORMAT
+    {
+        FORMAT_NONE,
+        FORMAT_ZIP,
+        FORMAT_GZIP
+    };
+
+    static FORMAT detect( const uint8_t* data, uint32_t size );
+
+    // data has to outlive the archive, it is indexed in place
+    bool open( const uint8_t* data, uint32_t size );
+
+    // nullptr or an empty name picks the first .nes entry
+    const archive_entry_t* find( const char* name ) const;
+
+    // out holds entry.size bytes, the CRC32 is checked
+    bool extract( const archive_entry_t& entry, uint8_t* out ) const;
+
+    FORMAT format{FORMAT_NONE};
+    std::vector<archive_entry_t> entries;
+
+private:
+    bool open_zip();
+    bool open_gzip();
+
+    const uint8_t* data{nullptr};
+    uint32_t size{0};
+};
+
+// Raw DEFLATE (RFC 1951), false on corrupt input or when the output doesn't fill out_size exactly
+bool inflate( const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size );
+
+} // nes
+
+#endif /* ARCHIVE_HPP */
@@ -0,0 +1,51 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace nes
+{
+
+/*
+*   One zeroed, cache line aligned block holding all state of an emulator
+*   instance. Sizes are reserved up front, commit() makes the single
+*   allocation and allocate() hands out the pieces. Nothing is freed on its
+*   own, objects constructed in the arena are destroyed by their owner and
+*   the memory goes with release().
+*/
+struct arena_t
+{
+    static constexpr size_t ALIGNMENT = 64; // Cache line
+
+    arena_t() = default;
+    arena_t( const arena_t& ) = delete;
+    arena_t& operator=( const arena_t& ) = delete;
+    ~arena_t();
+
+    static inline size_t align( size_t bytes )
+    {
+        return (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    inline void reserve( size_t bytes ) { capacity += align( bytes ); }
+    void  commit();
+    void  release();
+    void* allocate( size_t bytes );
+
+    template <typename T, typename... Args>
+    T* construct( Args&&... args )
+    {
+        return new (allocate( sizeof(T) )) T( std::forward<Args>(args)... );
+    }
+
+    uint8_t* data{nullptr};
+    size_t   capacity{0};
+    size_t   used{0};
+};
+
+} // nes
+
+#endif /* ARENA_HPP */
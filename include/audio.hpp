@@ -2,42 +2,213 @@
 #define AUDIO_HPP
 #include <miniaudio.h>
 
+#include "time_stretch.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace nes
 {
 
-#define DEVICE_FORMAT       ma_format_f32
-#define DEVICE_CHANNELS     2
-#define DEVICE_SAMPLE_RATE  48000
-#define FRAMES_PER_CB       480
-#define CYCLES_PER_CB       17865 // 10ms based upon 29780 per 16.67ms
+#define CYCLES_PER_SECOND               1786500 // 17865 per 10ms, based upon 29780 per 16.67ms
+#define DRIFT_CORRECTION_THRESHOLD_MS   104
+#define DRIFT_CORRECTION_SKIP_MS        62
+
+/*
+*   Output format, chosen at startup. The emulator always produces mono f32
+*   blocks of frames_per_cb frames (10ms), the backends convert to the
+*   configured layout on the way out.
+*/
+struct audio_config_t
+{
+    ma_format format{ma_format_f32};  // ma_format_f32 or ma_format_s16
+    uint32_t  channels{2};            // 1 or 2
+    uint32_t  sample_rate{48000};     // 44100, 48000 or 96000
+    uint32_t  period_frames{0};       // Device period, 0 = let the device decide
+
+    uint32_t frames_per_cb() const { return sample_rate / 100; }
+    uint32_t cycles_per_cb() const { return CYCLES_PER_SECOND / 100; }
+    uint32_t bytes_per_frame() const { return channels * (format == ma_format_s16 ? sizeof(int16_t) : sizeof(float)); }
+
+    // Comma separated list, e.g. "s16,mono,44100,period=256". Returns false on invalid input.
+    bool parse( const char* spec );
+};
+
+// Mono f32 to the configured format and channel count
+void convert_frames( const float* frames, size_t count, void* output, const audio_config_t& config );
+
+/*
+*   Lock-free histogram with fixed width buckets, values above the range
+*   end up in the last bucket. Written from one thread, readable from any.
+*/
+struct histogram_t
+{
+    static constexpr size_t HISTOGRAM_BUCKETS = 64;
+
+    histogram_t( float min_value, float bucket_width ) : min(min_value), width(bucket_width) {}
+
+    void     record( float value );
+    float    percentile( float fraction ) const; // Upper edge of the bucket holding the fraction
+    float    mean() const;
+    uint64_t samples() const { return count.load(std::memory_order_relaxed); }
+    void     write( FILE* file, const char* label, const char* unit ) const;
+
+    const float min;
+    const float width;
+
+private:
+    std::atomic<uint32_t> buckets[HISTOGRAM_BUCKETS]{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<double>   sum{0.0};
+};
+
+struct audio_stats_t
+{
+    histogram_t latency_ms{0.0f, 2.0f};         // Block production until the device callback consumed it
+    histogram_t ring_fill{0.0f, 2.0f};          // Percent of the ring buffer in use, per callback
+    histogram_t resample_ratio{0.84f, 0.005f};  // Input cycles per output frame, 1.0 = real time
+
+    std::atomic<uint64_t> underruns{0};         // Callbacks padded with the stale amplitude
+    std::atomic<uint64_t> padded_frames{0};
+    std::atomic<uint64_t> overruns{0};          // Blocks which didn't fit in the ring buffer
+    std::atomic<uint64_t> dropped_frames{0};
+    std::atomic<uint64_t> drift_skips{0};       // Drift corrections seeking past buffered audio
+    std::atomic<uint64_t> stretched_blocks{0};
 
-#define DRIFT_CORRECTION_THRESHOLD      20000
-#define DRIFT_CORRECTION_SKIP           12000 // 250ms
+    void write_report( FILE* file ) const;
+};
 
+/*
+*   Audio backends. The base collects the APU output every CPU cycle and
+*   decimates it into blocks of frames_per_cb frames, which are handed to
+*   the backend through submit(). When the emulator doesn't run at 1x the
+*   blocks are time-stretched back to real time, keeping the pitch.
+*/
 struct audio_t
 {
-    audio_t();
-    ~audio_t();
-    
-    struct audio_data_t {
-        ma_rb  ring_buffer;
-        float  tmp_buffer[FRAMES_PER_CB];
-        float  amplitude{0};
-        size_t drift{0};
-    } data;
+    audio_t( const audio_config_t& audio_config );
+    virtual ~audio_t() = default;
+
+    const audio_config_t config;
+    const uint32_t frames_per_cb;
+    const uint32_t cycles_per_cb;
 
-    float  storage[DEVICE_SAMPLE_RATE];
-    void*  buffer{nullptr};
+    std::vector<float> storage; // cycles_per_cb at the highest speed
+    std::vector<float> block;   // frames_per_cb at the highest speed
     size_t stored_data{0};
     size_t cycle_count{0};
+    float  speed{1.0f};
+
+    time_stretch_t stretcher;
+    bool           stretching{false};
+
+    audio_stats_t stats;
+
+    uint64_t samples_submitted{0};
 
     void buffer_data( float amplitude );
     void sample_data();
 
+    virtual const char* name() const = 0;
+    virtual void submit( const float* frames, size_t count ) = 0;
+};
+
+//////// miniaudio - real playback device
+struct audio_miniaudio_t : public audio_t
+{
+    audio_miniaudio_t( const audio_config_t& audio_config );
+    ~audio_miniaudio_t();
+
+    struct block_stamp_t
+    {
+        uint64_t end_frame;  // Total frames written once the block is in the ring
+        int64_t  produced;   // Steady clock, nanoseconds
+    };
+    static constexpr size_t STAMP_COUNT = 64;
+
+    struct audio_data_t {
+        ma_rb  ring_buffer;
+        std::vector<float> tmp_buffer;
+        float  amplitude{0};
+        size_t drift{0};
+        const audio_config_t* config{nullptr};
+        size_t drift_threshold{0}; // Bytes
+        size_t drift_skip{0};      // Bytes
+
+        // Latency bookkeeping, single producer (submit) and single consumer (callback)
+        audio_stats_t*        stats{nullptr};
+        block_stamp_t         stamps[STAMP_COUNT];
+        std::atomic<size_t>   stamp_head{0};
+        std::atomic<size_t>   stamp_tail{0};
+        std::atomic<uint64_t> frames_written{0};
+        uint64_t              frames_read{0};
+    } data;
+
+    const char* name() const override { return "miniaudio"; }
+    void submit( const float* frames, size_t count ) override;
+
     ma_device_config deviceConfig;
     ma_device device;
+
+private:
+    void start_device();
+
+    // The device is opened off the boot path, samples are buffered meanwhile
+    std::thread       start_thread;
+    std::atomic<bool> device_ready{false};
+};
+
+//////// null - discards all samples, but keeps count of them
+struct audio_null_t : public audio_t
+{
+    audio_null_t( const audio_config_t& audio_config ) : audio_t(audio_config) {}
+    ~audio_null_t();
+
+    const char* name() const override { return "null"; }
+    void submit( const float* frames, size_t count ) override;
+};
+
+//////// file - streams samples to a WAV or raw file from a writer thread
+struct audio_file_t : public audio_t
+{
+    enum class container
+    {
+        wav = 0,
+        raw = 1
+    };
+
+    audio_file_t( const char* filepath, container type, const audio_config_t& audio_config );
+    ~audio_file_t();
+
+    const char* name() const override { return type == container::wav ? "wav" : "raw"; }
+    void submit( const float* frames, size_t count ) override;
+
+private:
+    void writer_loop();
+    void write_wav_header( uint32_t data_size );
+
+    FILE*     file{nullptr};
+    container type{container::wav};
+    uint64_t  bytes_written{0};
+
+    std::thread             writer;
+    std::mutex              lock;
+    std::condition_variable wake;
+    std::vector<uint8_t>    pending; // Converted to the output format
+    bool                    closing{false};
 };
 
+/*
+*   Backend selection from the command line:
+*     miniaudio | null | wav:<path> | raw:<path>
+*   Returns nullptr on an invalid specification.
+*/
+audio_t* create_audio_backend( const char* spec, const audio_config_t& config );
+
 } // nes
 
-#endif /* AUDIO_HPP */
\ No newline at end of file
+#endif /* AUDIO_HPP */
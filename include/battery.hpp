@@ -0,0 +1,63 @@
+#ifndef BATTERY_HPP
+#define BATTERY_HPP
+
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+/*
+*   Battery-backed PRG-RAM, the .sav file is mapped shared and used as the
+*   RAM itself. The emulation thread only hands dirty pages to a writer
+*   thread at frame boundaries, the writer msyncs them. Platforms without
+*   mmap keep a heap copy and the writer writes the pages to the file.
+*
+*   The file is the whole of cartridge_mem_t::prg_ram: work RAM followed by
+*   NVRAM as the header sizes them, since $6000-$7FFF is one window over
+*   both. Boards have one or the other, so in practice it's the NVRAM (8KB
+*   for iNES 1.0 headers).
+*
+*   One instance owns a save file at a time, it's locked while open. Other
+*   instances (in this or another process) fail to open it and run on a
+*   copy from read_copy(), so they never share RAM with the owner.
+*/
+struct battery_ram_t
+{
+    ~battery_ram_t();
+
+    bool open( const char* filepath, uint32_t ram_size ); // False when locked by another instance
+    void close(); // Flushes everything and waits for the writer
+
+    // Save file contents without opening it for writing, zeros past the end
+    static void read_copy( const char* filepath, uint8_t* out, uint32_t ram_size );
+
+    // Queue pages for writing, never blocks on I/O
+    void flush( uint32_t dirty_pages );
+
+    uint8_t* data{nullptr};
+    uint32_t size{0};
+
+private:
+    void writer_loop();
+    void write_pages( uint32_t pages );
+
+    std::string path;
+    bool        mapped{false};
+    int         lock_fd{-1};
+
+    std::thread             writer;
+    std::mutex              mutex;
+    std::condition_variable wake;
+    uint32_t                pending{0};
+    bool                    stop{false};
+};
+
+} // nes
+
+#endif /* BATTERY_HPP */
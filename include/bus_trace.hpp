@@ -0,0 +1,75 @@
+#ifndef BUS_TRACE_HPP
+#define BUS_TRACE_HPP
+
+#include <cstdint>
+
+namespace nes
+{
+
+/*
+*   CPU data bus, picked at compile time. Every CPU access is recorded and
+*   open_bus() returns the value last driven on the bus, which is what an
+*   unmapped read sees on hardware. Without BUS_TRACE recording is a single
+*   byte store. With BUS_TRACE (Debug builds) accesses are also kept in a
+*   ring buffer together with their CPU cycle, which the JSON CPU tests
+*   compare cycle by cycle.
+*/
+
+struct bus_access_t
+{
+    uint32_t cycle;   // CPU cycles completed before the access
+    uint16_t address;
+    uint8_t  value;
+    bool     read;
+};
+
+#if defined(BUS_TRACE)
+
+struct bus_trace_t
+{
+    static constexpr uint32_t CAPACITY = 256; // Power of two
+
+    inline void record( uint32_t cycle, uint16_t address, uint8_t value, bool read )
+    {
+        log[ head++ & (CAPACITY - 1) ] = { cycle, address, value, read };
+        data_bus = value;
+    }
+
+    // Writes to the address of the last access, read-modify-write instructions
+    inline void rewrite( uint32_t cycle, uint8_t value )
+    {
+        record( cycle, head > 0 ? log[ (head - 1) & (CAPACITY - 1) ].address : 0, value, false );
+    }
+
+    inline uint8_t open_bus() const { return data_bus; }
+
+    // Accesses since clear(), oldest first. Only the last CAPACITY are kept
+    inline uint32_t size() const { return head < CAPACITY ? head : CAPACITY; }
+    inline const bus_access_t& operator[]( uint32_t index ) const
+    {
+        return log[ (head - size() + index) & (CAPACITY - 1) ];
+    }
+    inline void clear() { head = 0; }
+
+    bus_access_t log[CAPACITY];
+    uint32_t head{0};
+    uint8_t  data_bus{0};
+};
+
+#else
+
+struct bus_trace_t
+{
+    inline void record( uint32_t, uint16_t, uint8_t value, bool ) { data_bus = value; }
+    inline void rewrite( uint32_t, uint8_t value ) { data_bus = value; }
+    inline uint8_t open_bus() const { return data_bus; }
+    inline void clear() {}
+
+    uint8_t data_bus{0};
+};
+
+#endif /* BUS_TRACE */
+
+} // nes
+
+#endif /* BUS_TRACE_HPP */
@@ -0,0 +1,92 @@
+#ifndef DIRTY_PAGES_HPP
+#define DIRTY_PAGES_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nes
+{
+
+/*
+*   Pages of the instance state written since the last incremental snapshot,
+*   one bit per 256 bytes. Only the large memories are tracked: internal RAM,
+*   palette, VRAM and OAM, PRG-RAM and CHR-RAM, marked by mem_t and the mapper
+*   on every write. Pages holding anything else (the CPU, PPU and APU, mapper
+*   registers) are copied by every incremental snapshot.
+*
+*   mark() is a compare and a bit set. Writes outside the state (the battery
+*   save file) and writes before attach() land out of range and are ignored.
+*   With NO_DIRTY_PAGES defined marking compiles away and every page is
+*   copied, incremental snapshots become full ones.
+*/
+
+struct dirty_pages_t
+{
+    static constexpr uint32_t PAGE_SHIFT = 8;
+    static constexpr size_t   PAGE_SIZE  = (size_t)1 << PAGE_SHIFT;
+
+    static inline size_t words_for( size_t bytes )
+    {
+        return (((bytes + PAGE_SIZE - 1) >> PAGE_SHIFT) + 63) / 64;
+    }
+
+    // Storage holds 2 * words_for( state_bytes ) words, everything starts dirty
+    inline void attach( const uint8_t* state, size_t state_bytes, uint64_t* storage )
+    {
+        base = state;
+        pages = (state_bytes + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        words = words_for( state_bytes );
+        written = storage;
+        always = storage + words;
+        mark_all();
+        for (size_t i = 0; i < words; ++i) always[i] = written[i];
+    }
+
+    inline void mark_all()
+    {
+        for (size_t i = 0; i < words; ++i) written[i] = 0;
+        for (size_t page = 0; page < pages; ++page) written[page / 64] |= 1ull << (page % 64);
+    }
+
+#if defined(NO_DIRTY_PAGES)
+
+    inline void track( const void*, size_t ) {}
+    inline void mark( const void* ) {}
+    inline void mark( const void*, size_t ) {}
+
+#else
+
+    // Pages entirely inside data are only copied once marked
+    inline void track( const void* data, size_t bytes )
+    {
+        const size_t offset = (const uint8_t*)data - base;
+        size_t page = (offset + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        const size_t end = (offset + bytes) >> PAGE_SHIFT;
+        for (; page < end && page < pages; ++page) always[page / 64] &= ~(1ull << (page % 64));
+    }
+
+    inline void mark( const void* data )
+    {
+        const size_t page = ((uintptr_t)data - (uintptr_t)base) >> PAGE_SHIFT;
+        if (page < pages) written[page / 64] |= 1ull << (page % 64);
+    }
+
+    inline void mark( const void* data, size_t bytes )
+    {
+        mark( data );
+        mark( (const uint8_t*)data + bytes - 1 );
+        for (size_t offset = PAGE_SIZE; offset < bytes; offset += PAGE_SIZE) mark( (const uint8_t*)data + offset );
+    }
+
+#endif /* NO_DIRTY_PAGES */
+
+    const uint8_t* base{nullptr};
+    size_t    pages{0};
+    size_t    words{0};
+    uint64_t* written{nullptr}; // Since the last incremental snapshot
+    uint64_t* always{nullptr};  // Untracked pages
+};
+
+} // nes
+
+#endif /* DIRTY_PAGES_HPP */
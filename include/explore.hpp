@@ -0,0 +1,74 @@
+#ifndef EXPLORE_HPP
+#define EXPLORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+/*
+*   Branches an instance into child processes for input search. Every
+*   branch is a fork() of the process, the arena (the whole instance) is
+*   shared copy-on-write, so branching costs the same for any state size and
+*   only the pages a child writes are copied. Children run the branch
+*   callback with their branch index and write what it returns to a table
+*   in shared memory, the parent instance is never touched.
+*
+*   Other threads don't exist in a child. Children never use the audio
+*   backend, the battery save file (their RAM is a private copy) or a movie,
+*   and leave with _exit(). Fork from a process without other threads
+*   touching the instance. Not available on Windows.
+*/
+
+struct explore_result_t
+{
+    enum STATUS : uint32_t
+    {
+        STATUS_PENDING,
+        STATUS_DONE,
+        STATUS_FAILED // Threw, crashed or was never started
+    };
+
+    uint32_t status;
+    uint32_t frames;  // Frames the branch ran
+    int64_t  score;   // Returned by the branch
+    uint64_t ram_hash;
+    uint64_t run_ns;
+};
+
+struct explorer_t
+{
+    // Runs in the child, `frames` is filled in from the frame count
+    typedef int64_t (* branch_t)( emu_t& emu, uint32_t branch, void* cookie );
+
+    ~explorer_t();
+
+    // Shared results table for up to max_branches
+    bool open( uint32_t max_branches );
+    void close();
+
+    // Forks `count` branches off the instance as it is, at most `parallel`
+    // at a time, and waits for all of them
+    bool explore( emu_t& emu, uint32_t count, uint32_t parallel, branch_t branch, void* cookie );
+
+    const explore_result_t& operator[]( uint32_t branch ) const { return results[branch]; }
+
+    double fork_us() const { return forks ? fork_ns / 1000.0 / forks : 0.0; }
+    double fork_max_us() const { return fork_max_ns / 1000.0; }
+
+private:
+    explore_result_t* results{nullptr};
+    size_t   results_bytes{0};
+    uint32_t capacity{0};
+
+    uint64_t forks{0};
+    uint64_t fork_ns{0};
+    uint64_t fork_max_ns{0};
+};
+
+} // nes
+
+#endif /* EXPLORE_HPP */
@@ -14,6 +14,7 @@ enum LOG_LEVEL
 };
 
 void _log(LOG_LEVEL level, const char* buffer, ...);
+extern bool log_info_muted; // Silences LOG_I, e.g. while benchmarking
 
 #ifdef DEBUG 
     #define LOG_D(...) _log(nes::L_DEBUG, __VA_ARGS__)
@@ -1,6 +1,7 @@
 #ifndef MAPPERS_HPP
 #define MAPPERS_HPP
 
+#include <cstddef>
 #include <cstdint>
 
 #include "nes.hpp"
@@ -8,13 +9,24 @@
 namespace nes
 {
 
+constexpr uint32_t PRG_16KB_SIZE = 16 * 1024;
+constexpr uint32_t PRG_8KB_SIZE = 8 * 1024;
 constexpr uint32_t CHR_8KB_SIZE = 8 * 1024;
 constexpr uint32_t CHR_4KB_SIZE = 4 * 1024;
+constexpr uint32_t CHR_1KB_SIZE = 1 * 1024;
 
-extern mapper_t* mappers_lut[256];
-void instantiate_mappers();
+constexpr uint16_t MAPPER_COUNT = 4096; // NES 2.0 12-bit mapper numbers
+constexpr size_t MAPPER_STORAGE_SIZE = 128;
+
+// Mappers are constructed in place, storage is MAPPER_STORAGE_SIZE bytes
+// in the emulator arena and the caller destroys the mapper
+typedef mapper_t* (* mapper_factory_t)( void* storage );
+extern mapper_factory_t mappers_lut[MAPPER_COUNT];
+void register_mappers();
+mapper_t* create_mapper( uint16_t identifier, void* storage ); // nullptr if unimplemented
 /*
-*   NOTE: Instantiate each implemented mapper in the emu_t::init()
+*   NOTE: Register each implemented mapper in register_mappers(),
+*         every emulator instance creates its own mapper
 */
 
 //////// mapper 000 - NROM
@@ -23,6 +35,7 @@ struct mapper_nrom_t : public mapper_t { };
 //////// mapper 001 - MMC1B
 struct mapper_mmc1b_t : public mapper_t {
     void cpu_write( uint16_t address, uint8_t value ) override;
+    void state_fields( state_section_t& section ) override;
 
     uint8_t prg_bank_mode{3};
     uint8_t chr_bank_mode{0};
@@ -37,9 +50,31 @@ struct mapper_uxrom_t : public mapper_t {
     void cpu_write( uint16_t address, uint8_t value ) override;
 };
 
+//////// mapper 003 - CNROM
+struct mapper_cnrom_t : public mapper_t {
+    void cpu_write( uint16_t address, uint8_t value ) override;
+};
+
 //////// mapper 004 - MMC3
 struct mapper_mmc3_t : public mapper_t {
+    void init( mem_t* memory_ref ) override;
+    uint8_t cpu_read( uint16_t address ) override;
     void cpu_write( uint16_t address, uint8_t value ) override;
+    uint8_t ppu_snoop() const override;
+    void ppu_a12_rise() override;
+    void state_fields( state_section_t& section ) override;
+    void update_banks();
+
+    uint8_t bank_select{0};
+    uint8_t registers[8]{0};    // R0 - R7
+
+    bool prg_ram_enabled{true};
+    bool prg_ram_write_protect{false};
+
+    uint8_t irq_latch{0};
+    uint8_t irq_counter{0};
+    bool    irq_reload{false};
+    bool    irq_enabled{false};
 };
 
 //////// mapper 007 - AxROM
@@ -48,6 +83,81 @@ struct mapper_axrom_t : public mapper_t {
     void cpu_write( uint16_t address, uint8_t value ) override;
 };
 
+//////// mapper 009 - MMC2
+struct mapper_mmc2_t : public mapper_t {
+    void init( mem_t* memory_ref ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+    uint8_t ppu_snoop() const override;
+    void ppu_pattern_fetch( uint16_t address ) override;
+    void state_fields( state_section_t& section ) override;
+    virtual void map_prg( uint8_t value );
+    void update_chr();
+
+    uint8_t chr_registers[4]{0};    // $0000 FD, $0000 FE, $1000 FD, $1000 FE
+    uint8_t latch[2]{1, 1};         // Per pattern table, 0 = FD, 1 = FE
+    bool    exact_lower_latch{true};
+};
+
+//////// mapper 010 - MMC4
+struct mapper_mmc4_t : public mapper_mmc2_t {
+    void init( mem_t* memory_ref ) override;
+    void map_prg( uint8_t value ) override;
+};
+
+//////// mapper 011 - Color Dreams
+struct mapper_color_dreams_t : public mapper_t {
+    void init( mem_t* memory_ref ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+};
+
+//////// mapper 021, 022, 023, 025 - VRC2 / VRC4
+struct mapper_vrc_t : public mapper_t {
+    mapper_vrc_t( uint16_t mapper_number );
+
+    void init( mem_t* memory_ref ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+    bool cpu_clocked() const override;
+    void cpu_clock() override;
+    void state_fields( state_section_t& section ) override;
+    void update_banks();
+
+    // Boards wire the register select lines to different CPU address lines,
+    // a0_lines / a1_lines are the address bits ORed into register bit 0 / 1
+    uint16_t number;
+    uint16_t a0_lines{0};
+    uint16_t a1_lines{0};
+    bool     chr_shift{false};      // VRC2a ignores the lowest CHR bank bit
+    bool     vrc2{false};           // No PRG swap, one mirroring bit and no IRQ
+
+    uint8_t  prg_registers[2]{0};
+    uint16_t chr_registers[8]{0};
+    bool     prg_swap{false};
+
+    uint8_t  irq_latch{0};
+    uint8_t  irq_counter{0};
+    int16_t  irq_prescaler{0};
+    bool     irq_enabled{false};
+    bool     irq_enable_after_ack{false};
+    bool     irq_cycle_mode{false};
+};
+
+//////// mapper 034 - BNROM / NINA-001
+struct mapper_bnrom_t : public mapper_t {
+    void init( mem_t* memory_ref ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+};
+
+//////// mapper 066 - GxROM
+struct mapper_gxrom_t : public mapper_t {
+    void init( mem_t* memory_ref ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+};
+
+//////// mapper 071 - Camerica
+struct mapper_camerica_t : public mapper_t {
+    void cpu_write( uint16_t address, uint8_t value ) override;
+};
+
 //////// mapper 094 - UN1ROM
 struct mapper_un1rom_t : public mapper_t {
     void cpu_write( uint16_t address, uint8_t value ) override;
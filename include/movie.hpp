@@ -0,0 +1,87 @@
+#ifndef MOVIE_HPP
+#define MOVIE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+/*
+*   Input movies. Every controller latch (the $4016 strobe going low) is
+*   recorded with the values of both pads, grouped by frame, so games that
+*   poll more than once a frame replay exactly. Replay feeds the recorded
+*   values back at the same latches.
+*
+*   The movie starts from a save state and one is kept every STATE_INTERVAL
+*   frames, seek() loads the nearest one before the target and emulates the
+*   rest. Playing a movie without them (FM2) keeps them as it goes.
+*
+*   File layout, all values little endian:
+*
+*     header  magic "NESM", version, mapper, PRG + CHR CRC32, frame count,
+*             run count, state count, flags
+*     runs    frames in the run, latches per frame, two pad bytes per latch.
+*             A run is consecutive frames with the same latches
+*     states  frame, size in bytes, save state
+*
+*   FM2 movies (FCEUX, text only) are imported with one input per frame,
+*   used for every latch in that frame. Resets and the ROM checksum are
+*   ignored, the movie has to be for the ROM it's played with.
+*/
+struct movie_t
+{
+    static constexpr uint32_t STATE_INTERVAL = 600; // 10 seconds
+
+    ~movie_t();
+
+    // Records from the current state of the instance on
+    void record( emu_t& emu );
+
+    // Native movies or FM2, by content
+    bool load( const char* filepath );
+    bool save( const char* filepath ) const;
+
+    // Attaches to the instance and loads the starting state
+    void play( emu_t& emu );
+    void seek( uint32_t target_frame );
+    void detach();
+
+    uint32_t frames() const { return (uint32_t)frame_start.size() - 1; }
+    bool finished() const { return frame >= frames(); }
+
+    // Hooks, called by the emulator on a controller latch and after a frame
+    void latch( gamepad_t* pads );
+    void end_frame();
+
+    uint32_t frame{0};   // Frames since the start of the movie
+    uint32_t desyncs{0}; // Frames that latched a different number of times than recorded
+
+private:
+    struct state_t
+    {
+        uint32_t frame;
+        std::vector<uint8_t> data;
+    };
+
+    void capture_state();
+    bool parse( const uint8_t* data, size_t size );
+    bool parse_fm2( const char* text, size_t size );
+
+    emu_t*   emu{nullptr};
+    bool     recording{false};
+    bool     per_frame{false}; // One input for all latches of a frame (FM2)
+    uint32_t cursor{0};        // Latches seen in the current frame
+    uint16_t mapper{0};
+    uint32_t crc32{0};
+
+    std::vector<uint8_t>  latches{};          // Both pads per latch
+    std::vector<uint32_t> frame_start{ 0 };   // First latch of every frame, and the end
+    std::vector<state_t>  states{};           // Ordered by frame
+};
+
+} // nes
+
+#endif /* MOVIE_HPP */
@@ -2,8 +2,13 @@
 #define NES_HPP
 
 #include <cstdint>
+#include <memory>
+#include <string>
 
 #include "apu.hpp"
+#include "arena.hpp"
+#include "bus_trace.hpp"
+#include "dirty_pages.hpp"
 
 namespace nes
 {
@@ -14,12 +19,15 @@ namespace nes
 constexpr uint32_t PRG_PAGE_SIZE = 16 * 1024;
 constexpr uint32_t CHR_PAGE_SIZE = 8 * 1024;
 
+#define BATTERY_PAGE_SHIFT 12 // PRG-RAM dirty tracking granularity, 4KB
+
 #define BIT_CHECK_HI(value, bit) (((value >> bit) & 0x1) == 0x1)
 #define BIT_CHECK_LO(value, bit) (((value >> bit) & 0x1) == 0x0)
 #define UINT16(LO, HI) (((uint16_t) HI << 8) | LO)
 
 enum RESULT
 {
+    RESULT_INVALID_NSF_HEADER  = -11,
     RESULT_INVALID_INES_HEADER = -10,
 
     RESULT_MFB_ERROR           = -3,
@@ -34,6 +42,7 @@ inline const char* RESULT_to_string(RESULT v)
 {
     switch (v)
     {
+        case RESULT_INVALID_NSF_HEADER:     return "[Invalid NSF Header]";
         case RESULT_INVALID_INES_HEADER:    return "[Invalid iNES Header]";
         case RESULT_MFB_ERROR:              return "[MFB Error]";
         case RESULT_INVALID_ARGUMENTS:      return "[Invalid Arguments]";
@@ -50,14 +59,56 @@ struct ppu_t;
 struct apu_t;
 struct ines_rom_t;
 struct mem_t;
+struct audio_t;
+struct battery_ram_t;
+struct movie_t;
+struct state_section_t;
 
 struct mapper_t {
     mem_t* memory{nullptr};
+    uint8_t submapper{0}; // NES 2.0, set before init
+    virtual ~mapper_t() = default;
     virtual void init( mem_t* memory );
     virtual uint8_t cpu_read( uint16_t address );
-    virtual uint8_t ppu_read( uint16_t address );
     virtual void cpu_write( uint16_t address, uint8_t value );
     virtual void ppu_write( uint16_t address, uint8_t value );
+    uint8_t ppu_read( uint16_t address ); // Pattern fetches read the CHR windows directly
+
+    // PPU bus snooping is opt-in, mem_t resolves ppu_snoop() once after init
+    // so mappers without it pay nothing on pattern fetches
+    enum PPU_SNOOP
+    {
+        SNOOP_NONE    = 0,
+        SNOOP_A12     = 1 << 0, // ppu_a12_rise() on filtered A12 rising edges
+        SNOOP_PATTERN = 1 << 1  // ppu_pattern_fetch() after every pattern table read
+    };
+    virtual uint8_t ppu_snoop() const;
+    virtual void ppu_a12_rise();
+    virtual void ppu_pattern_fetch( uint16_t address );
+
+    // Per CPU cycle clock for cycle based IRQ counters, opt-in like the PPU snoop
+    virtual bool cpu_clocked() const;
+    virtual void cpu_clock();
+
+    // Registers for save states, see savestate.hpp. Bank windows are saved
+    // for every mapper, only registers the windows don't show are listed
+    virtual void state_fields( state_section_t& section );
+
+    // PRG bank switching, banks are counted in units of the window size
+    // and wrap around the available PRG ROM
+    void map_prg_8kb( uint8_t window, uint32_t bank );
+    void map_prg_16kb( uint8_t window, uint32_t bank );
+    void map_prg_32kb( uint32_t bank );
+    uint32_t prg_8kb_banks() const;
+    uint32_t prg_16kb_banks() const;
+
+    // CHR bank switching, banks are counted in units of the window size
+    // and wrap around the available CHR ROM or RAM
+    void map_chr_1kb( uint8_t window, uint32_t bank );
+    void map_chr_2kb( uint8_t window, uint32_t bank );
+    void map_chr_4kb( uint8_t window, uint32_t bank );
+    void map_chr_8kb( uint32_t bank );
+    uint32_t chr_1kb_banks() const;
 };
 
 struct gamepad_t
@@ -106,13 +157,6 @@ struct cpu_mem_t
 
     // $4018 – $401F
     uint8_t* cpu_test_mode{nullptr}; 
-
-    struct bus_activity_t
-    {
-        uint16_t address;
-        uint8_t  value;
-        bool     read;
-    } activity;
 };
 
 union oam_t
@@ -178,39 +222,41 @@ struct ppu_mem_t
 struct cartridge_mem_t
 {
     // PPU: $0000 - $1FFF
-    union chr_rom_t
-    { 
-        struct __attribute__((packed))
-        { // 1KB banked windows
-            uint8_t chr_bank_1kb_0[0x0400]; // PPU: $0000 - $03FF (1KB)
-            uint8_t chr_bank_1kb_1[0x0400]; // PPU: $0400 - $07FF (1KB)
-            uint8_t chr_bank_1kb_2[0x0400]; // PPU: $0800 - $0BFF (1KB)
-            uint8_t chr_bank_1kb_3[0x0400]; // PPU: $0C00 - $0FFF (1KB)
-            uint8_t chr_bank_1kb_4[0x0400]; // PPU: $1000 - $13FF (1KB)
-            uint8_t chr_bank_1kb_5[0x0400]; // PPU: $1400 - $17FF (1KB)
-            uint8_t chr_bank_1kb_6[0x0400]; // PPU: $1800 - $1BFF (1KB)
-            uint8_t chr_bank_1kb_7[0x0400]; // PPU: $1C00 - $1FFF (1KB)
-        };
-        struct __attribute__((packed))
-        { // 2KB banked windows
-            uint8_t chr_bank_2kb_0[0x0800]; // PPU: $0000 - $07FF (2KB)
-            uint8_t chr_bank_2kb_1[0x0800]; // PPU: $0800 - $0FFF (2KB)
-            uint8_t chr_bank_2kb_2[0x0800]; // PPU: $1000 - $17FF (2KB)
-            uint8_t chr_bank_2kb_3[0x0800]; // PPU: $1800 - $1FFF (2KB)
-        };
-        struct __attribute__((packed))
-        { // 4KB banked windows
-            uint8_t chr_bank_4kb_lower[0x1000]; // PPU: $0000 - $0FFF (4KB)
-            uint8_t chr_bank_4kb_upper[0x1000]; // PPU: $1000 - $1FFF (4KB)
-        };
-        uint8_t chr_bank_8kb[0x2000];
-    } chr_rom;
-
-    // CPU: $4020 - $FFFF
-    uint8_t expansion_rom[0x1FE0];    // CPU: $4020 - $5FFF
-    uint8_t sram[0x2000];             // CPU: $6000 - $7FFF
-    uint8_t* prg_lower_bank;          // CPU: $8000 - $BFFF
-    uint8_t* prg_upper_bank;          // CPU: $C000 - $FFFF
+    // Eight 1KB windows into CHR ROM (ines_rom_t::chr_pages) or chr_ram,
+    // retargeted by the mapper on bank switches
+    uint8_t* chr_banks[8]{nullptr};
+    uint8_t* chr_ram{nullptr};        // CHR-RAM followed by CHR-NVRAM, sized from the header
+    uint32_t chr_ram_size{0};
+    bool     chr_writable{false};
+
+    // CPU: $4020 - $FFFF, nothing is mapped at $4020 - $5FFF unless the mapper does it
+    uint8_t* prg_ram{nullptr};        // PRG-RAM followed by PRG-NVRAM, sized from the header
+    uint32_t prg_ram_size{0};
+    uint8_t* sram{nullptr};           // CPU: $6000 - $7FFF, prg_ram or the battery save file
+    uint16_t sram_mask{0};            // Mirrors RAM smaller than 8KB, 0 without RAM
+    uint32_t sram_dirty{0};           // Pages (BATTERY_PAGE_SHIFT) written since the last battery flush
+    const uint8_t* prg_banks[4]{nullptr}; // CPU: $8000 - $FFFF, four 8KB windows, nullptr when
+                                          // the mapper banks finer (NSF) and is read through cpu_read
+
+    // Read-modify-write instructions on ROM or unmapped space operate on a copy,
+    // the ROM image itself is read-only
+    uint8_t scratch{0};
+
+    // RAM comes from the emulator arena, see mem_t::arena_bytes
+    void allocate( arena_t& arena, uint32_t prg_ram_bytes, uint32_t chr_ram_bytes );
+    void map_sram( uint8_t* ram );
+
+    inline uint8_t read_sram( uint16_t offset ) const
+    {
+        return sram[ offset & sram_mask ];
+    }
+
+    inline void write_sram( uint16_t offset, uint8_t value )
+    {
+        offset &= sram_mask;
+        sram[ offset ] = value;
+        sram_dirty |= 1u << (offset >> BATTERY_PAGE_SHIFT);
+    }
 };
 
 struct apu_mem_t
@@ -229,17 +275,61 @@ struct mem_t
     apu_t* apu;
     apu_mem_t apu_mem;
 
-    ines_rom_t* ines_rom;
+    const ines_rom_t* ines_rom{nullptr};
     cartridge_mem_t cartridge_mem;
 
     mapper_t* mapper;
+    mapper_t* owned_mapper{nullptr}; // Constructed in the arena for the iNES image, nullptr for NSF
+    battery_ram_t* battery{nullptr}; // Save file for battery-backed PRG-RAM
+    movie_t* movie{nullptr};         // Input movie being recorded or played, see movie.hpp
 
     gamepad_t gamepad[2];
     uint8_t   gamepad_strobe{0};
     uint32_t  cpu_cycles{0};
+    bus_trace_t cpu_bus; // See bus_trace.hpp
+    dirty_pages_t dirty; // Pages written since the last incremental snapshot, see dirty_pages.hpp
 
     uint8_t*  memory_hook{nullptr};
 
+    // Cartridge IRQ line, ORed with the APU interrupts
+    bool      cartridge_irq{false};
+
+    // Hands PRG-RAM written during the frame to the battery writer
+    inline void end_frame()
+    {
+        if (battery && cartridge_mem.sram_dirty) flush_battery( cartridge_mem.sram_dirty );
+        cartridge_mem.sram_dirty = 0;
+    }
+    void flush_battery( uint32_t pages );
+    void shadow_battery(); // RAM runs from prg_ram, written pages are copied to the file on flush
+    void detach_battery(); // Keeps the RAM contents, stops saving them
+
+    // Mappers snooping the PPU bus, see mapper_t::PPU_SNOOP
+    mapper_t* pattern_mapper{nullptr};
+
+    // Mapper clocked every CPU cycle, see mapper_t::cpu_clocked
+    mapper_t* clocked_mapper{nullptr};
+
+    // PPU A12 rising edges, filtered like the MMC3 does (low for 3+ CPU cycles)
+    mapper_t* a12_mapper{nullptr};
+    bool      ppu_a12{false};
+    uint32_t  ppu_a12_low_cycle{0};
+
+    inline void track_ppu_a12( uint16_t address )
+    {
+        bool a12 = (address & 0x1000) != 0;
+        if ( a12 == ppu_a12 ) return;
+        ppu_a12 = a12;
+        if ( !a12 )
+        {
+            ppu_a12_low_cycle = cpu_cycles;
+        }
+        else if ( cpu_cycles - ppu_a12_low_cycle >= 3 )
+        {
+            a12_mapper->ppu_a12_rise();
+        }
+    }
+
     enum MEMORY_BUS
     {
         CPU,
@@ -247,8 +337,13 @@ struct mem_t
         APU
     };
 
-    virtual ~mem_t() = default;
-    virtual void init( ines_rom_t &rom );
+    virtual ~mem_t();
+    virtual void init( const ines_rom_t &rom, arena_t& arena, bool save_file );
+    virtual void init( mapper_t* cartridge_mapper, arena_t& arena ); // Cartridges without an iNES image (NSF)
+    void attach_mapper( mapper_t* cartridge_mapper );
+
+    // Arena space init() takes for the mapper and cartridge RAM, rom is nullptr for NSF
+    static size_t arena_bytes( const ines_rom_t* rom );
 
     virtual uint8_t* fetch_byte_ref( uint16_t address );
 
@@ -314,12 +409,13 @@ struct cpu_t
     cpu_callback_t cpu_callback{nullptr};
     cpu_callback_t ppu_callback{nullptr};
     cpu_callback_t apu_callback{nullptr};
+    void* callback_cookie{nullptr};
 
     mem_t* memory{nullptr};
     
     void tick_clock();
     void tick_clock( uint16_t cycles );
-    void init(cpu_callback_t cpu_cb, cpu_callback_t ppu_cb, cpu_callback_t apu_cb, mem_t* mem);
+    void init(cpu_callback_t cpu_cb, cpu_callback_t ppu_cb, cpu_callback_t apu_cb, mem_t* mem, void* cookie);
     void irq(); // Also NMI
     uint16_t execute();
     void     pre_inc_stack();
@@ -351,24 +447,71 @@ struct ines_rom_t
         uint8_t chr_size;   // Size of CHR ROM in 8 KB units (8192 * y bytes) (value 0 means the board uses CHR RAM)
         uint8_t flags_6;    // Mapper, mirroring, battery, trainer
         uint8_t flags_7;    // Mapper, VS/Playchoice, NES 2.0
-        uint8_t flags_8;    // PRG-RAM size (rarely used extension)
-        uint8_t flags_9;    // TV system (rarely used extension)
-        uint8_t flags_10;   // TV system, PRG-RAM presence (unofficial, rarely used extension)
-        uint8_t padding[5]; // Unused padding
+        uint8_t flags_8;    // PRG-RAM size (rarely used extension), NES 2.0: mapper MSB, submapper
+        uint8_t flags_9;    // TV system (rarely used extension), NES 2.0: PRG/CHR ROM size MSB
+        uint8_t flags_10;   // TV system, PRG-RAM presence (unofficial, rarely used extension), NES 2.0: PRG-RAM/NVRAM size
+        uint8_t flags_11;   // NES 2.0: CHR-RAM/NVRAM size
+        uint8_t flags_12;   // NES 2.0: CPU/PPU timing
+        uint8_t padding[3]; // Unused padding
     } header;
 
-    // Data is stored in pages, each page 16KB (16 * 1024 * x bytes)
-    uint8_t** prg_pages{nullptr};
-    uint8_t** chr_pages{nullptr};
+    enum TIMING
+    {
+        TIMING_NTSC  = 0,
+        TIMING_PAL   = 1,
+        TIMING_MULTI = 2,
+        TIMING_DENDY = 3
+    };
+
+    // Resolved from the iNES 1.0 or NES 2.0 header, sizes in bytes
+    bool     nes2{false};
+    uint16_t mapper{0};
+    uint8_t  submapper{0};
+    uint32_t prg_rom_size{0};
+    uint32_t chr_rom_size{0};
+    uint32_t prg_ram_size{0};
+    uint32_t prg_nvram_size{0};
+    uint32_t chr_ram_size{0};
+    uint32_t chr_nvram_size{0};
+    uint8_t  timing{TIMING_NTSC};
+    const uint8_t* trainer{nullptr}; // 512 bytes for $7000 - $71FF, nullptr if absent
+
+    std::string filepath; // Save files are named after it, empty when loaded from data
+
+    // PRG + CHR checksums, header overrides come from rom_db when the dump is known
+    uint32_t crc32{0};
+    bool     db_match{false};
+
+    // Pages are read-only views into image, PRG pages 16KB and CHR pages 8KB
+    const uint8_t** prg_pages{nullptr};
+    const uint8_t** chr_pages{nullptr};
+
+    // Whole file, memory-mapped when the platform allows it so instances
+    // running the same ROM share its pages through the page cache
+    uint8_t* image{nullptr};
+    uint32_t image_size{0};
+    bool     image_mapped{false};
 
     ~ines_rom_t();
 
     void clear_contents();
     void construct_empty();
-    void load_from_file(const char* filepath);
+    void load_from_file(const char* path); // .nes, .gz or .zip ("roms.zip#Game.nes" picks an entry)
     void load_from_data(const uint8_t* data, const uint32_t size);
+
+private:
+    void extract_archive(const std::string& archive_path, const char* entry_name);
+    void map_pages();
+    void parse_header();
+    void apply_db_overrides();
 };
 
+// Immutable ROM image shared between emulator instances, the image is
+// released with its last reference. Loading a path that is still
+// referenced returns the existing image.
+typedef std::shared_ptr<const ines_rom_t> shared_rom_t;
+shared_rom_t load_shared_rom( const char* filepath );
+
 struct ppu_t
 {
 
@@ -498,6 +641,11 @@ struct ppu_t
     bool render_sp_leftmost{false};
     bool recently_power_on{false};
     bool vblank_suppression{false};
+    bool old_nmi_enable{false};
+    bool allow_nmi{false};
+    uint8_t nmi_unstable{0};
+    uint8_t ppumask_history[8]{0x00};
+    uint8_t ppumask_history_index{0};
     render_states render_state{render_states::pre_render_scanline};
     uint32_t frame_num{0};
     uint8_t  sprite_indices_next_scanline[8];
@@ -526,21 +674,65 @@ struct ppu_t
 
 struct emu_t
 {
-    cpu_t cpu;
-    ppu_t ppu;
-    apu_t apu;
+    // All state lives in one arena block owned by the instance: CPU, PPU,
+    // APU and memory first, then the mapper and cartridge RAM, with the
+    // framebuffers last so snapshots can leave them out
+    cpu_t* cpu{nullptr};
+    ppu_t* ppu{nullptr};
+    apu_t* apu{nullptr};
     mem_t* memory{nullptr};
+    audio_t* audio{nullptr}; // Not owned, nullptr runs without audio
+    shared_rom_t rom;        // Keeps a shared image alive, empty for caller owned ROMs
+    bool save_file{true};    // Set before init, false runs battery RAM on a copy and never writes the .sav
 
     uint32_t* front_buffer{nullptr};
     uint32_t* back_buffer{nullptr};
 
     ~emu_t();
 
-    void init(ines_rom_t &rom);
-    void init_testsuite(void* validator);
+    void init(const ines_rom_t &rom, audio_t* audio_backend);
+    void init(const shared_rom_t& shared_rom, audio_t* audio_backend);
+    void init_nsf(mapper_t* nsf_mapper, audio_t* audio_backend);
+    void init_testsuite();
+    void release();
     void swap_framebuffers();
+
+    // Snapshots copy the state part of the arena as-is and are only valid
+    // for the instance that took them. The ROM, battery save file and the
+    // NSF mapper live outside the arena and aren't part of a snapshot.
+    size_t snapshot_size() const { return state_size; }
+    void snapshot( uint8_t* out ) const;
+    void restore( const uint8_t* in );
+
+    // Incremental snapshot into `out`, which holds the previous one of this
+    // instance: only pages written since then are copied. The pages copied
+    // are left in `pages` (dirty_page_words() words) when given. There can
+    // be one caller per instance, restore() dirties the pages it changes and
+    // load_state() every page.
+    void snapshot_dirty( uint8_t* out, uint64_t* pages = nullptr );
+    size_t dirty_page_words() const { return memory->dirty.words; }
+
+    // Versioned save states (savestate.hpp) load into any instance running
+    // the same ROM, also one built from a different version of the emulator.
+    // save_state_size() is exact, save_state() returns the bytes written.
+    // Invalid states or states of another ROM throw RESULT_ERROR.
+    size_t save_state_size() const;
+    size_t save_state( uint8_t* out ) const;
+    void   load_state( const uint8_t* in, size_t size );
+
     RESULT step_cycles(int32_t cycles);
     uint16_t step_vblank();
+    bool step_instruction(); // True when the instruction finished a frame
+
+private:
+    void flip_frame();
+    void reserve_state( size_t mem_size, size_t cartridge_bytes );
+    void attach_framebuffers();
+    void attach_dirty_pages();
+
+    arena_t   arena;
+    uint32_t* framebuffers{nullptr}; // Front and back, after the snapshot state
+    size_t    state_size{0};
 };
 
 } // nes
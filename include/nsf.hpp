@@ -0,0 +1,84 @@
+#ifndef NSF_HPP
+#define NSF_HPP
+
+#include <cstdint>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+constexpr uint32_t NSF_BANK_SIZE = 4 * 1024;
+
+struct nsf_t
+{
+    struct __attribute__((packed)) header_t
+    { // 128 bytes
+        uint8_t  magic[5];            // ASCII "NESM" followed by MS-DOS end-of-file
+        uint8_t  version;
+        uint8_t  total_songs;
+        uint8_t  starting_song;       // 1 based
+        uint16_t load_address;
+        uint16_t init_address;
+        uint16_t play_address;
+        char     song_name[32];
+        char     artist[32];
+        char     copyright[32];
+        uint16_t ntsc_speed;          // Play rate in 1/1000000 sec ticks
+        uint8_t  bankswitch_init[8];  // All zero = no bankswitching
+        uint16_t pal_speed;
+        uint8_t  region;              // Bit 0: PAL, bit 1: dual PAL/NTSC
+        uint8_t  extra_sound_chip;
+        uint8_t  padding[4];
+    } header;
+
+    // Program data padded to 4KB banks, as seen by the $5FF8 - $5FFF bank registers
+    uint8_t* banks{nullptr};
+    uint32_t bank_count{0};
+    uint8_t  bank_init[8]{0};
+    bool     bankswitched{false};
+
+    ~nsf_t();
+
+    static bool is_nsf_file(const char* filepath);
+    void clear_contents();
+    void load_from_file(const char* filepath);
+    void load_from_data(const uint8_t* data, const uint32_t size);
+};
+
+//////// NSF - 8 x 4KB banks at $8000 - $FFFF, bank registers at $5FF8 - $5FFF
+struct mapper_nsf_t : public mapper_t {
+    nsf_t* nsf{nullptr};
+    uint8_t* prg_banks[8]{nullptr};
+
+    void init( mem_t* memory_ref ) override;
+    uint8_t cpu_read( uint16_t address ) override;
+    void cpu_write( uint16_t address, uint8_t value ) override;
+    void reset_banks();
+};
+
+/*
+*   Drives INIT/PLAY on the CPU core. The PPU is not clocked at all, so
+*   offline rendering runs as fast as the CPU and APU allow.
+*/
+struct nsf_player_t
+{
+    void init( emu_t* emu_ref, nsf_t* nsf_ref, audio_t* audio );
+    void start_track( uint8_t track ); // 0 based
+    void play_frame();
+    uint64_t render( uint32_t seconds ); // Returns CPU cycles executed
+
+    uint32_t play_period{29780}; // CPU cycles between PLAY calls
+    uint8_t  track{0};
+
+private:
+    uint32_t call_routine( uint16_t address, uint32_t max_cycles );
+
+    emu_t* emu{nullptr};
+    nsf_t* nsf{nullptr};
+    mapper_nsf_t mapper;
+};
+
+} // nes
+
+#endif /* NSF_HPP */
@@ -0,0 +1,128 @@
+#ifndef REWIND_HPP
+#define REWIND_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+/*
+*   Rewind history. After every frame the emulation thread copies the pages
+*   written since the last push (emu_t::snapshot_dirty) into a free slot and
+*   hands it to a worker thread. The worker fills in the other pages from the
+*   newest stored state and stores the XOR
+*   against the previous snapshot, run-length encoded, in a fixed size ring.
+*   Every KEYFRAME_INTERVAL frames a snapshot is stored on its own, the ring
+*   drops the oldest keyframe and its deltas when it runs full. push() never
+*   waits, a frame the worker has no slot for is skipped.
+*
+*   step_back() runs on the emulation thread. XOR works both ways, so undoing
+*   the newest delta gives the state before it. Stepping back over a keyframe
+*   replays the group before it from its keyframe.
+*
+*   The battery save file lives outside the arena. While the history is
+*   open PRG-RAM runs from the arena (mem_t::shadow_battery) so it's rewound
+*   with everything else, and the file follows it.
+*/
+
+struct rewind_stats_t
+{
+    uint32_t frames{0};        // States in the history
+    uint32_t keyframes{0};
+    size_t   stored_bytes{0};  // Encoded states in the ring
+    size_t   memory_bytes{0};  // Ring and snapshot slots
+    uint64_t skipped{0};       // Frames the worker had no slot for
+    double   push_us{0.0};     // Emulation thread, per frame
+    double   push_bytes{0.0};  // Copied per frame
+    double   encode_us{0.0};   // Worker thread, per frame
+    double   encode_max_us{0.0};
+    double   step_back_us{0.0};
+    double   step_back_max_us{0.0};
+};
+
+struct rewind_t
+{
+    static constexpr uint32_t KEYFRAME_INTERVAL = 60;
+    static constexpr uint32_t SLOTS = 4;
+
+    ~rewind_t();
+
+    bool open( emu_t& emu, size_t capacity_bytes );
+    void close(); // Waits for the worker
+
+    // Call after a frame, copies the snapshot and returns. The history is
+    // the only caller of the instance's incremental snapshots
+    void push( emu_t& emu );
+
+    // Restores the state before the newest one and drops the newest,
+    // false when there's nothing older left
+    bool step_back( emu_t& emu );
+
+    rewind_stats_t stats();
+    bool enabled() const { return ring != nullptr; }
+
+private:
+    struct entry_t
+    {
+        size_t offset;
+        size_t size;
+        bool   keyframe;
+    };
+
+    void   worker_loop();
+    void   store( uint32_t slot );
+    void   fill_clean_pages( uint32_t slot );
+    size_t reserve( size_t bytes );
+    void   drop_oldest();
+    void   apply( const entry_t& entry, uint64_t* state ) const;
+
+    uint8_t* ring{nullptr};
+    size_t   capacity{0};
+    size_t   words{0}; // Snapshot size in 64-bit words
+
+    std::deque<entry_t> entries;
+    size_t   stored_bytes{0};
+    uint32_t since_keyframe{0};
+
+    // Snapshot buffers: free slots, slots waiting for the worker and the
+    // newest stored state, which deltas are taken against
+    std::vector<uint64_t> buffers[SLOTS + 1];
+    std::vector<uint64_t> pages[SLOTS + 1]; // Pages push() copied into the slot
+    std::vector<uint8_t>  scratch;
+    std::deque<uint32_t>  free_slots;
+    std::deque<uint32_t>  pending;
+    uint32_t latest{0};
+    bool     has_latest{false};
+    bool     full_push{true}; // Next push copies every page
+
+    std::thread             worker;
+    std::mutex              mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool                    busy{false};
+    bool                    stop{false};
+
+    // Totals behind stats()
+    uint64_t skipped{0};
+    uint64_t pushes{0};
+    uint64_t push_ns{0};
+    uint64_t push_bytes{0};
+    uint64_t encodes{0};
+    uint64_t encode_ns{0};
+    uint64_t encode_max_ns{0};
+    uint64_t step_backs{0};
+    uint64_t step_back_ns{0};
+    uint64_t step_back_max_ns{0};
+};
+
+} // nes
+
+#endif /* REWIND_HPP */
@@ -0,0 +1,73 @@
+#ifndef ROM_DB_HPP
+#define ROM_DB_HPP
+
+#include <cstdint>
+
+namespace nes
+{
+
+/*
+*   Local ROM header database, used to correct dumps with bad iNES headers.
+*   The file is a sorted table of fixed size records that is mapped as-is,
+*   lookups binary search on the CRC32 of PRG + CHR and confirm with SHA-1.
+*   Build it with data/make_romdb.py.
+*/
+
+#define ROM_DB_MAGIC   "NESROMDB"
+#define ROM_DB_VERSION 1
+
+struct __attribute__((packed)) rom_db_header_t
+{ // 16 bytes
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+struct __attribute__((packed)) rom_db_entry_t
+{ // 32 bytes
+    uint32_t crc32;             // PRG + CHR, sort key
+    uint8_t  sha1[20];          // PRG + CHR, all zero matches any
+    uint16_t mapper;
+    uint8_t  submapper;
+    uint8_t  flags;             // ROM_DB_FLAGS
+    uint8_t  prg_ram_shift;     // 64 << shift bytes, 0 = none (NES 2.0 encoding)
+    uint8_t  prg_nvram_shift;
+    uint8_t  chr_ram_shift;
+    uint8_t  reserved;
+};
+
+enum ROM_DB_FLAGS
+{
+    ROM_DB_VERTICAL     = 1 << 0,
+    ROM_DB_FOUR_SCREEN  = 1 << 1,
+    ROM_DB_BATTERY      = 1 << 2,
+    ROM_DB_REGION_SHIFT = 4,    // 2 bits, 0 NTSC, 1 PAL, 2 multi-region, 3 Dendy
+    ROM_DB_REGION_MASK  = 0x3 << ROM_DB_REGION_SHIFT
+};
+
+struct rom_db_t
+{
+    ~rom_db_t();
+
+    bool open( const char* filepath );
+    void close();
+
+    // data is PRG + CHR, SHA-1 is only computed when the CRC32 matches
+    const rom_db_entry_t* find( uint32_t crc32, const uint8_t* data, uint32_t size ) const;
+
+private:
+    uint8_t* image{nullptr};
+    uint32_t image_size{0};
+    bool     image_mapped{false};
+    const rom_db_entry_t* entries{nullptr};
+    uint32_t count{0};
+};
+
+extern rom_db_t rom_db; // Process wide, consulted by ines_rom_t while loading
+
+uint32_t hash_crc32( const uint8_t* data, uint32_t size, uint32_t crc = 0 );
+void hash_sha1( const uint8_t* data, uint32_t size, uint8_t digest[20] );
+
+} // nes
+
+#endif /* ROM_DB_HPP */
@@ -0,0 +1,52 @@
+#ifndef RUN_AHEAD_HPP
+#define RUN_AHEAD_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "nes.hpp"
+
+namespace nes
+{
+
+/*
+*   Run-ahead hides the input lag games have built in. Every host frame runs
+*   one frame of the committed timeline, with sound, then `frames` more with
+*   the same input and shows the picture of the last one. The speculative
+*   frames are thrown away and never feed audio, the battery save file or a
+*   movie.
+*
+*   The single instance variant snapshots the instance after the committed
+*   frame and restores it afterwards. The second instance variant loads a
+*   save state of the committed instance into a second instance and runs
+*   ahead there, the committed instance (and its APU) is never rolled back.
+*/
+struct run_ahead_t
+{
+    void init( emu_t& emu, uint32_t ahead_frames, bool second_instance );
+
+    // One host frame, the picture to show is in `picture` afterwards
+    void frame();
+
+    uint32_t* picture{nullptr}; // Valid until the next frame()
+
+    // Average time per host frame, all of it and the part spent ahead
+    double frame_us() const { return frames_run ? total_ns / 1000.0 / frames_run : 0.0; }
+    double ahead_us() const { return frames_run ? ahead_ns / 1000.0 / frames_run : 0.0; }
+
+private:
+    emu_t*   emu{nullptr};
+    uint32_t frames{0};
+    bool     use_second{false};
+    emu_t    second{};
+
+    std::vector<uint8_t> state{}; // Snapshot or save state of the committed frame
+
+    uint64_t frames_run{0};
+    uint64_t total_ns{0};
+    uint64_t ahead_ns{0};
+};
+
+} // nes
+
+#endif /* RUN_AHEAD_HPP */
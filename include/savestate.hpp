@@ -0,0 +1,100 @@
+#ifndef SAVESTATE_HPP
+#define SAVESTATE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "nes.hpp"
+#include "logging.hpp"
+
+namespace nes
+{
+
+/*
+*   Save state layout, all values little endian:
+*
+*     header   magic "NESS", version, mapper, PRG + CHR CRC32, section count
+*     section  tag, size in bytes, fields (CPU, PPU, APU, MEM, CART, MAPR)
+*     field    tag, size in bytes, data
+*
+*   Fields are looked up by tag when loading. A field a newer build added is
+*   skipped by older ones, and a field missing from an older state keeps the
+*   value the instance already has. Fields only grow at the end, a shorter
+*   one loads as a prefix. Pointers are never stored, bank windows are saved
+*   as offsets into PRG/CHR and rebuilt on load.
+*/
+
+#define STATE_TAG(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+constexpr uint32_t SAVESTATE_MAGIC   = STATE_TAG('N', 'E', 'S', 'S');
+constexpr uint16_t SAVESTATE_VERSION = 1;
+
+struct state_field_t
+{
+    uint32_t  tag;
+    void*     data;
+    uint32_t  size;
+    uint32_t* dirty; // Battery RAM, pages that change on load are marked here
+};
+
+// The fields of one component, listed by its state_fields()
+struct state_section_t
+{
+    static constexpr uint32_t MAX_FIELDS = 40;
+
+    state_section_t() = default;
+    explicit state_section_t( uint32_t section_tag ) : tag( section_tag ) {}
+
+    inline void add( uint32_t field_tag, void* data, uint32_t size, uint32_t* dirty = nullptr )
+    {
+        if (count == MAX_FIELDS)
+        {
+            LOG_E("Save state section has more than %u fields", MAX_FIELDS);
+            throw RESULT_ERROR;
+        }
+        fields[count++] = { field_tag, data, size, dirty };
+    }
+
+    template <typename T>
+    inline void add( uint32_t field_tag, T& value )
+    {
+        add( field_tag, &value, sizeof(T) );
+    }
+
+    uint32_t tag{0};
+    uint32_t count{0};
+    state_field_t fields[MAX_FIELDS];
+};
+
+// Bank windows as offsets into PRG ROM and CHR ROM/RAM
+struct bank_offsets_t
+{
+    uint32_t prg[4];
+    uint32_t chr[8];
+};
+
+enum SECTION
+{
+    SECTION_CPU,
+    SECTION_PPU,
+    SECTION_APU,
+    SECTION_MEM,
+    SECTION_CART,
+    SECTION_MAPPER,
+    SECTION_COUNT
+};
+
+struct state_sections_t
+{
+    state_section_t section[SECTION_COUNT];
+    bank_offsets_t  banks;
+};
+
+// Every field a save state holds, pointing into the instance. The bank
+// windows are converted to offsets when collected, collect again after
+// the instance has run.
+void collect_state( const emu_t& emu, state_sections_t& sections );
+
+} // nes
+
+#endif /* SAVESTATE_HPP */
@@ -0,0 +1,71 @@
+#ifndef STATE_HASH_HPP
+#define STATE_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "nes.hpp"
+#include "savestate.hpp"
+
+namespace nes
+{
+
+/*
+*   State hashes tell two runs apart without storing the states. Every field
+*   a save state holds (RAM, VRAM, OAM, palette, the CPU/PPU/APU registers,
+*   cartridge RAM, bank windows and the mapper) is hashed with hash64(), a
+*   stripe hash with SSE2/NEON paths that give the same hashes as the plain
+*   C++ one, so streams of builds for different CPUs compare.
+*
+*   A frame stream has one hash per section after every frame. Comparing the
+*   streams of two builds gives the first frame that differs, replaying that
+*   frame with an instruction stream (one hash per field after every
+*   instruction) gives the instruction and the fields that differ first.
+*
+*   Stream layout, all values little endian:
+*
+*     header   magic "NESH", version, kind, hashes per record
+*     tags     section tag and field tag per hash, field tag 0 for sections
+*     records  index (frame or instruction in the frame), PC, hashes
+*
+*   Padding bytes inside the fields are hashed too. The arena is zeroed on
+*   init so they're the same in every run of the same build.
+*/
+
+uint64_t hash64( const void* data, size_t size, uint64_t seed = 0 );
+
+struct state_hash_stream_t
+{
+    enum KIND : uint16_t
+    {
+        KIND_FRAMES,
+        KIND_INSTRUCTIONS
+    };
+
+    ~state_hash_stream_t();
+
+    bool open( const char* filepath, const emu_t& emu, KIND kind );
+    void close();
+
+    // Appends the hashes of the instance as it is now
+    void record( const emu_t& emu, uint32_t index );
+
+    uint64_t records{0};
+    uint64_t hash_ns{0};
+
+private:
+    std::ofstream file{};
+    KIND kind{KIND_FRAMES};
+    uint32_t count{0};
+    std::vector<uint8_t> buffer{};
+};
+
+// Prints the first record and the fields where the streams differ, false
+// when they do or can't be compared
+bool compare_state_hashes( const char* filepath_a, const char* filepath_b );
+
+} // nes
+
+#endif /* STATE_HASH_HPP */
@@ -17,9 +17,7 @@ public:
     jsontest_validator() = default;
 
     void init(emu_t* emu_ref, const char* path);
-    RESULT run_tests();
-
-    std::vector<cpu_mem_t::bus_activity_t> bus_activities;
+    RESULT run_tests(); // Needs a BUS_TRACE build, the cycles are checked against memory->cpu_bus
 
 private:
     emu_t* emu{nullptr};
@@ -0,0 +1,34 @@
+#ifndef SAVESTATE_VALIDATOR_HPP
+#define SAVESTATE_VALIDATOR_HPP
+
+#include "nes.hpp"
+
+#include <vector>
+
+namespace nes
+{
+
+/*
+*   Round trip check for save states. A state saved after warmup_frames is
+*   loaded into a fresh instance and back into the original one, both have
+*   to render the same frames as the uninterrupted run and end up in the
+*   same state.
+*/
+class savestate_validator
+{
+public:
+    savestate_validator() = default;
+
+    RESULT run(const shared_rom_t& rom, uint32_t warmup_frames, uint32_t compare_frames);
+
+private:
+    void record_frames(emu_t& emu, uint32_t frames, std::vector<uint64_t>& hashes);
+    bool compare_frames(const char* label, const emu_t& emu, const std::vector<uint64_t>& hashes);
+
+    std::vector<uint64_t> expected;
+    std::vector<uint8_t>  expected_state;
+};
+
+} // nes
+
+#endif /* SAVESTATE_VALIDATOR_HPP */
@@ -0,0 +1,59 @@
+#ifndef TIME_STRETCH_HPP
+#define TIME_STRETCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nes
+{
+
+#define STRETCH_MIN_SPEED   0.25f
+#define STRETCH_MAX_SPEED   4.0f
+
+/*
+*   WSOLA (Waveform Similarity Overlap-Add) time-stretch.
+*   Input arrives in emulated time, i.e. about frames_per_cb * speed frames
+*   per callback period, and leaves in blocks of `hop` frames (10ms) at
+*   the original pitch. Every output block costs one similarity search of fixed
+*   size, so the CPU time per callback period doesn't grow with the speed.
+*/
+struct time_stretch_t
+{
+    static constexpr uint32_t STRETCH_MAX_RATE     = 96000;
+    static constexpr size_t   STRETCH_MAX_HOP      = STRETCH_MAX_RATE / 100; // Buffers fit the highest output rate
+    static constexpr size_t   STRETCH_MAX_WINDOW   = STRETCH_MAX_HOP * 2;
+    static constexpr size_t   STRETCH_MAX_CAPACITY = STRETCH_MAX_WINDOW * 8 + STRETCH_MAX_RATE / 200 * 2;
+    static constexpr size_t   STRETCH_COARSE       = 4; // Coarse search stride, refined afterwards
+
+    time_stretch_t();
+
+    // Hop and search window follow the output rate, resets the stretcher
+    void init( uint32_t sample_rate );
+    void reset();
+
+    // Queues frames and produces as many output blocks as possible through the callback.
+    // Returns the number of output blocks produced.
+    typedef void (* block_callback_t)(void* cookie, const float* block, size_t count);
+    size_t process( const float* frames, size_t count, float speed, block_callback_t callback, void* cookie );
+
+private:
+    size_t find_best_offset( size_t nominal, size_t natural ) const;
+
+    size_t hop{0};        // Synthesis hop, one output block (10ms)
+    size_t window_size{0};
+    size_t tolerance{0};  // Search +-5ms around the nominal position
+    size_t capacity{0};
+
+    float  window[STRETCH_MAX_WINDOW];
+    float  input[STRETCH_MAX_CAPACITY];
+    float  overlap[STRETCH_MAX_HOP]; // Windowed tail of the previous segment
+    float  output[STRETCH_MAX_HOP];
+    size_t input_count{0};
+    double analysis_position{0}; // Nominal start of the next segment in input
+    size_t previous_end{0};      // End of the previous segment, where the next one would continue
+    bool   primed{false};
+};
+
+} // nes
+
+#endif /* TIME_STRETCH_HPP */
@@ -9,6 +9,38 @@ constexpr uint8_t length_counter_lut[32] = { // 0x00 - 0x1F
     0x0C, 0x10, 0x18, 0x12, 0x30, 0x14, 0x60, 0x16, 0xC0, 0x18, 0x48, 0x1A, 0x10, 0x1C, 0x20, 0x1E
 };
 
+namespace
+{
+
+// Nonlinear mixer lookup tables
+// https://www.nesdev.org/wiki/APU_Mixer#Lookup_Table
+struct mixer_tables_t
+{
+    float pulse[31];  // pulse_1 + pulse_2              (0 - 30)
+    float tnd[203];   // 3 * triangle + 2 * noise + dmc (0 - 202)
+
+    mixer_tables_t()
+    {
+        pulse[0] = 0.0f;
+        tnd[0] = 0.0f;
+        for (auto n = 1; n < 31; ++n)  pulse[n] = 95.52f / (8128.0f / (float)n + 100.0f);
+        for (auto n = 1; n < 203; ++n) tnd[n] = 163.67f / (24329.0f / (float)n + 100.0f);
+    }
+};
+
+const mixer_tables_t mixer_tables;
+
+inline float mixer_lookup(const float* table, uint8_t last, float index)
+{ // Interpolated lookup, used when channels are scaled by a non-unity gain
+    if (index <= 0.0f) return 0.0f;
+    if (index >= (float)last) return table[last];
+    uint8_t i = (uint8_t)index;
+    float frac = index - (float)i;
+    return table[i] + (table[i+1] - table[i]) * frac;
+}
+
+} // anonymous
+
 void apu_t::init(mem_t* mem)
 {
     memory = mem;
@@ -21,11 +53,57 @@ void apu_t::init(mem_t* mem)
 
 void apu_t::mixer()
 {
-    // Linear approximation
-    float pulse_out = 0.00752 * ((float)pulse_1.amplitude + (float)pulse_2.amplitude);
-    float tnd_out = (0.00851 * (float)triangle.amplitude) + (0.00494 * (float)noise.amplitude) + (0.00335 * (float)dmc.output_level);
-    output = pulse_out + tnd_out;
+    uint8_t p1  = pulse_1.amplitude;
+    uint8_t p2  = pulse_2.amplitude;
+    uint8_t tri = triangle.amplitude;
+    uint8_t noi = noise.amplitude;
+    uint8_t dmo = dmc.output_level;
+
+    if (mix.mute_mask)
+    { // Muted channels are not synthesized, their last amplitude is stale
+        if (channel_muted(CH_PULSE_1))  p1  = 0;
+        if (channel_muted(CH_PULSE_2))  p2  = 0;
+        if (channel_muted(CH_TRIANGLE)) tri = 0;
+        if (channel_muted(CH_NOISE))    noi = 0;
+        if (channel_muted(CH_DMC))      dmo = 0;
+    }
 
+    if (mix.unity_gain)
+    {
+        output = mixer_tables.pulse[p1 + p2] + mixer_tables.tnd[3 * tri + 2 * noi + dmo];
+    } else
+    {
+        const float* g = mix.gain;
+        output = mixer_lookup(mixer_tables.pulse, 30,  p1 * g[CH_PULSE_1] + p2 * g[CH_PULSE_2]) +
+                 mixer_lookup(mixer_tables.tnd,   202, 3 * tri * g[CH_TRIANGLE] + 2 * noi * g[CH_NOISE] + dmo * g[CH_DMC]);
+    }
+
+    if (mix.stem_callback)
+    { // Each channel run through the mixer on its own
+        const float* g = mix.gain;
+        mix.stems[CH_PULSE_1]  = mixer_lookup(mixer_tables.pulse, 30,  p1 * g[CH_PULSE_1]);
+        mix.stems[CH_PULSE_2]  = mixer_lookup(mixer_tables.pulse, 30,  p2 * g[CH_PULSE_2]);
+        mix.stems[CH_TRIANGLE] = mixer_lookup(mixer_tables.tnd,   202, 3 * tri * g[CH_TRIANGLE]);
+        mix.stems[CH_NOISE]    = mixer_lookup(mixer_tables.tnd,   202, 2 * noi * g[CH_NOISE]);
+        mix.stems[CH_DMC]      = mixer_lookup(mixer_tables.tnd,   202, dmo * g[CH_DMC]);
+        mix.stem_callback(mix.stem_cookie, mix.stems);
+    }
+}
+
+void apu_t::set_channel_gain( CHANNEL channel, float gain )
+{
+    mix.gain[channel] = gain < 0.0f ? 0.0f : gain;
+    mix.unity_gain = true;
+    for (auto i = 0; i < CH_COUNT; ++i)
+    {
+        if (mix.gain[i] != 1.0f) mix.unity_gain = false;
+    }
+}
+
+void apu_t::set_channel_mute( CHANNEL channel, bool mute )
+{
+    if (mute) mix.mute_mask |= (1 << channel);
+    else      mix.mute_mask &= ~(1 << channel);
 }
 
 void apu_t::quarter_frame()
@@ -46,8 +124,6 @@ void apu_t::half_frame()
     noise.tick_length_counter();
 }
 
-static bool irq_lag[3]{false};
-static uint8_t irq_lag_index{0};
 float apu_t::execute()
 {
     // Run the sequencer
@@ -57,7 +133,7 @@ float apu_t::execute()
     // Actual IRQ seems to lag 2 cycles behind. It's probably wrong but it seems to work. 
     irq_lag[irq_lag_index++] = frame_interrupt || dmc.interrupt_flag;
     irq_lag_index %= 3;
-    memory->cpu->irq_pending = irq_lag[irq_lag_index];
+    memory->cpu->irq_pending = irq_lag[irq_lag_index] || memory->cartridge_irq;
 
     if (reset_frame_counter > 0 && --reset_frame_counter == 0)
     {
@@ -135,11 +211,12 @@ float apu_t::execute()
     if (triangle.length_counter_tmp > 0 && !triangle.muted) { triangle.length_counter = triangle.length_counter_tmp; } triangle.length_counter_tmp = 0;
     if (noise.length_counter_tmp > 0 && !noise.muted) { noise.length_counter = noise.length_counter_tmp; } noise.length_counter_tmp = 0;
 
-    // Tick oscillators
-    pulse_1.tick();
-    pulse_2.tick();
-    triangle.tick();
-    noise.tick();
+    // Tick oscillators, muted channels skip synthesis.
+    // DMC is always ticked since its memory reader drives DMA and IRQs.
+    if (!channel_muted(CH_PULSE_1))  pulse_1.tick();
+    if (!channel_muted(CH_PULSE_2))  pulse_2.tick();
+    if (!channel_muted(CH_TRIANGLE)) triangle.tick();
+    if (!channel_muted(CH_NOISE))    noise.tick();
     dmc.tick();
 
     mixer();
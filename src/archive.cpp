@@ -0,0 +1,216 @@
+#include "archive.hpp"
+#include "rom_db.hpp"
+#include "logging.hpp"
+
+#include <cctype>
+#include <cstring>
+
+namespace nes
+{
+
+namespace
+{
+constexpr uint32_t ZIP_LOCAL_HEADER   = 0x04034B50;
+constexpr uint32_t ZIP_CENTRAL_HEADER = 0x02014B50;
+constexpr uint32_t ZIP_END_OF_CENTRAL = 0x06054B50;
+constexpr uint32_t ZIP_LOCAL_SIZE     = 30;
+constexpr uint32_t ZIP_CENTRAL_SIZE   = 46;
+constexpr uint32_t ZIP_END_SIZE       = 22;
+constexpr uint32_t ZIP_MAX_COMMENT    = 0xFFFF;
+
+constexpr uint16_t METHOD_STORED  = 0;
+constexpr uint16_t METHOD_DEFLATE = 8;
+
+enum GZIP_FLAGS
+{
+    GZIP_FHCRC    = 1 << 1,
+    GZIP_FEXTRA   = 1 << 2,
+    GZIP_FNAME    = 1 << 3,
+    GZIP_FCOMMENT = 1 << 4
+};
+
+inline uint16_t read16( const uint8_t* p ) { return (uint16_t)(p[0] | (p[1] << 8)); }
+inline uint32_t read32( const uint8_t* p ) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+bool has_nes_extension( const std::string& name )
+{
+    if (name.size() < 4) return false;
+    const char* ext = name.c_str() + name.size() - 4;
+    return ext[0] == '.' && tolower(ext[1]) == 'n' && tolower(ext[2]) == 'e' && tolower(ext[3]) == 's';
+}
+} // anonymous
+
+archive_t::FORMAT archive_t::detect( const uint8_t* data, uint32_t size )
+{
+    if (size >= 4 && read32( data ) == ZIP_LOCAL_HEADER) return FORMAT_ZIP;
+    if (size >= 4 && read32( data ) == ZIP_END_OF_CENTRAL) return FORMAT_ZIP; // Empty zip
+    if (size >= 18 && data[0] == 0x1F && data[1] == 0x8B) return FORMAT_GZIP;
+    return FORMAT_NONE;
+}
+
+bool archive_t::open( const uint8_t* archive_data, uint32_t archive_size )
+{
+    data = archive_data;
+    size = archive_size;
+    entries.clear();
+    format = detect( data, size );
+
+    switch (format)
+    {
+        case FORMAT_ZIP:  return open_zip();
+        case FORMAT_GZIP: return open_gzip();
+        default:          return false;
+    }
+}
+
+bool archive_t::open_zip()
+{
+    // The end of central directory record sits behind an optional comment
+    if (size < ZIP_END_SIZE) return false;
+    const uint8_t* end = nullptr;
+    const uint32_t scan_limit = size - ZIP_END_SIZE > ZIP_MAX_COMMENT ? size - ZIP_END_SIZE - ZIP_MAX_COMMENT : 0;
+    for (uint32_t position = size - ZIP_END_SIZE + 1; position-- > scan_limit; )
+    {
+        if (read32( &data[position] ) == ZIP_END_OF_CENTRAL)
+        {
+            end = &data[position];
+            break;
+        }
+    }
+    if (!end)
+    {
+        LOG_E("Zip end of central directory not found");
+        return false;
+    }
+
+    const uint16_t count = read16( &end[10] );
+    const uint32_t directory_size = read32( &end[12] );
+    const uint32_t directory_offset = read32( &end[16] );
+    if (directory_offset == 0xFFFFFFFF || (uint64_t)directory_offset + directory_size > size)
+    { // Zip64 is never needed for ROMs
+        LOG_E("Zip central directory not supported");
+        return false;
+    }
+
+    entries.reserve( count );
+    uint32_t position = directory_offset;
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        if (position + ZIP_CENTRAL_SIZE > size || read32( &data[position] ) != ZIP_CENTRAL_HEADER)
+        {
+            LOG_E("Zip central directory is corrupt");
+            return false;
+        }
+        const uint8_t* header = &data[position];
+        const uint16_t flags = read16( &header[8] );
+        const uint16_t name_length = read16( &header[28] );
+        const uint32_t header_size = ZIP_CENTRAL_SIZE + name_length + read16( &header[30] ) + read16( &header[32] );
+        if (position + header_size > size) return false;
+
+        archive_entry_t entry;
+        entry.name.assign( (const char*)&header[ZIP_CENTRAL_SIZE], name_length );
+        entry.method = read16( &header[10] );
+        entry.crc32 = read32( &header[16] );
+        entry.compressed_size = read32( &header[20] );
+        entry.size = read32( &header[24] );
+        const uint32_t local_offset = read32( &header[42] );
+        position += header_size;
+
+        if (flags & 0x1) continue; // Encrypted
+        if (entry.method != METHOD_STORED && entry.method != METHOD_DEFLATE) continue;
+        if (!entry.name.empty() && entry.name.back() == '/') continue; // Directory
+
+        // The local header repeats the name but its extra field can differ
+        if ((uint64_t)local_offset + ZIP_LOCAL_SIZE > size || read32( &data[local_offset] ) != ZIP_LOCAL_HEADER) continue;
+        entry.offset = local_offset + ZIP_LOCAL_SIZE + read16( &data[local_offset + 26] ) + read16( &data[local_offset + 28] );
+        if ((uint64_t)entry.offset + entry.compressed_size > size) continue;
+
+        entries.push_back( entry );
+    }
+    return true;
+}
+
+bool archive_t::open_gzip()
+{
+    if (data[2] != METHOD_DEFLATE) return false;
+    const uint8_t flags = data[3];
+
+    uint32_t position = 10;
+    archive_entry_t entry;
+    if (flags & GZIP_FEXTRA)
+    {
+        if (position + 2 > size) return false;
+        position += 2 + read16( &data[position] );
+    }
+    if (flags & GZIP_FNAME)
+    {
+        const uint32_t start = position;
+        while (position < size && data[position] != 0) ++position;
+        entry.name.assign( (const char*)&data[start], position - start );
+        ++position;
+    }
+    if (flags & GZIP_FCOMMENT)
+    {
+        while (position < size && data[position] != 0) ++position;
+        ++position;
+    }
+    if (flags & GZIP_FHCRC) position += 2;
+    if (position + 8 > size) return false;
+
+    // The trailer holds the CRC32 and the size modulo 4GB
+    entry.method = METHOD_DEFLATE;
+    entry.offset = position;
+    entry.compressed_size = size - 8 - position;
+    entry.crc32 = read32( &data[size - 8] );
+    entry.size = read32( &data[size - 4] );
+    entries.push_back( entry );
+    return true;
+}
+
+const archive_entry_t* archive_t::find( const char* name ) const
+{
+    if (name && name[0])
+    {
+        for (const archive_entry_t& entry : entries)
+        {
+            if (entry.name == name) return &entry;
+        }
+        return nullptr;
+    }
+
+    // A gzip member is the ROM whatever it was called
+    if (format == FORMAT_GZIP) return entries.empty() ? nullptr : &entries[0];
+    for (const archive_entry_t& entry : entries)
+    {
+        if (has_nes_extension( entry.name )) return &entry;
+    }
+    return nullptr;
+}
+
+bool archive_t::extract( const archive_entry_t& entry, uint8_t* out ) const
+{
+    bool ok;
+    if (entry.method == METHOD_STORED)
+    {
+        ok = entry.compressed_size == entry.size;
+        if (ok) memcpy( out, &data[entry.offset], entry.size );
+    }
+    else
+    {
+        ok = inflate( &data[entry.offset], entry.compressed_size, out, entry.size );
+    }
+
+    if (!ok)
+    {
+        LOG_E("Failed to inflate '%s'", entry.name.c_str());
+        return false;
+    }
+    if (hash_crc32( out, entry.size ) != entry.crc32)
+    {
+        LOG_E("CRC32 mismatch in '%s'", entry.name.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // nes
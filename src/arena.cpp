@@ -0,0 +1,64 @@
+#include "arena.hpp"
+#include "nes.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace nes
+{
+
+arena_t::~arena_t()
+{
+    release();
+}
+
+void arena_t::commit()
+{
+    if (data) return;
+
+#if defined(_WIN32)
+    data = (uint8_t*)_aligned_malloc( capacity, ALIGNMENT );
+#else
+    void* block = nullptr;
+    if (posix_memalign( &block, ALIGNMENT, capacity ) == 0) data = (uint8_t*)block;
+#endif
+    if (data == nullptr)
+    {
+        LOG_E("Failed to allocate memory for emulator state.");
+        throw RESULT_ERROR;
+    }
+    memset( data, 0, capacity );
+    used = 0;
+}
+
+void arena_t::release()
+{
+#if defined(_WIN32)
+    _aligned_free( data );
+#else
+    free( data );
+#endif
+    data = nullptr;
+    capacity = 0;
+    used = 0;
+}
+
+void* arena_t::allocate( size_t bytes )
+{
+    bytes = align( bytes );
+    if (data == nullptr || used + bytes > capacity)
+    { // Every allocation has to be reserved before commit()
+        LOG_E("Emulator arena exhausted (%zu + %zu > %zu bytes)", used, bytes, capacity);
+        throw RESULT_ERROR;
+    }
+    void* block = data + used;
+    used += bytes;
+    return block;
+}
+
+} // nes
@@ -0,0 +1,567 @@
+#define MA_NO_DECODING
+#define MA_NO_ENCODING
+#define MA_NO_GENERATION
+#define MA_NO_RESOURCE_MANAGER
+#define MA_NO_NODE_GRAPH
+#define MA_NO_ENGINE
+#define MINIAUDIO_IMPLEMENTATION
+
+#include "audio.hpp"
+#include "nes.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define AUDIO_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AUDIO_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nes
+{
+
+namespace
+{
+
+int64_t steady_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void audio_callback(ma_device* device, void* output, const void* input, ma_uint32 frame_count)
+{
+    (void)input;   /* Unused. */
+    audio_miniaudio_t::audio_data_t* data = (audio_miniaudio_t::audio_data_t*)device->pUserData;
+    audio_stats_t* stats = data->stats;
+    const audio_config_t& config = *data->config;
+
+    data->drift = ma_rb_pointer_distance(&data->ring_buffer);
+    stats->ring_fill.record( 100.0f * data->drift / (config.sample_rate * sizeof(float)) );
+    if (data->drift > data->drift_threshold) {
+        ma_rb_seek_read(&data->ring_buffer, data->drift_skip);
+        data->frames_read += data->drift_skip / sizeof(float);
+        stats->drift_skips++;
+        LOG_W("Audio lagging behind, skipping forward.");
+    }
+
+    // Converted in chunks of the scratch buffer, missing frames repeat the last amplitude
+    uint8_t* frames_out = (uint8_t*)output;
+    float* tmp_buffer = data->tmp_buffer.data();
+    size_t ready_total = 0;
+    size_t remaining = frame_count;
+    while (remaining > 0)
+    {
+        const size_t chunk = remaining < data->tmp_buffer.size() ? remaining : data->tmp_buffer.size();
+
+        size_t ready_frames = 0;
+        while (ready_frames < chunk)
+        { // The readable region ends where the ring wraps around
+            void* buffer;
+            size_t size_in_bytes = (chunk - ready_frames) * sizeof(float);
+            ma_rb_acquire_read(&data->ring_buffer, &size_in_bytes, &buffer);
+            if (size_in_bytes == 0) break;
+            memcpy(&tmp_buffer[ready_frames], buffer, size_in_bytes);
+            ma_rb_commit_read(&data->ring_buffer, size_in_bytes);
+            ready_frames += size_in_bytes / sizeof(float);
+        }
+
+        if (ready_frames > 0) data->amplitude = tmp_buffer[ready_frames - 1];
+        for (size_t frame = ready_frames; frame < chunk; ++frame)
+        {
+            tmp_buffer[frame] = data->amplitude;
+        }
+
+        convert_frames(tmp_buffer, chunk, frames_out, config);
+        frames_out  += chunk * config.bytes_per_frame();
+        remaining   -= chunk;
+        ready_total += ready_frames;
+    }
+
+    if (ready_total < frame_count)
+    {
+        stats->underruns++;
+        stats->padded_frames += frame_count - ready_total;
+    }
+
+    // Every block fully consumed by now has reached the device
+    data->frames_read += ready_total;
+    const int64_t now = steady_now_ns();
+    size_t tail = data->stamp_tail.load(std::memory_order_relaxed);
+    while (tail != data->stamp_head.load(std::memory_order_acquire))
+    {
+        const audio_miniaudio_t::block_stamp_t& stamp = data->stamps[tail % audio_miniaudio_t::STAMP_COUNT];
+        if (stamp.end_frame > data->frames_read) break;
+        stats->latency_ms.record( (now - stamp.produced) / 1000000.0f );
+        tail++;
+    }
+    data->stamp_tail.store(tail, std::memory_order_release);
+}
+
+void stretched_block(void* cookie, const float* block, size_t count)
+{
+    audio_t* audio = (audio_t*)cookie;
+    audio->submit( block, count );
+    audio->samples_submitted += count;
+}
+
+} // anonymous
+
+///////////////////////////// Format
+//////////////////////////////////////////////////////////
+
+bool audio_config_t::parse( const char* spec )
+{
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    for (char* token = strtok(buffer, ","); token != nullptr; token = strtok(nullptr, ","))
+    {
+        if      (strcmp(token, "f32") == 0)    format = ma_format_f32;
+        else if (strcmp(token, "s16") == 0)    format = ma_format_s16;
+        else if (strcmp(token, "mono") == 0)   channels = 1;
+        else if (strcmp(token, "stereo") == 0) channels = 2;
+        else if (strcmp(token, "44100") == 0 || strcmp(token, "48000") == 0 || strcmp(token, "96000") == 0)
+        {
+            sample_rate = atoi(token);
+        }
+        else if (strncmp(token, "period=", 7) == 0 && token[7] != '\0')
+        {
+            period_frames = atoi(token + 7);
+        }
+        else
+        {
+            LOG_E("Unknown audio format option '%s'", token);
+            return false;
+        }
+    }
+    return true;
+}
+
+void convert_frames( const float* frames, size_t count, void* output, const audio_config_t& config )
+{
+    size_t i = 0;
+    if (config.format == ma_format_f32)
+    {
+        float* out = (float*)output;
+        if (config.channels == 1)
+        {
+            memcpy(out, frames, count * sizeof(float));
+            return;
+        }
+#if defined(AUDIO_SSE2)
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 v = _mm_loadu_ps(frames + i);
+            _mm_storeu_ps(out + i * 2,     _mm_unpacklo_ps(v, v));
+            _mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(v, v));
+        }
+#elif defined(AUDIO_NEON)
+        for (; i + 4 <= count; i += 4)
+        {
+            float32x4_t v = vld1q_f32(frames + i);
+            float32x4x2_t lr = vzipq_f32(v, v);
+            vst1q_f32(out + i * 2,     lr.val[0]);
+            vst1q_f32(out + i * 2 + 4, lr.val[1]);
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            out[i * 2] = out[i * 2 + 1] = frames[i];
+        }
+        return;
+    }
+
+    // s16, clamped and rounded to nearest
+    int16_t* out = (int16_t*)output;
+    const bool stereo = config.channels == 2;
+#if defined(AUDIO_SSE2)
+    const __m128 low   = _mm_set1_ps(-1.0f);
+    const __m128 high  = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(frames + i),     low), high), scale);
+        __m128 b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(frames + i + 4), low), high), scale);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        if (stereo)
+        {
+            _mm_storeu_si128((__m128i*)(out + i * 2),     _mm_unpacklo_epi16(packed, packed));
+            _mm_storeu_si128((__m128i*)(out + i * 2 + 8), _mm_unpackhi_epi16(packed, packed));
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i*)(out + i), packed);
+        }
+    }
+#elif defined(AUDIO_NEON)
+    const float32x4_t low  = vdupq_n_f32(-1.0f);
+    const float32x4_t high = vdupq_n_f32(1.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t v = vmulq_n_f32(vminq_f32(vmaxq_f32(vld1q_f32(frames + i), low), high), 32767.0f);
+        // Round half away from zero, vcvtq truncates
+        v = vaddq_f32(v, vbslq_f32(vcltq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f)));
+        int16x4_t packed = vqmovn_s32(vcvtq_s32_f32(v));
+        if (stereo)
+        {
+            int16x4x2_t lr = vzip_s16(packed, packed);
+            vst1_s16(out + i * 2,     lr.val[0]);
+            vst1_s16(out + i * 2 + 4, lr.val[1]);
+        }
+        else
+        {
+            vst1_s16(out + i, packed);
+        }
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        float v = frames[i] < -1.0f ? -1.0f : (frames[i] > 1.0f ? 1.0f : frames[i]);
+        int16_t sample = (int16_t)lrintf(v * 32767.0f);
+        if (stereo)
+        {
+            out[i * 2] = out[i * 2 + 1] = sample;
+        }
+        else
+        {
+            out[i] = sample;
+        }
+    }
+}
+
+///////////////////////////// Base
+//////////////////////////////////////////////////////////
+
+audio_t::audio_t( const audio_config_t& audio_config ) :
+    config(audio_config),
+    frames_per_cb(audio_config.frames_per_cb()),
+    cycles_per_cb(audio_config.cycles_per_cb()),
+    storage(cycles_per_cb * (size_t)STRETCH_MAX_SPEED + 64),
+    block(frames_per_cb * (size_t)STRETCH_MAX_SPEED)
+{
+    stretcher.init( config.sample_rate );
+}
+
+void audio_t::buffer_data( float amplitude )
+{
+    storage[stored_data++] = amplitude;
+
+    if (cycle_count++ > (float)cycles_per_cb * speed || stored_data == storage.size())
+    {
+        sample_data();
+        cycle_count = 0;
+    }
+}
+
+void audio_t::sample_data()
+{
+    // The period holds frames_per_cb * speed frames worth of emulated time
+    size_t frames = (size_t)((float)frames_per_cb * speed + 0.5f);
+    if (frames > block.size()) frames = block.size();
+    if (frames == 0 || stored_data < frames) return; // Not enough frames ready to be sampled
+
+    const float sample_offset = (float)stored_data / (float)frames;
+    stats.resample_ratio.record( sample_offset * (float)frames_per_cb / (float)cycles_per_cb );
+
+    size_t j = 0;
+    for (float i = 0.0; i < stored_data && j < frames; i += sample_offset)
+    {
+        block[j++] = storage[(int)i];
+    }
+    stored_data = 0;
+
+    if (frames == frames_per_cb)
+    { // Real time, no stretching needed
+        if (stretching) stretcher.reset();
+        stretching = false;
+        submit( block.data(), j );
+        samples_submitted += j;
+        return;
+    }
+
+    stretching = true;
+    stats.stretched_blocks += stretcher.process( block.data(), j, speed, &stretched_block, this );
+}
+
+///////////////////////////// Stats
+//////////////////////////////////////////////////////////
+
+void histogram_t::record( float value )
+{
+    int bucket = (int)((value - min) / width);
+    if (bucket < 0) bucket = 0;
+    if (bucket >= (int)HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); // Single writer
+    count.fetch_add(1, std::memory_order_relaxed);
+}
+
+float histogram_t::percentile( float fraction ) const
+{
+    const uint64_t total = samples();
+    if (total == 0) return 0.0f;
+
+    const uint64_t target = (uint64_t)(fraction * total + 0.5f);
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        accumulated += buckets[i].load(std::memory_order_relaxed);
+        if (accumulated >= target) return min + width * (i + 1);
+    }
+    return min + width * HISTOGRAM_BUCKETS;
+}
+
+float histogram_t::mean() const
+{
+    const uint64_t total = samples();
+    return total ? (float)(sum.load(std::memory_order_relaxed) / total) : 0.0f;
+}
+
+void histogram_t::write( FILE* file, const char* label, const char* unit ) const
+{
+    fprintf(file, "%s: %llu samples, mean %.3f%s, p50 %.3f%s, p90 %.3f%s, p99 %.3f%s\n", label,
+        (unsigned long long)samples(), mean(), unit, percentile(0.5f), unit, percentile(0.9f), unit, percentile(0.99f), unit);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        uint32_t hits = buckets[i].load(std::memory_order_relaxed);
+        if (hits == 0) continue;
+        fprintf(file, "  [%8.3f, %8.3f%s) %u\n", min + width * i,
+            min + width * (i + 1), i + 1 == HISTOGRAM_BUCKETS ? "+" : "", hits);
+    }
+}
+
+void audio_stats_t::write_report( FILE* file ) const
+{
+    fprintf(file, "underruns: %llu (%llu frames padded)\n", (unsigned long long)underruns.load(), (unsigned long long)padded_frames.load());
+    fprintf(file, "overruns: %llu (%llu frames dropped)\n", (unsigned long long)overruns.load(), (unsigned long long)dropped_frames.load());
+    fprintf(file, "drift skips: %llu\n", (unsigned long long)drift_skips.load());
+    fprintf(file, "time-stretched blocks: %llu\n", (unsigned long long)stretched_blocks.load());
+    latency_ms.write(file, "latency", "ms");
+    ring_fill.write(file, "ring fill", "%");
+    resample_ratio.write(file, "resample ratio", "");
+}
+
+///////////////////////////// miniaudio
+//////////////////////////////////////////////////////////
+
+audio_miniaudio_t::audio_miniaudio_t( const audio_config_t& audio_config ) : audio_t(audio_config)
+{
+    // One second of mono f32, conversion to the device format happens in the callback
+    if (ma_rb_init(config.sample_rate * sizeof(float), NULL, NULL, &data.ring_buffer) != MA_SUCCESS)
+    {
+        LOG_E("Failed to initialize ring buffer.");
+        throw RESULT_ERROR;
+    }
+    data.stats = &stats;
+    data.config = &config;
+    data.tmp_buffer.resize(config.period_frames > frames_per_cb ? config.period_frames : frames_per_cb);
+    data.drift_threshold = config.sample_rate * DRIFT_CORRECTION_THRESHOLD_MS / 1000 * sizeof(float);
+    data.drift_skip      = config.sample_rate * DRIFT_CORRECTION_SKIP_MS / 1000 * sizeof(float);
+
+    start_thread = std::thread(&audio_miniaudio_t::start_device, this);
+}
+
+audio_miniaudio_t::~audio_miniaudio_t()
+{
+    if (start_thread.joinable()) start_thread.join();
+    if (device_ready) ma_device_uninit(&device);
+    ma_rb_uninit(&data.ring_buffer);
+}
+
+void audio_miniaudio_t::start_device()
+{
+    deviceConfig = ma_device_config_init(ma_device_type_playback);
+    deviceConfig.playback.format   = config.format;
+    deviceConfig.playback.channels = config.channels;
+    deviceConfig.sampleRate        = config.sample_rate;
+    deviceConfig.dataCallback      = audio_callback;
+    deviceConfig.pUserData         = &data;
+    if (config.period_frames > 0)
+    {
+        deviceConfig.periodSizeInFrames = config.period_frames;
+    }
+    else
+    { // Smallest period the backend is comfortable with
+        deviceConfig.performanceProfile = ma_performance_profile_low_latency;
+    }
+
+    if (ma_device_init(NULL, &deviceConfig, &device) != MA_SUCCESS) {
+        LOG_W("Failed to open playback device, audio is discarded.");
+        return;
+    }
+
+    if (ma_device_start(&device) != MA_SUCCESS) {
+        LOG_W("Failed to start playback device, audio is discarded.");
+        ma_device_uninit(&device);
+        return;
+    }
+
+    device_ready = true;
+    LOG_I("Audio device started (%s, %u ch, %u Hz, period %u frames)", config.format == ma_format_s16 ? "s16" : "f32",
+        config.channels, config.sample_rate, device.playback.internalPeriodSizeInFrames);
+}
+
+void audio_miniaudio_t::submit( const float* frames, size_t count )
+{
+    if (!device_ready) return; // Device not (yet) running
+
+    const int64_t produced = steady_now_ns();
+
+    void* buffer;
+    size_t size_in_bytes = count * sizeof(float);
+    ma_rb_acquire_write(&data.ring_buffer, &size_in_bytes, &buffer);
+    memcpy(buffer, frames, size_in_bytes);
+    ma_rb_commit_write(&data.ring_buffer, size_in_bytes);
+
+    const size_t written = size_in_bytes / sizeof(float);
+    if (written < count)
+    {
+        stats.overruns++;
+        stats.dropped_frames += count - written;
+    }
+
+    const uint64_t end_frame = data.frames_written.load(std::memory_order_relaxed) + written;
+    data.frames_written.store(end_frame, std::memory_order_relaxed);
+
+    size_t head = data.stamp_head.load(std::memory_order_relaxed);
+    if (head - data.stamp_tail.load(std::memory_order_acquire) < STAMP_COUNT)
+    { // Stamps are skipped while the device isn't consuming
+        data.stamps[head % STAMP_COUNT] = { end_frame, produced };
+        data.stamp_head.store(head + 1, std::memory_order_release);
+    }
+}
+
+///////////////////////////// null
+//////////////////////////////////////////////////////////
+
+audio_null_t::~audio_null_t()
+{
+    LOG_I("Null audio discarded %llu samples (%.2f s)",
+        (unsigned long long)samples_submitted, (double)samples_submitted / config.sample_rate);
+}
+
+void audio_null_t::submit( const float* frames, size_t count )
+{
+    (void)frames;
+    (void)count;
+}
+
+///////////////////////////// file
+//////////////////////////////////////////////////////////
+
+audio_file_t::audio_file_t( const char* filepath, container container_type, const audio_config_t& audio_config ) :
+    audio_t(audio_config)
+{
+    type = container_type;
+    file = fopen(filepath, "wb");
+    if (!file)
+    {
+        LOG_E("Failed to open audio output file '%s'", filepath);
+        throw RESULT_ERROR;
+    }
+
+    if (type == container::wav) write_wav_header( 0 );
+    writer = std::thread(&audio_file_t::writer_loop, this);
+    LOG_I("Writing audio to '%s'", filepath);
+}
+
+audio_file_t::~audio_file_t()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) writer.join();
+
+    if (type == container::wav)
+    { // Patch the sizes now that they're known
+        fseek(file, 0, SEEK_SET);
+        write_wav_header( (uint32_t)bytes_written );
+    }
+    fclose(file);
+}
+
+void audio_file_t::submit( const float* frames, size_t count )
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const size_t offset = pending.size();
+        pending.resize(offset + count * config.bytes_per_frame());
+        convert_frames(frames, count, &pending[offset], config);
+    }
+    wake.notify_one();
+}
+
+void audio_file_t::writer_loop()
+{
+    std::vector<uint8_t> writing;
+    while (true)
+    {
+        bool done;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this]{ return closing || !pending.empty(); });
+            writing.swap(pending);
+            done = closing;
+        }
+
+        if (!writing.empty())
+        {
+            bytes_written += fwrite(writing.data(), 1, writing.size(), file);
+            writing.clear();
+        }
+        if (done) break;
+    }
+}
+
+void audio_file_t::write_wav_header( uint32_t data_size )
+{
+    struct __attribute__((packed))
+    {
+        char     riff[4]{'R', 'I', 'F', 'F'};
+        uint32_t riff_size;
+        char     wave[4]{'W', 'A', 'V', 'E'};
+        char     fmt[4]{'f', 'm', 't', ' '};
+        uint32_t fmt_size{16};
+        uint16_t format_tag;
+        uint16_t channels;
+        uint32_t sample_rate;
+        uint32_t byte_rate;
+        uint16_t block_align;
+        uint16_t bits_per_sample;
+        char     data[4]{'d', 'a', 't', 'a'};
+        uint32_t data_size;
+    } header;
+    const bool pcm = config.format == ma_format_s16;
+    header.format_tag      = pcm ? 1 : 3; // PCM or IEEE float
+    header.channels        = config.channels;
+    header.sample_rate     = config.sample_rate;
+    header.byte_rate       = config.sample_rate * config.bytes_per_frame();
+    header.block_align     = config.bytes_per_frame();
+    header.bits_per_sample = pcm ? 16 : 32;
+    header.riff_size = 36 + data_size;
+    header.data_size = data_size;
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+///////////////////////////// Selection
+//////////////////////////////////////////////////////////
+
+audio_t* create_audio_backend( const char* spec, const audio_config_t& config )
+{
+    if (strcmp(spec, "miniaudio") == 0) return new audio_miniaudio_t(config);
+    if (strcmp(spec, "null") == 0)      return new audio_null_t(config);
+    if (strncmp(spec, "wav:", 4) == 0 && spec[4] != '\0') return new audio_file_t(spec + 4, audio_file_t::container::wav, config);
+    if (strncmp(spec, "raw:", 4) == 0 && spec[4] != '\0') return new audio_file_t(spec + 4, audio_file_t::container::raw, config);
+
+    LOG_E("Unknown audio backend '%s'", spec);
+    return nullptr;
+}
+
+} // nes
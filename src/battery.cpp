@@ -0,0 +1,190 @@
+#include "battery.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+
+#if !defined(_WIN32)
+#define BATTERY_MMAP
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace nes
+{
+
+battery_ram_t::~battery_ram_t()
+{
+    close();
+}
+
+bool battery_ram_t::open( const char* filepath, uint32_t ram_size )
+{
+    close();
+    path = filepath;
+    size = ram_size;
+
+#if defined(BATTERY_MMAP)
+    int fd = ::open(filepath, O_RDWR | O_CREAT, 0644);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        if (fd >= 0) ::close(fd);
+        LOG_E("Failed to open save file '%s'", filepath);
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        ::close(fd);
+        LOG_W("Save file '%s' is in use by another instance, running on a copy", filepath);
+        return false;
+    }
+
+    // New or short files are zero extended to the RAM size
+    if ((uint32_t)file_stat.st_size < size && ftruncate(fd, size) != 0)
+    {
+        ::close(fd);
+        LOG_E("Failed to resize save file '%s'", filepath);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        ::close(fd);
+        LOG_E("Failed to map save file '%s'", filepath);
+        return false;
+    }
+    data = (uint8_t*)mapping;
+    mapped = true;
+    lock_fd = fd; // Held until close
+#else
+    data = (uint8_t*)calloc(size, 1);
+    if (data == nullptr)
+    {
+        LOG_E("Failed to allocate memory for battery RAM.");
+        return false;
+    }
+
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary);
+    if (file.is_open()) file.read((char*)data, size);
+#endif
+
+    stop = false;
+    pending = 0;
+    writer = std::thread(&battery_ram_t::writer_loop, this);
+
+    LOG_I("Battery RAM backed by '%s'", filepath);
+    return true;
+}
+
+void battery_ram_t::close()
+{
+    if (!data) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = ~0u; // Final flush, everything
+        stop = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) writer.join();
+
+#if defined(BATTERY_MMAP)
+    if (mapped) munmap(data, size);
+    else
+#endif
+    free(data);
+    data = nullptr;
+    mapped = false;
+
+#if defined(BATTERY_MMAP)
+    if (lock_fd >= 0) ::close(lock_fd); // Releases the lock
+#endif
+    lock_fd = -1;
+}
+
+void battery_ram_t::read_copy( const char* filepath, uint8_t* out, uint32_t ram_size )
+{
+    memset(out, 0, ram_size);
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary);
+    if (file.is_open()) file.read((char*)out, ram_size);
+}
+
+void battery_ram_t::flush( uint32_t dirty_pages )
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending |= dirty_pages;
+    }
+    wake.notify_one();
+}
+
+void battery_ram_t::writer_loop()
+{
+    while (true)
+    {
+        uint32_t pages;
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return pending != 0 || stop; });
+            pages = pending;
+            pending = 0;
+            done = stop;
+        }
+        if (pages) write_pages(pages);
+        if (done) return;
+    }
+}
+
+void battery_ram_t::write_pages( uint32_t pages )
+{
+    const uint32_t page_size = 1u << BATTERY_PAGE_SHIFT;
+    const uint32_t page_count = (size + page_size - 1) >> BATTERY_PAGE_SHIFT;
+
+#if defined(BATTERY_MMAP)
+    // msync wants addresses aligned to the system page size
+    const uintptr_t system_page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for (uint32_t page = 0; page < page_count && page < 32; ++page)
+    {
+        if (!(pages & (1u << page))) continue;
+        uintptr_t start = (uintptr_t)data + page * page_size;
+        uintptr_t end = (uintptr_t)data + std::min(size, (page + 1) * page_size);
+        start &= ~(system_page - 1);
+        if (msync((void*)start, end - start, MS_SYNC) != 0)
+        {
+            LOG_W("Failed to sync save file '%s'", path.c_str());
+        }
+    }
+#else
+    std::fstream file;
+    file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.is_open())
+    { // First write creates the file
+        file.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        pages = ~0u;
+    }
+    if (!file.is_open())
+    {
+        LOG_W("Failed to write save file '%s'", path.c_str());
+        return;
+    }
+    for (uint32_t page = 0; page < page_count && page < 32; ++page)
+    {
+        if (!(pages & (1u << page))) continue;
+        uint32_t offset = page * page_size;
+        file.seekp(offset);
+        file.write((const char*)&data[offset], std::min(page_size, size - offset));
+    }
+#endif
+}
+
+} // nes
@@ -7,11 +7,12 @@
 namespace nes
 {
 
-void cpu_t::init(cpu_callback_t cpu_cb, cpu_callback_t ppu_cb, cpu_callback_t apu_cb, mem_t* mem)
+void cpu_t::init(cpu_callback_t cpu_cb, cpu_callback_t ppu_cb, cpu_callback_t apu_cb, mem_t* mem, void* cookie)
 {
     cpu_callback = cpu_cb;
     ppu_callback = ppu_cb;
     apu_callback = apu_cb;
+    callback_cookie = cookie;
     memory = mem;
     memory->cpu = this;
 
@@ -74,18 +75,22 @@ void cpu_t::tick_clock()
 
         if (cpu_callback)
         {
-            cpu_callback(nullptr);
+            cpu_callback(callback_cookie);
+        }
+        if (memory->clocked_mapper)
+        { // Cartridge IRQ counters, before the APU samples the IRQ line
+            memory->clocked_mapper->cpu_clock();
         }
         if (ppu_callback)
         { // NTSC PPU runs at 3x the CPU clock speed
-            ppu_callback(nullptr);
+            ppu_callback(callback_cookie);
             nmi_trigger |= nmi_pending;
-            ppu_callback(nullptr);
-            ppu_callback(nullptr);
+            ppu_callback(callback_cookie);
+            ppu_callback(callback_cookie);
         }
         if (apu_callback)
         {
-            apu_callback(nullptr);
+            apu_callback(callback_cookie);
         }
 
         // DMA halt
@@ -166,10 +171,11 @@ void cpu_t::write_byte( uint8_t data, uint8_t* ref )
         throw RESULT_ERROR;
     }
     
+    // The unmodified value is written back first, then the result
+    memory->cpu_bus.rewrite( memory->cpu_cycles, memory->cpu_bus.open_bus() );
     *ref = data;
-    memory->cpu_mem.activity.read = false;
     tick_clock();
-    memory->cpu_mem.activity.value = data;
+    memory->cpu_bus.rewrite( memory->cpu_cycles, data );
     tick_clock();
 }
 
@@ -190,16 +190,18 @@ static void ppu_get_chr(emu_t& emu, uint16_t address, uint8_t* out_data, bool bg
 {
     uint16_t chr_offset = 0x0;
     if (bg) {
-        if ((emu.ppu.regs.PPUCTRL >> 4) & 0x1) {
+        if ((emu.ppu->regs.PPUCTRL >> 4) & 0x1) {
             chr_offset = 0x1000;
         }
     } else {
-        if ((emu.ppu.regs.PPUCTRL >> 3) & 0x1) {
+        if ((emu.ppu->regs.PPUCTRL >> 3) & 0x1) {
             chr_offset = 0x1000;
         }
     }
 
-    uint8_t* chr_data = (uint8_t*)emu.memory->cartridge_mem.chr_rom.chr_bank_8kb + address + chr_offset;
+    // A tile never straddles a 1KB CHR window
+    uint16_t chr_address = address + chr_offset;
+    const uint8_t* chr_data = emu.memory->cartridge_mem.chr_banks[ chr_address >> 10 ] + (chr_address & 0x3FF);
 
     // low bits
     for (uint32_t y = 0; y < 8; ++y)
@@ -295,7 +297,7 @@ static void blit_chr_nt(emu_t& emu, uint32_t pix_x, uint32_t pix_y, uint32_t chr
 
 void dump_sprites(emu_t &emu)
 {
-    bool is_8x16 = ((emu.ppu.regs.PPUCTRL >> 5) & 0b1) == 0b1;
+    bool is_8x16 = ((emu.ppu->regs.PPUCTRL >> 5) & 0b1) == 0b1;
 
     static uint8_t palette_set[3];
     for (uint32_t sprite_i = 0; sprite_i < 64; ++sprite_i)
@@ -309,7 +311,7 @@ void dump_sprites(emu_t &emu)
         bool flip_y = !!(sprite_data2 & (1 << 7));
         uint8_t palette_id = sprite_data2 & 0x3;
 
-        // uint8_t palette_ids = emu.ppu.palette[0x11+palette_id*3];
+        // uint8_t palette_ids = emu.ppu->palette[0x11+palette_id*3];
         palette_set[0] = emu.memory->ppu_mem.palette[0x11+palette_id*4];
         palette_set[1] = emu.memory->ppu_mem.palette[0x12+palette_id*4];
         palette_set[2] = emu.memory->ppu_mem.palette[0x13+palette_id*4];
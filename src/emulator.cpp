@@ -1,15 +1,10 @@
-#define MA_NO_DECODING
-#define MA_NO_ENCODING
-#define MA_NO_GENERATION
-#define MA_NO_RESOURCE_MANAGER
-#define MA_NO_NODE_GRAPH
-#define MA_NO_ENGINE
-#define MINIAUDIO_IMPLEMENTATION
-
 #include "nes.hpp"
 #include "logging.hpp"
 #include "mappers.hpp"
 #include "audio.hpp"
+#include "movie.hpp"
+
+#include <cstring>
 
 #include "test/jsontest_validator.hpp"
 
@@ -18,104 +13,176 @@ namespace nes
 
 namespace
 {
-emu_t* emulator_ref;
-jsontest_validator* validator_ref;
-audio_t* audio_ref;
+// Debug views draw up to 512 x 480
+constexpr size_t FRAMEBUFFER_SIZE = NES_WIDTH * NES_HEIGHT * 4;
 
-uint32_t framebuffer_a[NES_WIDTH * NES_HEIGHT * 4];
-uint32_t framebuffer_b[NES_WIDTH * NES_HEIGHT * 4];
-float speed = 1.0f;
+void callback_execute_ppu(void *cookie)
+{
+    ((emu_t*)cookie)->ppu->execute();
+}
 
-void callback_execute_cpu(void *cookie)
+void callback_execute_apu(void *cookie)
 {
-    validator_ref->bus_activities.push_back(emulator_ref->memory->cpu_mem.activity);
+    emu_t* emu = (emu_t*)cookie;
+    float output = emu->apu->execute();
+    if (emu->audio) emu->audio->buffer_data( output );
 }
 
-void callback_execute_ppu(void *cookie)
+} // anonymous
+
+emu_t::~emu_t()
 {
-    emulator_ref->ppu.execute();
+    release();
 }
 
-void callback_execute_apu(void *cookie)
+void emu_t::release()
 {
-    float output = emulator_ref->apu.execute();
-    audio_ref->buffer_data( output );
+    if (memory) memory->~mem_t(); // Final battery flush, destroys the mapper
+    cpu = nullptr;
+    ppu = nullptr;
+    apu = nullptr;
+    memory = nullptr;
+    front_buffer = nullptr;
+    back_buffer = nullptr;
+    framebuffers = nullptr;
+    state_size = 0;
+    arena.release();
 }
 
-void audio_callback(ma_device* device, void* output, const void* input, ma_uint32 frame_count)
+void emu_t::reserve_state( size_t mem_size, size_t cartridge_bytes )
+{ // Reservations in the same order as the allocations below and in mem_t::init
+    release();
+    arena.reserve( sizeof(cpu_t) );
+    arena.reserve( sizeof(ppu_t) );
+    arena.reserve( sizeof(apu_t) );
+    arena.reserve( mem_size );
+    arena.reserve( cartridge_bytes );
+    arena.reserve( dirty_pages_t::words_for( arena.capacity ) * 2 * sizeof(uint64_t) ); // Bounds the state
+    arena.reserve( FRAMEBUFFER_SIZE * sizeof(uint32_t) * 2 );
+    arena.commit();
+
+    cpu = arena.construct<cpu_t>();
+    ppu = arena.construct<ppu_t>();
+    apu = arena.construct<apu_t>();
+}
+
+void emu_t::attach_framebuffers()
 {
-    (void)input;   /* Unused. */
-    float* frames_out = (float*)output;
-    audio_t::audio_data_t* data = (audio_t::audio_data_t*)device->pUserData;
-    float amplitude = data->amplitude;
+    state_size = arena.used;
+    framebuffers = (uint32_t*)arena.allocate( FRAMEBUFFER_SIZE * sizeof(uint32_t) * 2 );
+    front_buffer = framebuffers;
+    back_buffer = framebuffers + FRAMEBUFFER_SIZE;
+}
 
-    void* buffer;    
-    data->drift = ma_rb_pointer_distance(&data->ring_buffer);
-    if (data->drift > DRIFT_CORRECTION_THRESHOLD) {
-        ma_rb_seek_read(&data->ring_buffer, DRIFT_CORRECTION_SKIP);
-        LOG_W("Audio lagging behind, skipping forward.");
-    }
+void emu_t::attach_dirty_pages()
+{ // After the framebuffers, outside the state
+    dirty_pages_t& dirty = memory->dirty;
+    dirty.attach( arena.data, state_size, (uint64_t*)arena.allocate( dirty_pages_t::words_for( state_size ) * 2 * sizeof(uint64_t) ) );
+
+    // Palette, VRAM and OAM are next to each other
+    ppu_mem_t& ppu_mem = memory->ppu_mem;
+    dirty.track( memory->cpu_mem.internal_ram, sizeof(memory->cpu_mem.internal_ram) );
+    dirty.track( ppu_mem.palette, (const uint8_t*)&ppu_mem.soam - ppu_mem.palette );
+    if (memory->cartridge_mem.prg_ram) dirty.track( memory->cartridge_mem.prg_ram, memory->cartridge_mem.prg_ram_size );
+    if (memory->cartridge_mem.chr_ram) dirty.track( memory->cartridge_mem.chr_ram, memory->cartridge_mem.chr_ram_size );
+}
 
-    size_t size_in_bytes = frame_count * sizeof(float);
-    ma_rb_acquire_read(&data->ring_buffer, &size_in_bytes, &buffer);
+void emu_t::init(const shared_rom_t& shared_rom, audio_t* audio_backend)
+{
+    rom = shared_rom;
+    init(*rom, audio_backend);
+    LOG_I("Shared ROM image: %u KB (%ld references)", rom->image_size / 1024, rom.use_count());
+}
 
-    size_t ready_frames = size_in_bytes / sizeof(float);
-    memcpy(data->tmp_buffer, buffer, size_in_bytes);
-    ma_rb_commit_read(&data->ring_buffer, size_in_bytes);
+void emu_t::init(const ines_rom_t &rom, audio_t* audio_backend)
+{
+    register_mappers();
 
-    for (ma_uint32 frame = 0; frame < frame_count; ++frame)
-    {
-        if (frame < ready_frames)
-        {
-            amplitude = data->tmp_buffer[frame];
-        }
+    audio = audio_backend;
+    if (audio) LOG_I("Audio interface initiated (%s)", audio->name());
 
-        for (ma_uint32 channel = 0; channel < device->playback.channels; ++channel)
-        {
-            frames_out[frame*device->playback.channels + channel] = amplitude;
-        }
-    }
-    
-    data->amplitude = amplitude;
+    reserve_state( sizeof(mem_t), mem_t::arena_bytes( &rom ) );
+    memory = arena.construct<mem_t>();
+    memory->init( rom, arena, save_file );
+    attach_framebuffers();
+    attach_dirty_pages();
+
+    cpu->init( nullptr, &callback_execute_ppu, &callback_execute_apu, memory, this );
+    ppu->init( memory, back_buffer );
+    apu->init( memory );
+
+    // Everything but the ROM image is private to this instance
+    LOG_I("Instance memory: %u KB in one block (%u KB state)", (uint32_t)(arena.capacity / 1024), (uint32_t)(state_size / 1024));
 }
 
-} // anonymous
+void emu_t::init_nsf(mapper_t* nsf_mapper, audio_t* audio_backend)
+{ // Sound only, the PPU is never clocked
+    audio = audio_backend;
 
-emu_t::~emu_t()
-{
-    if (memory) delete memory;
+    reserve_state( sizeof(mem_t), mem_t::arena_bytes( nullptr ) );
+    memory = arena.construct<mem_t>();
+    memory->init( nsf_mapper, arena );
+    attach_framebuffers();
+    attach_dirty_pages();
+
+    cpu->init( nullptr, nullptr, &callback_execute_apu, memory, this );
+    ppu->init( memory, back_buffer );
+    apu->init( memory );
 }
 
-void emu_t::init(ines_rom_t &rom)
-{
-    emulator_ref = this;
-    front_buffer = framebuffer_a;
-    back_buffer = framebuffer_b;
+void emu_t::init_testsuite()
+{ // Headless CPU only, bus activity is read from memory->cpu_bus
+    register_mappers();
 
-    instantiate_mappers();
+    reserve_state( sizeof(mem_dummy_t), 0 );
+    memory = arena.construct<mem_dummy_t>();
+    attach_framebuffers();
+    attach_dirty_pages();
 
-    if (audio_ref) delete audio_ref;
-    audio_ref = new audio_t();
-    LOG_I("Audio interface initiated");
+    cpu->init( nullptr, nullptr, nullptr, memory, this );
+    ppu->init( memory, back_buffer );
+    apu->init( memory );
+}
 
-    memory = new mem_t();
-    memory->init( rom );
-    cpu.init( nullptr, &callback_execute_ppu, &callback_execute_apu, memory );
-    ppu.init( memory, back_buffer );
-    apu.init( memory );
+void emu_t::snapshot( uint8_t* out ) const
+{
+    memcpy( out, arena.data, state_size );
 }
 
-void emu_t::init_testsuite(void* validator)
-{ // Headless CPU only
-    emulator_ref = this;
-    validator_ref = (jsontest_validator*)validator;
+void emu_t::snapshot_dirty( uint8_t* out, uint64_t* pages )
+{
+    dirty_pages_t& dirty = memory->dirty;
+    for (size_t word = 0; word < dirty.words; ++word)
+    {
+        uint64_t bits = dirty.written[word] | dirty.always[word];
+        dirty.written[word] = 0;
+        if (pages) pages[word] = bits;
+        while (bits)
+        {
+            const size_t offset = (word * 64 + __builtin_ctzll( bits )) << dirty_pages_t::PAGE_SHIFT;
+            const size_t bytes = state_size - offset < dirty_pages_t::PAGE_SIZE ? state_size - offset : dirty_pages_t::PAGE_SIZE;
+            memcpy( out + offset, arena.data + offset, bytes );
+            bits &= bits - 1;
+        }
+    }
+}
 
-    instantiate_mappers();
-    memory = new nes::mem_dummy_t();
+void emu_t::restore( const uint8_t* in )
+{
+    // Only pages the snapshot changes are copied and dirtied, the next
+    // incremental snapshot stays small when little differs
+    dirty_pages_t& dirty = memory->dirty;
+    for (size_t offset = 0; offset < state_size; offset += dirty_pages_t::PAGE_SIZE)
+    {
+        const size_t bytes = state_size - offset < dirty_pages_t::PAGE_SIZE ? state_size - offset : dirty_pages_t::PAGE_SIZE;
+        if (memcmp( arena.data + offset, in + offset, bytes ) == 0) continue;
+        memcpy( arena.data + offset, in + offset, bytes );
+        dirty.mark( arena.data + offset );
+    }
 
-    cpu.init( &callback_execute_cpu, nullptr, nullptr, memory );
-    ppu.init( memory, back_buffer );
-    apu.init( memory );
+    // The PPU pointer says which framebuffer was the back buffer
+    back_buffer = ppu->output;
+    front_buffer = (back_buffer == framebuffers) ? framebuffers + FRAMEBUFFER_SIZE : framebuffers;
 }
 
 void emu_t::swap_framebuffers()
@@ -125,18 +192,25 @@ void emu_t::swap_framebuffers()
     back_buffer = tmp;
 }
 
+void emu_t::flip_frame()
+{
+    swap_framebuffers();
+    memory->end_frame();
+    ppu->output = back_buffer;
+    if (memory->movie) memory->movie->end_frame();
+}
+
 RESULT emu_t::step_cycles(int32_t cycles)
 {
-    speed = (float)cycles / 29780.0;
+    if (audio) audio->speed = (float)cycles / 29780.0;
     while (cycles > 0)
     {
-        bool start_in_vblank = ppu.check_vblank();
-        cycles -= cpu.execute();
-        bool end_in_vblank = ppu.check_vblank();
+        bool start_in_vblank = ppu->check_vblank();
+        cycles -= cpu->execute();
+        bool end_in_vblank = ppu->check_vblank();
         if (start_in_vblank && !end_in_vblank) 
         { // Entered vblank, flip frame buffer
-            swap_framebuffers();
-            ppu.output = back_buffer;
+            flip_frame();
         }
     }
     return RESULT_OK;
@@ -147,13 +221,12 @@ uint16_t emu_t::step_vblank()
     uint16_t cycles_executed = 0;
     while (true)
     {
-        bool start_in_vblank = ppu.check_vblank();
-        cycles_executed += cpu.execute();
-        bool end_in_vblank = ppu.check_vblank();
+        bool start_in_vblank = ppu->check_vblank();
+        cycles_executed += cpu->execute();
+        bool end_in_vblank = ppu->check_vblank();
         if (start_in_vblank && !end_in_vblank) 
         { // Entered vblank, flip frame buffer
-            swap_framebuffers();
-            ppu.output = back_buffer;
+            flip_frame();
             break;
         }
     }
@@ -161,68 +234,17 @@ uint16_t emu_t::step_vblank()
     return cycles_executed;
 }
 
-void audio_t::buffer_data( float amplitude)
-{
-    storage[stored_data++] = amplitude;
-
-    if (cycle_count++ > (float)CYCLES_PER_CB * speed)
-    {
-        sample_data();
-        cycle_count = 0;
-    }
-}
-
-audio_t::audio_t()
+bool emu_t::step_instruction()
 {
-    if (ma_rb_init(DEVICE_SAMPLE_RATE * sizeof(float), NULL, NULL, &data.ring_buffer) != MA_SUCCESS)
+    bool start_in_vblank = ppu->check_vblank();
+    cpu->execute();
+    bool end_in_vblank = ppu->check_vblank();
+    if (start_in_vblank && !end_in_vblank)
     {
-        LOG_E("Failed to initialize ring buffer.");
-        throw;
+        flip_frame();
+        return true;
     }
-
-    deviceConfig = ma_device_config_init(ma_device_type_playback);
-    deviceConfig.playback.format   = DEVICE_FORMAT;
-    deviceConfig.playback.channels = DEVICE_CHANNELS;
-    deviceConfig.sampleRate        = DEVICE_SAMPLE_RATE;
-    deviceConfig.dataCallback      = audio_callback;
-    deviceConfig.pUserData         = &data;
-
-    if (ma_device_init(NULL, &deviceConfig, &device) != MA_SUCCESS) {
-        LOG_E("Failed to open playback device.");
-        throw;
-    }
-
-    if (ma_device_start(&device) != MA_SUCCESS) {
-        LOG_E("Failed to start playback device.");
-        ma_device_uninit(&device);
-        throw;
-    }
-}
-
-audio_t::~audio_t()
-{
-    ma_rb_uninit(&data.ring_buffer);
-    ma_device_uninit(&device);
-}
-
-void audio_t::sample_data()
-{
-    if (stored_data < FRAMES_PER_CB) return; // Not enough frames ready to be sampled
-
-    const float sample_offset = (float)stored_data / (float)FRAMES_PER_CB;
-    size_t size_in_bytes = FRAMES_PER_CB * sizeof(float);
-
-    size_t j = 0;
-    for (float i = 0.0; i < stored_data; i += sample_offset)
-    {
-        data.tmp_buffer[j++] = storage[(int)i];
-    }
-    stored_data = 0;
-
-    ma_rb_acquire_write(&data.ring_buffer, &size_in_bytes, &buffer);
-    memcpy(buffer, data.tmp_buffer, size_in_bytes);
-    ma_rb_commit_write(&data.ring_buffer, size_in_bytes);
-
+    return false;
 }
 
 
@@ -0,0 +1,189 @@
+#include "explore.hpp"
+#include "battery.hpp"
+#include "logging.hpp"
+#include "state_hash.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#define EXPLORE_FORK
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace nes
+{
+
+namespace
+{
+typedef std::chrono::high_resolution_clock clock;
+
+inline uint64_t elapsed_ns( clock::time_point start )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+}
+
+#if defined(EXPLORE_FORK)
+void run_branch( emu_t& emu, uint32_t index, explorer_t::branch_t branch, void* cookie, explore_result_t& result )
+{ // In the child, the instance is its own copy from here on
+    mem_t* memory = emu.memory;
+    cartridge_mem_t& cart = memory->cartridge_mem;
+    if (memory->battery)
+    { // The save file is the parent's and its writer thread wasn't forked
+        memcpy( cart.prg_ram, memory->battery->data, cart.prg_ram_size );
+        cart.map_sram( cart.prg_ram );
+        memory->battery = nullptr;
+    }
+    emu.audio = nullptr;
+    memory->movie = nullptr;
+
+    const uint32_t start_frame = emu.ppu->frame_num;
+    auto start = clock::now();
+    try
+    {
+        result.score = branch( emu, index, cookie );
+    }
+    catch (RESULT)
+    {
+        result.status = explore_result_t::STATUS_FAILED;
+        return;
+    }
+    result.run_ns = elapsed_ns( start );
+    result.frames = emu.ppu->frame_num - start_frame;
+    result.ram_hash = hash64( memory->cpu_mem.internal_ram, sizeof(memory->cpu_mem.internal_ram) );
+    result.status = explore_result_t::STATUS_DONE;
+}
+#endif
+
+} // anonymous
+
+explorer_t::~explorer_t()
+{
+    close();
+}
+
+bool explorer_t::open( uint32_t max_branches )
+{
+    close();
+#if defined(EXPLORE_FORK)
+    results_bytes = (size_t)max_branches * sizeof(explore_result_t);
+    void* table = mmap( nullptr, results_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if (table == MAP_FAILED)
+    {
+        LOG_E("Failed to map the results table for %u branches", max_branches);
+        results_bytes = 0;
+        return false;
+    }
+    results = (explore_result_t*)table;
+    capacity = max_branches;
+    forks = fork_ns = fork_max_ns = 0;
+    return true;
+#else
+    (void)max_branches;
+    LOG_E("Forked branches aren't supported on this platform");
+    return false;
+#endif
+}
+
+void explorer_t::close()
+{
+#if defined(EXPLORE_FORK)
+    if (results) munmap( results, results_bytes );
+#endif
+    results = nullptr;
+    results_bytes = 0;
+    capacity = 0;
+}
+
+bool explorer_t::explore( emu_t& emu, uint32_t count, uint32_t parallel, branch_t branch, void* cookie )
+{
+#if defined(EXPLORE_FORK)
+    if (!results || count > capacity)
+    {
+        LOG_E("Results table holds %u branches, %u asked for", capacity, count);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) results[i] = { explore_result_t::STATUS_PENDING, 0, 0, 0, 0 };
+    if (parallel == 0) parallel = 1;
+
+    std::vector<std::pair<pid_t, uint32_t>> running; // Child and its branch
+    uint32_t next = 0;
+    while (next < count || !running.empty())
+    {
+        if (next < count && running.size() < parallel)
+        {
+            auto start = clock::now();
+            const pid_t pid = fork();
+            if (pid == 0)
+            { // Nothing of the parent is cleaned up in the child
+                run_branch( emu, next, branch, cookie, results[next] );
+                _exit( results[next].status == explore_result_t::STATUS_DONE ? 0 : 1 );
+            }
+            const uint64_t ns = elapsed_ns( start );
+            if (pid < 0)
+            {
+                if (running.empty())
+                {
+                    LOG_E("Failed to fork branch %u", next);
+                    for (; next < count; ++next) results[next].status = explore_result_t::STATUS_FAILED;
+                }
+                else
+                {
+                    parallel = (uint32_t)running.size(); // Out of processes, wait for one
+                }
+                continue;
+            }
+            ++forks;
+            fork_ns += ns;
+            if (ns > fork_max_ns) fork_max_ns = ns;
+            running.push_back( std::make_pair( pid, next++ ) );
+            continue;
+        }
+
+        // Only the branches are waited on, other children of the host are
+        // left alone. Finished ones are collected first, with none the
+        // oldest is waited for.
+        size_t done = running.size();
+        int status = 0;
+        for (size_t i = 0; i < running.size() && done == running.size(); ++i)
+        {
+            const pid_t pid = waitpid( running[i].first, &status, WNOHANG );
+            if (pid < 0 && errno != EINTR) status = -1; // Reaped by someone else, the result says how it went
+            if (pid == running[i].first || status == -1) done = i;
+        }
+        if (done == running.size())
+        {
+            const pid_t pid = waitpid( running.front().first, &status, 0 );
+            if (pid < 0 && errno == EINTR) continue;
+            done = 0;
+            if (pid < 0) status = -1;
+        }
+
+        explore_result_t& result = results[running[done].second];
+        if (result.status != explore_result_t::STATUS_DONE)
+        {
+            result.status = explore_result_t::STATUS_FAILED;
+            if (status == -1) LOG_W("Branch %u failed", running[done].second);
+            else LOG_W("Branch %u failed (%s %d)", running[done].second, WIFSIGNALED(status) ? "signal" : "exit code",
+                WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        }
+        running.erase( running.begin() + done );
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (results[i].status == explore_result_t::STATUS_PENDING) results[i].status = explore_result_t::STATUS_FAILED;
+    }
+    return true;
+#else
+    (void)emu; (void)count; (void)parallel; (void)branch; (void)cookie;
+    LOG_E("Forked branches aren't supported on this platform");
+    return false;
+#endif
+}
+
+} // nes
@@ -0,0 +1,342 @@
+#include "archive.hpp"
+
+#include <cstring>
+
+namespace nes
+{
+
+/*
+*   Raw DEFLATE (RFC 1951) decoder. Input is consumed through a 64-bit bit
+*   buffer and output goes straight into the caller's buffer, which doubles
+*   as the 32KB history window. Huffman codes up to HUFFMAN_FAST_BITS long
+*   are decoded with one table lookup, longer ones walk the canonical code.
+*/
+
+namespace
+{
+constexpr uint32_t HUFFMAN_MAX_BITS  = 15;
+constexpr uint32_t HUFFMAN_FAST_BITS = 10;
+constexpr uint32_t MAX_LITLEN_CODES  = 288;
+constexpr uint32_t MAX_DIST_CODES    = 30;
+
+const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Order the code length code lengths are stored in
+const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct bit_reader_t
+{
+    bit_reader_t( const uint8_t* in, uint32_t in_size ) : data( in ), size( in_size ) { }
+
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t position{0}; // Next byte to load, runs past size when zero padding
+    uint64_t bits{0};
+    uint32_t count{0};
+
+    inline void refill()
+    {
+        if (position + 8 <= size)
+        { // Whole word, bits above count already hold the following input so ORing it again is harmless
+            uint64_t word;
+            memcpy( &word, &data[position], sizeof(word) ); // Little endian, like the rest of the emulator
+            bits |= word << count;
+            const uint32_t bytes = (63 - count) >> 3;
+            position += bytes;
+            count += bytes * 8;
+            return;
+        }
+        while (count <= 56)
+        {
+            const uint64_t byte = position < size ? data[position] : 0;
+            bits |= byte << count;
+            count += 8;
+            ++position;
+        }
+    }
+
+    inline uint32_t peek( uint32_t n ) const { return (uint32_t)bits & ((1u << n) - 1); }
+    inline void     drop( uint32_t n ) { bits >>= n; count -= n; }
+
+    inline uint32_t get( uint32_t n )
+    { // n <= 32, the buffer holds at least 57 bits after a refill
+        if (count < n) refill();
+        const uint32_t value = peek( n );
+        drop( n );
+        return value;
+    }
+
+    // Bytes actually consumed, false once decoding ran into the padding
+    inline bool overrun() const { return position - count / 8 > size; }
+};
+
+struct huffman_t
+{
+    uint16_t fast[1 << HUFFMAN_FAST_BITS]; // (symbol << 4) | length, 0 for longer codes
+    uint16_t count[HUFFMAN_MAX_BITS + 1];  // Codes per length
+    uint16_t symbol[MAX_LITLEN_CODES];     // Symbols in canonical order
+
+    bool build( const uint8_t* lengths, uint32_t codes )
+    {
+        memset( count, 0, sizeof(count) );
+        for (uint32_t i = 0; i < codes; ++i) count[lengths[i]]++;
+        count[0] = 0;
+
+        int32_t left = 1;
+        for (uint32_t length = 1; length <= HUFFMAN_MAX_BITS; ++length)
+        { // Over-subscribed sets can't be decoded, incomplete ones are allowed
+            left = (left << 1) - count[length];
+            if (left < 0) return false;
+        }
+
+        uint16_t offsets[HUFFMAN_MAX_BITS + 2];
+        offsets[1] = 0;
+        for (uint32_t length = 1; length <= HUFFMAN_MAX_BITS; ++length)
+        {
+            offsets[length + 1] = offsets[length] + count[length];
+        }
+        for (uint32_t i = 0; i < codes; ++i)
+        {
+            if (lengths[i]) symbol[offsets[lengths[i]]++] = i;
+        }
+
+        // Codes are stored MSB first but read LSB first, so the table is
+        // indexed with the bit-reversed code
+        memset( fast, 0, sizeof(fast) );
+        uint32_t code = 0;
+        uint32_t index = 0;
+        for (uint32_t length = 1; length <= HUFFMAN_FAST_BITS; ++length)
+        {
+            for (uint32_t i = 0; i < count[length]; ++i, ++index, ++code)
+            {
+                uint32_t reversed = 0;
+                for (uint32_t bit = 0; bit < length; ++bit)
+                {
+                    reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+                }
+                const uint16_t entry = (uint16_t)((symbol[index] << 4) | length);
+                for (uint32_t fill = reversed; fill < (1u << HUFFMAN_FAST_BITS); fill += 1u << length)
+                {
+                    fast[fill] = entry;
+                }
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+
+    inline int32_t decode( bit_reader_t& reader ) const
+    {
+        if (reader.count < HUFFMAN_MAX_BITS) reader.refill();
+
+        const uint16_t entry = fast[ reader.peek( HUFFMAN_FAST_BITS ) ];
+        if (entry)
+        {
+            reader.drop( entry & 0xF );
+            return entry >> 4;
+        }
+
+        // Longer code, walk the canonical code one bit at a time
+        int32_t code = 0;
+        int32_t first = 0;
+        int32_t index = 0;
+        for (uint32_t length = 1; length <= HUFFMAN_MAX_BITS; ++length)
+        {
+            code |= (int32_t)((reader.bits >> (length - 1)) & 1);
+            const int32_t codes = count[length];
+            if (code - first < codes)
+            {
+                reader.drop( length );
+                return symbol[index + code - first];
+            }
+            index += codes;
+            first = (first + codes) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+};
+
+struct inflater_t
+{
+    inflater_t( const uint8_t* in, uint32_t in_size, uint8_t* output, uint32_t output_size ) :
+        reader( in, in_size ), out( output ), out_size( output_size ) { }
+
+    bit_reader_t reader;
+    uint8_t*  out;
+    uint32_t  out_size;
+    uint32_t  out_position{0};
+    huffman_t litlen;
+    huffman_t dist;
+
+    bool stored_block()
+    {
+        reader.drop( reader.count & 7 ); // Byte align
+        const uint32_t length = reader.get( 16 );
+        if ((reader.get( 16 ) ^ 0xFFFF) != length) return false;
+        if (length > out_size - out_position) return false;
+
+        // Whole bytes still in the bit buffer first, then straight from the input
+        uint32_t remaining = length;
+        while (remaining > 0 && reader.count >= 8)
+        {
+            out[out_position++] = (uint8_t)reader.get( 8 );
+            --remaining;
+        }
+        if (remaining > 0)
+        { // The bit buffer is empty, drop its read-ahead as decoding resumes after the copy
+            reader.bits = 0;
+            if (reader.position + remaining > reader.size) return false;
+            memcpy( &out[out_position], &reader.data[reader.position], remaining );
+            reader.position += remaining;
+            out_position += remaining;
+        }
+        return true;
+    }
+
+    bool fixed_tables()
+    {
+        uint8_t lengths[MAX_LITLEN_CODES + MAX_DIST_CODES];
+        uint32_t i = 0;
+        for (; i < 144; ++i) lengths[i] = 8;
+        for (; i < 256; ++i) lengths[i] = 9;
+        for (; i < 280; ++i) lengths[i] = 7;
+        for (; i < MAX_LITLEN_CODES; ++i) lengths[i] = 8;
+        for (; i < MAX_LITLEN_CODES + MAX_DIST_CODES; ++i) lengths[i] = 5;
+        return litlen.build( lengths, MAX_LITLEN_CODES ) &&
+               dist.build( &lengths[MAX_LITLEN_CODES], MAX_DIST_CODES );
+    }
+
+    bool dynamic_tables()
+    {
+        const uint32_t litlen_codes = reader.get( 5 ) + 257;
+        const uint32_t dist_codes   = reader.get( 5 ) + 1;
+        const uint32_t length_codes = reader.get( 4 ) + 4;
+        if (litlen_codes > 286 || dist_codes > MAX_DIST_CODES) return false;
+
+        uint8_t lengths[MAX_LITLEN_CODES + MAX_DIST_CODES] = { 0 };
+        for (uint32_t i = 0; i < length_codes; ++i)
+        {
+            lengths[code_length_order[i]] = (uint8_t)reader.get( 3 );
+        }
+        huffman_t code_lengths;
+        if (!code_lengths.build( lengths, 19 )) return false;
+
+        // Literal/length and distance code lengths share one run-length stream
+        const uint32_t total = litlen_codes + dist_codes;
+        uint32_t index = 0;
+        while (index < total)
+        {
+            const int32_t symbol = code_lengths.decode( reader );
+            if (symbol < 0) return false;
+            if (symbol < 16)
+            {
+                lengths[index++] = (uint8_t)symbol;
+                continue;
+            }
+
+            uint8_t  repeat_length = 0;
+            uint32_t repeat;
+            if (symbol == 16)
+            {
+                if (index == 0) return false;
+                repeat_length = lengths[index - 1];
+                repeat = 3 + reader.get( 2 );
+            }
+            else if (symbol == 17) repeat = 3 + reader.get( 3 );
+            else                   repeat = 11 + reader.get( 7 );
+
+            if (index + repeat > total) return false;
+            while (repeat--) lengths[index++] = repeat_length;
+        }
+
+        if (lengths[256] == 0) return false; // No end of block code
+        memmove( &lengths[MAX_LITLEN_CODES], &lengths[litlen_codes], dist_codes );
+        memset( &lengths[litlen_codes], 0, MAX_LITLEN_CODES - litlen_codes );
+        memset( &lengths[MAX_LITLEN_CODES + dist_codes], 0, MAX_DIST_CODES - dist_codes );
+        return litlen.build( lengths, MAX_LITLEN_CODES ) &&
+               dist.build( &lengths[MAX_LITLEN_CODES], MAX_DIST_CODES );
+    }
+
+    bool compressed_block()
+    {
+        while (true)
+        {
+            const int32_t symbol = litlen.decode( reader );
+            if (symbol < 256)
+            {
+                if (symbol < 0 || out_position >= out_size) return false;
+                out[out_position++] = (uint8_t)symbol;
+                continue;
+            }
+            if (symbol == 256) return true;
+
+            const uint32_t length_code = symbol - 257;
+            if (length_code >= 29) return false;
+            const uint32_t length = length_base[length_code] + reader.get( length_extra[length_code] );
+
+            const int32_t dist_code = dist.decode( reader );
+            if (dist_code < 0 || dist_code >= 30) return false;
+            const uint32_t distance = dist_base[dist_code] + reader.get( dist_extra[dist_code] );
+
+            if (distance > out_position || length > out_size - out_position) return false;
+
+            // Overlapping copies repeat the last distance bytes, copy the
+            // pattern in growing chunks that never overlap their source
+            uint8_t* target = &out[out_position];
+            const uint8_t* source = target - distance;
+            uint32_t available = distance;
+            uint32_t remaining = length;
+            while (remaining > 0)
+            {
+                const uint32_t chunk = remaining < available ? remaining : available;
+                memcpy( target, source, chunk );
+                target += chunk;
+                remaining -= chunk;
+                available += chunk;
+            }
+            out_position += length;
+        }
+    }
+
+    bool run()
+    {
+        bool last = false;
+        while (!last)
+        {
+            last = reader.get( 1 ) != 0;
+            bool ok;
+            switch (reader.get( 2 ))
+            {
+                case 0:  ok = stored_block(); break;
+                case 1:  ok = fixed_tables() && compressed_block(); break;
+                case 2:  ok = dynamic_tables() && compressed_block(); break;
+                default: ok = false; break;
+            }
+            if (!ok || reader.overrun()) return false;
+        }
+        return out_position == out_size;
+    }
+};
+
+} // anonymous
+
+bool inflate( const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size )
+{
+    inflater_t inflater( in, in_size, out, out_size );
+    return inflater.run();
+}
+
+} // nes
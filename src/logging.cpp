@@ -6,11 +6,15 @@
 namespace nes
 {
 
+bool log_info_muted = false;
+
 void _log(LOG_LEVEL level, const char* buffer, ...)
 {
     static char _buffer[2048];
     static va_list va;
 
+    if (level == L_INFO && log_info_muted) return;
+
     va_start(va, buffer);
     vsnprintf(_buffer, 2048, buffer, va);
     va_end(va);
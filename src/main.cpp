@@ -1,12 +1,26 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
 #include <MiniFB.h>
 
 #include "logging.hpp"
 #include "nes.hpp"
+#include "audio.hpp"
+#include "nsf.hpp"
+#include "rom_db.hpp"
 #include "debug_render.hpp"
+#include "rewind.hpp"
+#include "movie.hpp"
+#include "run_ahead.hpp"
+#include "state_hash.hpp"
+#include "explore.hpp"
 #include "test/jsontest_validator.hpp"
+#include "test/savestate_validator.hpp"
 #include "test/nestest_validator.hpp"
 
 namespace 
@@ -21,9 +35,45 @@ bool json_test = false;
 bool validate = false;
 bool validate_log = false;
 bool debug = false;
+uint8_t apu_mute_mask = 0x00;
+const char* audio_stats_filepath = nullptr;
+nes::audio_config_t audio_config{};
+
+// NSF
+int      nsf_track = -1; // 1 based, -1 = starting song (all songs when rendering)
+uint32_t nsf_seconds = 120;
+const char* nsf_render_filepath = nullptr;
 
 float emu_speed = 1.0;
 
+// Benchmark
+uint32_t bench_iterations = 0;
+
+// Save state round trip
+uint32_t state_test_frames = 0;
+
+// Rewind, held key steps back a frame per frame
+uint32_t rewind_megabytes = 32;
+bool rewinding = false;
+
+// Input movies
+const char* movie_record_filepath = nullptr;
+const char* movie_play_filepath = nullptr;
+uint32_t movie_seek_frame = 0;
+
+// State hash streams of a movie replay, and two streams to compare
+const char* hash_out_filepath = nullptr;
+int64_t     hash_frame = -1; // Per instruction hashes of this frame instead of per frame
+const char* hash_diff_filepaths[2] = { nullptr, nullptr };
+
+// Forked branches, each holding its own input for a number of frames
+uint32_t explore_branches = 0;
+uint32_t explore_frames = 0;
+
+// Run-ahead, frames shown ahead of the committed one
+uint32_t run_ahead_frames = 0;
+bool run_ahead_second_instance = false;
+
 void keyboard_callback(struct mfb_window *window, mfb_key key, mfb_key_mod mod, bool isPressed)
 {
     nes::emu_t* emu = (nes::emu_t*)mfb_get_user_data(window);
@@ -39,6 +89,8 @@ void keyboard_callback(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
         case KB_KEY_LEFT:  emu->memory->gamepad[0].left   = isPressed; break;
         case KB_KEY_RIGHT: emu->memory->gamepad[0].right  = isPressed; break;
 
+        case KB_KEY_BACKSPACE: rewinding = isPressed; break;
+
         case KB_KEY_0: emu_speed = 0.00; break;
         case KB_KEY_1: emu_speed = 0.33; break;
         case KB_KEY_2: emu_speed = 0.50; break;
@@ -48,6 +100,7 @@ void keyboard_callback(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
         case KB_KEY_6: emu_speed = 1.50; break;
         case KB_KEY_7: emu_speed = 1.66; break;
         case KB_KEY_8: emu_speed = 2.00; break;
+        case KB_KEY_9: emu_speed = 4.00; break;
 
         default: break;
     }
@@ -60,6 +113,407 @@ void keyboard_callback(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
 
 }
 
+uint8_t parse_channel_list(const char* list)
+{ // Comma separated channel names, e.g. "pulse1,noise"
+    static const char* channel_names[nes::apu_t::CH_COUNT] = { "pulse1", "pulse2", "triangle", "noise", "dmc" };
+    uint8_t mask = 0x00;
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    for (char* name = strtok(buffer, ","); name != nullptr; name = strtok(nullptr, ","))
+    {
+        bool found = false;
+        for (auto i = 0; i < nes::apu_t::CH_COUNT; ++i)
+        {
+            if (strcmp(name, channel_names[i]) == 0)
+            {
+                mask |= (1 << i);
+                found = true;
+            }
+        }
+        if (!found) printf("Unknown APU channel '%s'\n", name);
+    }
+    return mask;
+}
+
+void apply_apu_settings(nes::emu_t &emu)
+{
+    for (auto i = 0; i < nes::apu_t::CH_COUNT; ++i)
+    {
+        emu.apu->set_channel_mute( (nes::apu_t::CHANNEL)i, (apu_mute_mask >> i) & 0x1 );
+    }
+}
+
+// --audio-stats, every backend of a rendering run goes to the same file
+void write_audio_stats(const nes::audio_t* audio, bool append)
+{
+    if (!audio || !audio_stats_filepath) return;
+    FILE* stats_file = fopen(audio_stats_filepath, append ? "a" : "w");
+    if (stats_file)
+    {
+        fprintf(stats_file, "backend: %s\n", audio->name());
+        audio->stats.write_report(stats_file);
+        fclose(stats_file);
+    }
+    else printf("Failed to write audio stats to '%s'\n", audio_stats_filepath);
+}
+
+nes::RESULT run_nsf(const char* filepath, const char* audio_backend)
+{
+    nes::nsf_t nsf{};
+    nes::emu_t emu{};
+    nes::nsf_player_t player{};
+    nsf.load_from_file(filepath);
+
+    if (nsf_render_filepath)
+    { // Offline rendering, one WAV per track
+        std::string stem = nsf_render_filepath;
+        size_t ext = stem.rfind(".wav");
+        if (ext != std::string::npos) stem.erase(ext);
+
+        uint8_t first = nsf_track > 0 ? nsf_track - 1 : 0;
+        uint8_t last  = nsf_track > 0 ? nsf_track - 1 : nsf.header.total_songs - 1;
+
+        player.init(&emu, &nsf, nullptr);
+        apply_apu_settings(emu);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint16_t track = first; track <= last; ++track)
+        {
+            char path[512];
+            snprintf(path, sizeof(path), "wav:%s_%02u.wav", stem.c_str(), track + 1);
+            nes::audio_t* audio = nes::create_audio_backend(path, audio_config);
+            if (!audio) return nes::RESULT_INVALID_ARGUMENTS;
+
+            emu.audio = audio;
+            player.start_track(track);
+            player.render(nsf_seconds);
+            emu.audio = nullptr;
+            write_audio_stats(audio, track != first);
+            delete audio;
+            printf("Rendered %s\n", path + 4);
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        double seconds = elapsed / 1000000.0;
+        uint32_t tracks = last - first + 1;
+        printf("%u tracks in %.2fs (%.1f tracks/min, %.1fx realtime)\n", tracks, seconds,
+            tracks * 60.0 / seconds, tracks * (double)nsf_seconds / seconds);
+        return nes::RESULT_OK;
+    }
+
+    // Real-time playback
+    nes::audio_t* audio = nes::create_audio_backend(audio_backend, audio_config);
+    if (!audio) return nes::RESULT_INVALID_ARGUMENTS;
+    player.init(&emu, &nsf, audio);
+    apply_apu_settings(emu);
+    player.start_track(nsf_track > 0 ? nsf_track - 1 : nsf.header.starting_song - 1);
+    printf("Playing track %u/%u for %us\n", player.track + 1, nsf.header.total_songs, nsf_seconds);
+
+    const auto period = std::chrono::microseconds(nsf.header.ntsc_speed ? nsf.header.ntsc_speed : microseconds_per_frame);
+    const uint64_t frames = (uint64_t)nsf_seconds * 1000000 / period.count();
+    auto next = std::chrono::high_resolution_clock::now();
+    for (uint64_t frame = 0; frame < frames; ++frame)
+    {
+        player.play_frame();
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    write_audio_stats(audio, false);
+    delete audio;
+    return nes::RESULT_OK;
+}
+
+nes::RESULT run_bench(const char* filepath)
+{ // Instance creation against snapshot cost, nothing is rendered
+    typedef std::chrono::high_resolution_clock clock;
+    nes::shared_rom_t rom = nes::load_shared_rom(filepath);
+    nes::log_info_muted = true;
+
+    auto start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i)
+    {
+        nes::emu_t instance{};
+        instance.save_file = false;
+        instance.init(rom, nullptr);
+    }
+    double create_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    // Time to first frame from the file, load share included (compare a .zip against the raw .nes)
+    double load_ns = 0.0;
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i)
+    {
+        auto load_start = clock::now();
+        nes::ines_rom_t cold_rom{};
+        cold_rom.load_from_file(filepath);
+        load_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - load_start).count();
+        nes::emu_t instance{};
+        instance.save_file = false;
+        instance.init(cold_rom, nullptr);
+        instance.step_vblank();
+    }
+    double first_frame_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+    load_ns /= (double)bench_iterations;
+
+    // Snapshot a running game rather than a freshly reset one
+    nes::emu_t emu{};
+    emu.save_file = false; // Frames, loaded states and rewinds never reach the game's save
+    emu.init(rom, nullptr);
+    const uint32_t frames = 60;
+    start = clock::now();
+    for (uint32_t i = 0; i < frames; ++i) emu.step_vblank();
+    double frame_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)frames;
+
+    std::vector<uint8_t> state(emu.snapshot_size());
+    uint8_t* buffer = state.data();
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i) emu.snapshot(buffer);
+    double snapshot_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i) emu.restore(buffer);
+    double restore_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    // Incremental snapshots, one per frame like the rewind history takes them. A
+    // frame leaves the caches cold, full snapshots are timed after one as well
+    std::vector<uint8_t> full(emu.snapshot_size());
+    std::vector<uint64_t> pages(emu.dirty_page_words());
+    double dirty_ns = 0.0;
+    double cold_snapshot_ns = 0.0;
+    uint32_t dirty_pages = 0;
+    emu.snapshot_dirty(buffer);
+    for (uint32_t i = 0; i < frames * 2; ++i)
+    {
+        emu.step_vblank();
+        auto snapshot_start = clock::now();
+        if (i % 2)
+        {
+            emu.snapshot(full.data());
+            cold_snapshot_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - snapshot_start).count();
+            continue;
+        }
+        emu.snapshot_dirty(buffer, pages.data());
+        dirty_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - snapshot_start).count();
+        for (uint64_t bits : pages) dirty_pages += __builtin_popcountll(bits);
+    }
+    dirty_ns /= frames;
+    cold_snapshot_ns /= frames;
+
+    std::vector<uint8_t> save(emu.save_state_size());
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i) emu.save_state(save.data());
+    double save_state_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i) emu.load_state(save.data(), save.size());
+    double load_state_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    // State hashing, the whole snapshot at once
+    uint64_t hash_sum = 0;
+    start = clock::now();
+    for (uint32_t i = 0; i < bench_iterations; ++i) hash_sum += nes::hash64(buffer, state.size(), i);
+    double hash_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)bench_iterations;
+
+    // Rewind history over ten seconds of play, then all the way back
+    nes::rewind_t history{};
+    nes::rewind_stats_t recorded{};
+    nes::rewind_stats_t rewound{};
+    if (rewind_megabytes > 0 && history.open(emu, (size_t)rewind_megabytes << 20))
+    {
+        for (uint32_t i = 0; i < 600; ++i)
+        {
+            emu.step_vblank();
+            history.push(emu);
+        }
+        history.step_back(emu); // Waits for the worker
+        recorded = history.stats();
+        while (history.step_back(emu)) {}
+        rewound = history.stats();
+    }
+
+    // Run-ahead host frames, single and second instance, 1 and 2 frames ahead
+    double run_ahead_us[2][2];
+    for (uint32_t second = 0; second < 2; ++second)
+    {
+        for (uint32_t ahead_frames = 1; ahead_frames <= 2; ++ahead_frames)
+        {
+            nes::run_ahead_t run_ahead{};
+            run_ahead.init(emu, ahead_frames, second == 1);
+            for (uint32_t i = 0; i < frames; ++i) run_ahead.frame();
+            run_ahead_us[second][ahead_frames - 1] = run_ahead.frame_us();
+        }
+    }
+
+    nes::log_info_muted = false;
+    printf("%u iterations, %zu byte state\n", bench_iterations, emu.snapshot_size());
+    printf("  create   %10.0f ns\n", create_ns);
+    printf("  snapshot %10.0f ns (%.3f%% of a frame)\n", snapshot_ns, snapshot_ns * 100.0 / frame_ns);
+    printf("  restore  %10.0f ns\n", restore_ns);
+    printf("  dirty    %10.0f ns (%.1f of %zu pages per frame, full snapshot after a frame %.0f ns)\n", dirty_ns, (double)dirty_pages / frames,
+        (emu.snapshot_size() + nes::dirty_pages_t::PAGE_SIZE - 1) / nes::dirty_pages_t::PAGE_SIZE, cold_snapshot_ns);
+    printf("  save     %10.0f ns (%zu byte save state)\n", save_state_ns, save.size());
+    printf("  load     %10.0f ns\n", load_state_ns);
+    printf("  frame    %10.0f ns\n", frame_ns);
+    printf("  hash     %10.0f ns (%.1f GB/s, %016llx)\n", hash_ns, state.size() / hash_ns, (unsigned long long)hash_sum);
+    printf("  first frame %7.0f ns (load %.0f ns)\n", first_frame_ns, load_ns);
+    for (uint32_t ahead_frames = 1; ahead_frames <= 2; ++ahead_frames)
+    {
+        printf("  run-ahead %u %7.0f us per host frame (%.2f frames), second instance %.0f us\n", ahead_frames,
+            run_ahead_us[0][ahead_frames - 1], run_ahead_us[0][ahead_frames - 1] * 1000.0 / frame_ns,
+            run_ahead_us[1][ahead_frames - 1]);
+    }
+    if (recorded.frames > 0)
+    {
+        const double frame_bytes = (double)recorded.stored_bytes / recorded.frames;
+        printf("  rewind   %10.1f us push (%.0f bytes copied), %.1f us encode (max %.1f), %.0f bytes/frame, %u skipped\n",
+            recorded.push_us, recorded.push_bytes, recorded.encode_us, recorded.encode_max_us, frame_bytes, (uint32_t)recorded.skipped);
+        printf("  rewind   %10.1f us step back (max %.1f), %.1f minutes in %u MB\n",
+            rewound.step_back_us, rewound.step_back_max_us, (rewind_megabytes << 20) / frame_bytes / 3600.0, rewind_megabytes);
+    }
+    return nes::RESULT_OK;
+}
+
+int64_t explore_branch(nes::emu_t& emu, uint32_t branch, void* cookie)
+{ // New input every 8 frames from a generator seeded by the branch, scored by the RAM bytes it changed
+    const uint32_t frames = *(const uint32_t*)cookie;
+    uint8_t start_ram[sizeof(emu.memory->cpu_mem.internal_ram)];
+    memcpy(start_ram, emu.memory->cpu_mem.internal_ram, sizeof(start_ram));
+
+    uint32_t seed = branch * 2654435761u + 1;
+    for (uint32_t frame = 0; frame < frames; ++frame)
+    {
+        if (frame % 8 == 0)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            emu.memory->gamepad[0].data = (uint8_t)seed;
+        }
+        emu.step_vblank();
+    }
+
+    int64_t changed = 0;
+    for (size_t i = 0; i < sizeof(start_ram); ++i) changed += start_ram[i] != emu.memory->cpu_mem.internal_ram[i];
+    return changed;
+}
+
+nes::RESULT run_explore(const char* filepath)
+{ // Branches from a movie frame (--play, --seek) or two seconds after power on
+    typedef std::chrono::high_resolution_clock clock;
+    nes::shared_rom_t rom = nes::load_shared_rom(filepath);
+    nes::emu_t emu{};
+    emu.save_file = false; // Replays never touch the game's save
+    emu.init(rom, nullptr);
+
+    nes::movie_t movie{};
+    if (movie_play_filepath)
+    {
+        if (!movie.load(movie_play_filepath)) return nes::RESULT_INVALID_ARGUMENTS;
+        movie.play(emu);
+        movie.seek(movie_seek_frame);
+        movie.detach();
+    }
+    else
+    {
+        for (uint32_t i = 0; i < 120; ++i) emu.step_vblank();
+    }
+
+    nes::explorer_t explorer{};
+    if (!explorer.open(explore_branches)) return nes::RESULT_ERROR;
+    const uint32_t parallel = std::thread::hardware_concurrency();
+    auto start = clock::now();
+    if (!explorer.explore(emu, explore_branches, parallel, &explore_branch, &explore_frames)) return nes::RESULT_ERROR;
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count() / 1000000.0;
+
+    uint32_t done = 0;
+    uint32_t best = 0;
+    double run_ms = 0.0;
+    std::vector<uint64_t> outcomes;
+    for (uint32_t i = 0; i < explore_branches; ++i)
+    {
+        const nes::explore_result_t& result = explorer[i];
+        if (result.status != nes::explore_result_t::STATUS_DONE) continue;
+        ++done;
+        run_ms += result.run_ns / 1000000.0;
+        if (result.score > explorer[best].score || explorer[best].status != nes::explore_result_t::STATUS_DONE) best = i;
+        if (std::find(outcomes.begin(), outcomes.end(), result.ram_hash) == outcomes.end()) outcomes.push_back(result.ram_hash);
+    }
+    printf("Explored %u of %u branches x %u frames in %.2fs (%u at a time), fork %.0f us (max %.0f), %.1f ms per branch\n",
+        done, explore_branches, explore_frames, seconds, parallel, explorer.fork_us(), explorer.fork_max_us(), done ? run_ms / done : 0.0);
+    if (done > 0) printf("%zu distinct RAM outcomes, branch %u changed the most RAM (%lld bytes)\n",
+        outcomes.size(), best, (long long)explorer[best].score);
+    return done == explore_branches ? nes::RESULT_OK : nes::RESULT_ERROR;
+}
+
+nes::RESULT run_movie(const char* filepath)
+{ // Headless replay, the hash of the last frame tells runs apart
+    typedef std::chrono::high_resolution_clock clock;
+    nes::shared_rom_t rom = nes::load_shared_rom(filepath);
+    nes::emu_t emu{};
+    emu.save_file = false; // Replays never touch the game's save
+    emu.init(rom, nullptr);
+
+    nes::movie_t movie{};
+    if (!movie.load(movie_play_filepath)) return nes::RESULT_INVALID_ARGUMENTS;
+    movie.play(emu);
+
+    if (hash_frame >= 0)
+    { // The instructions of one frame, from the state after the frame before it
+        if (hash_frame < 1 || hash_frame > movie.frames())
+        {
+            printf("Frame %lld is not in the movie (1 - %u)\n", (long long)hash_frame, movie.frames());
+            return nes::RESULT_INVALID_ARGUMENTS;
+        }
+        movie.seek((uint32_t)hash_frame - 1);
+        nes::state_hash_stream_t stream{};
+        if (!hash_out_filepath || !stream.open(hash_out_filepath, emu, nes::state_hash_stream_t::KIND_INSTRUCTIONS))
+        {
+            printf("--hash-frame needs --hash-out <file>\n");
+            return nes::RESULT_INVALID_ARGUMENTS;
+        }
+        uint32_t instruction = 0;
+        stream.record(emu, instruction);
+        while (!emu.step_instruction()) stream.record(emu, ++instruction);
+        stream.record(emu, ++instruction);
+        printf("Hashed %u instructions of frame %lld, %.1f us per instruction\n", instruction, (long long)hash_frame,
+            stream.hash_ns / 1000.0 / stream.records);
+        return nes::RESULT_OK;
+    }
+
+    if (movie_seek_frame > 0)
+    {
+        auto start = clock::now();
+        movie.seek(movie_seek_frame);
+        double seek_ms = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count() / 1000.0;
+        printf("Seeked to frame %u in %.1f ms\n", movie.frame, seek_ms);
+    }
+
+    nes::state_hash_stream_t stream{};
+    if (hash_out_filepath && !stream.open(hash_out_filepath, emu, nes::state_hash_stream_t::KIND_FRAMES)) return nes::RESULT_ERROR;
+
+    const uint32_t first_frame = movie.frame;
+    auto start = clock::now();
+    while (!movie.finished())
+    {
+        emu.step_vblank();
+        stream.record(emu, movie.frame);
+    }
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count() / 1000000.0;
+    if (stream.records > 0) printf("Hashed %llu frames, %.1f us per frame\n", (unsigned long long)stream.records,
+        stream.hash_ns / 1000.0 / stream.records);
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint32_t i = 0; i < NES_WIDTH * NES_HEIGHT; ++i)
+    {
+        hash ^= emu.front_buffer[i];
+        hash *= 0x100000001B3ULL;
+    }
+    const uint32_t played = movie.frame - first_frame;
+    printf("Played %u frames in %.2fs (%.0f fps), %u desynced, last frame %016llx\n", played, seconds,
+        seconds > 0.0 ? played / seconds : 0.0, movie.desyncs, (unsigned long long)hash);
+    return movie.desyncs == 0 ? nes::RESULT_OK : nes::RESULT_ERROR;
+}
+
 } // anonymous
 
 int main(int argc, char *argv[])
@@ -67,6 +521,7 @@ int main(int argc, char *argv[])
     const char* rom_filepath = nes_test_rom;
     const char* validate_log_filepath;
     const char* json_test_filepath;
+    const char* audio_backend = "miniaudio";
     for ( auto i = 1; i < argc; ++i )
     {
         if ( strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--validate") == 0 )
@@ -93,6 +548,244 @@ int main(int argc, char *argv[])
             }
         }
 
+        if ( strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mute") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                apu_mute_mask = parse_channel_list(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with APU channels to mute\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--audio") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                audio_backend = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with audio backend\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--audio-format") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                if (!audio_config.parse(argv[++i])) return nes::RESULT_INVALID_ARGUMENTS;
+                continue;
+            } else {
+                printf("Missing argument with audio format\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--audio-stats") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                audio_stats_filepath = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with audio stats path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--romdb") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                if (!nes::rom_db.open(argv[++i])) return nes::RESULT_INVALID_ARGUMENTS;
+                continue;
+            } else {
+                printf("Missing argument with ROM database path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--track") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                nsf_track = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with NSF track number\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--render") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                nsf_render_filepath = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with NSF render path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--seconds") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                nsf_seconds = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with NSF track length\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--bench") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                bench_iterations = atoi(argv[++i]);
+                if (bench_iterations == 0) bench_iterations = 1;
+                continue;
+            } else {
+                printf("Missing argument with benchmark iterations\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--state-test") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                state_test_frames = atoi(argv[++i]);
+                if (state_test_frames == 0) state_test_frames = 1;
+                continue;
+            } else {
+                printf("Missing argument with save state test frames\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--rewind") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                rewind_megabytes = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with rewind buffer size\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--record") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                movie_record_filepath = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with movie path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--play") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                movie_play_filepath = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with movie path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--seek") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                movie_seek_frame = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with movie frame\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--hash-out") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                hash_out_filepath = argv[++i];
+                continue;
+            } else {
+                printf("Missing argument with state hash path\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--hash-frame") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                hash_frame = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with movie frame\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--hash-diff") == 0 )
+        {
+            if (i + 2 < argc)
+            {
+                hash_diff_filepaths[0] = argv[++i];
+                hash_diff_filepaths[1] = argv[++i];
+                continue;
+            } else {
+                printf("Missing arguments with two state hash paths\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--explore") == 0 )
+        {
+            if (i + 2 < argc)
+            {
+                explore_branches = atoi(argv[++i]);
+                explore_frames = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing arguments with branch and frame counts\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--run-ahead") == 0 )
+        {
+            if (i + 1 < argc)
+            {
+                run_ahead_frames = atoi(argv[++i]);
+                continue;
+            } else {
+                printf("Missing argument with run-ahead frames\n");
+                return nes::RESULT_INVALID_ARGUMENTS;
+            }
+        }
+
+        if ( strcmp(argv[i], "--second-instance") == 0 )
+        {
+            run_ahead_second_instance = true;
+            continue;
+        }
+
         if ( strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0 )
         {
             debug = true;
@@ -110,7 +803,28 @@ int main(int argc, char *argv[])
             printf("       -h | --help      (print this help)\n");
             printf("       -v | --validate  (validation execution)\n");
             printf("       -v <validation_log_path>  (validate against provided log file)\n");
-            printf("       -j <path to json test>    (validate CPU against JSON test)\n");
+            printf("       -j <path to json test>    (validate CPU against JSON test, Debug builds)\n");
+            printf("       -m | --mute <channels>    (mute APU channels: pulse1,pulse2,triangle,noise,dmc)\n");
+            printf("       -a | --audio <backend>    (miniaudio (default), null, wav:<path> or raw:<path>)\n");
+            printf("       --audio-format <opts>     (f32|s16, mono|stereo, 44100|48000|96000, period=<frames>)\n");
+            printf("       --audio-stats <path>      (write audio latency and health stats on exit)\n");
+            printf("       --romdb <path>            (correct known bad headers from a ROM database)\n");
+            printf("       --bench <n>               (time loading, instance creation, snapshots and save states, n iterations)\n");
+            printf("       --state-test <frames>     (save state round trip, compares frames after a load)\n");
+            printf("       --rewind <MB>             (rewind history size, default 32, 0 disables, hold backspace to rewind)\n");
+            printf("       --record <movie>          (record input to a movie, rewind is off while recording)\n");
+            printf("       --play <movie>            (replay a movie or FM2 headless, prints the last frame hash)\n");
+            printf("       --seek <frame>            (with --play, jump to the frame before playing the rest)\n");
+            printf("       --hash-out <file>         (with --play, write state hashes of every frame)\n");
+            printf("       --hash-frame <n>          (with --play and --hash-out, hash every instruction of frame n instead)\n");
+            printf("       --hash-diff <a> <b>       (compare two state hash files, prints where they first differ)\n");
+            printf("       --explore <n> <frames>    (fork n branches with their own input for frames, from --play/--seek or power on)\n");
+            printf("       --run-ahead <n>           (show n frames ahead to hide input lag, runs at normal speed)\n");
+            printf("       --second-instance         (with --run-ahead, run ahead in a second instance)\n");
+            printf("NSF flags:\n");
+            printf("       -t | --track <n>          (play track n, 1 based)\n");
+            printf("       -s | --seconds <n>        (track length, default 120)\n");
+            printf("       -r | --render <out.wav>   (render offline to <out>_NN.wav, all tracks unless -t)\n");
             return nes::RESULT_OK;
         }
 
@@ -124,22 +838,50 @@ int main(int argc, char *argv[])
     printf("--- NESscape ---\n");
     nes::RESULT ret = nes::RESULT_OK;
 
-    nes::ines_rom_t rom{};
     nes::emu_t emu{};
+    nes::audio_t* audio = nullptr;
 
     try
     {
-        if (json_test)
+        if (hash_diff_filepaths[0])
+        { // State hash comparison, no ROM involved
+            ret = nes::compare_state_hashes(hash_diff_filepaths[0], hash_diff_filepaths[1]) ? nes::RESULT_OK : nes::RESULT_ERROR;
+        }
+        else if (nes::nsf_t::is_nsf_file(rom_filepath))
+        { // NSF Playback
+            ret = run_nsf(rom_filepath, audio_backend);
+        }
+        else if (bench_iterations > 0)
+        { // Benchmark
+            ret = run_bench(rom_filepath);
+        }
+        else if (explore_branches > 0)
+        { // Forked input search
+            ret = run_explore(rom_filepath);
+        }
+        else if (movie_play_filepath)
+        { // Movie replay
+            ret = run_movie(rom_filepath);
+        }
+        else if (state_test_frames > 0)
+        { // Save state round trip
+            nes::shared_rom_t rom = nes::load_shared_rom(rom_filepath);
+            nes::savestate_validator validator{};
+            ret = validator.run(rom, state_test_frames, state_test_frames);
+        }
+        else if (json_test)
         { // Json Tests
             nes::jsontest_validator validator{};
-            emu.init_testsuite(&validator);
+            emu.init_testsuite();
             validator.init( &emu, json_test_filepath );
             ret = validator.run_tests();
         } 
         else if (validate)
         { // NesTest Validation
-            rom.load_from_file(rom_filepath);
-            emu.init(rom);
+            nes::shared_rom_t rom = nes::load_shared_rom(rom_filepath);
+            audio = nes::create_audio_backend(audio_backend, audio_config);
+            if (!audio) throw nes::RESULT_INVALID_ARGUMENTS;
+            emu.init(rom, audio);
 
             nes::nestest_validator validator{};
             ret = validator.init( &emu, validate_log_filepath, validate_log ) ;
@@ -157,8 +899,21 @@ int main(int argc, char *argv[])
         }
         else
         { // Regular Execution
-            rom.load_from_file(rom_filepath);
-            emu.init(rom);
+            nes::shared_rom_t rom = nes::load_shared_rom(rom_filepath);
+            audio = nes::create_audio_backend(audio_backend, audio_config);
+            if (!audio) throw nes::RESULT_INVALID_ARGUMENTS;
+            emu.init(rom, audio);
+            apply_apu_settings(emu);
+
+            // Rewinding would leave the movie ahead of the game
+            nes::movie_t movie{};
+            nes::rewind_t history{};
+            if (movie_record_filepath) movie.record(emu);
+            else if (rewind_megabytes > 0) history.open(emu, (size_t)rewind_megabytes << 20);
+
+            nes::run_ahead_t run_ahead{};
+            if (run_ahead_frames > 0) run_ahead.init(emu, run_ahead_frames, run_ahead_second_instance);
+            uint32_t* picture = emu.front_buffer;
 
             struct mfb_window *window = 0x0;
             struct mfb_window *nt_window = 0x0;
@@ -193,20 +948,54 @@ int main(int argc, char *argv[])
                 } else if (time < std::chrono::microseconds(0)) 
                 { // Window minimized or something, reset the correction
                     time = std::chrono::microseconds(0);
+                } else if (rewinding && history.enabled())
+                { // Back to the previous state, then render it again without sound
+                    if (history.step_back(emu))
+                    {
+                        emu.audio = nullptr;
+                        emu.step_vblank();
+                        emu.audio = audio;
+                    }
+                    picture = emu.front_buffer;
+                } else if (run_ahead_frames > 0)
+                { // Whole frames at normal speed, 0 still pauses
+                    if (emu_speed > 0.0)
+                    {
+                        run_ahead.frame();
+                        history.push(emu);
+                    }
+                    picture = run_ahead.picture;
                 } else 
                 {
                     emu.step_cycles(29780 * emu_speed);
+                    if (emu_speed > 0.0) history.push(emu);
+                    picture = emu.front_buffer;
                 }
 
                 if (debug)
                 {
-                    nes::cpu_t::regs_t& regs = emu.cpu.regs;
-                    nes::draw_text( emu.front_buffer, 1, 1,  "PC   A  X  Y  SR SP CYC");
-                    nes::draw_text( emu.front_buffer, 1, 10, 
+                    nes::cpu_t::regs_t& regs = emu.cpu->regs;
+                    nes::draw_text( picture, 1, 1,  "PC   A  X  Y  SR SP CYC");
+                    nes::draw_text( picture, 1, 10, 
                         "%04X %02X %02X %02X %02X %02X %08X",
-                        regs.PC, regs.A, regs.X, regs.Y, regs.SR, regs.SP, emu.cpu.cycles);
-                    nes::draw_text( emu.front_buffer, 1, 19, "EMU %d%%", (int)(emu_speed*100));
-                    nes::draw_text( emu.front_buffer, 30, NES_HEIGHT - 10, 
+                        regs.PC, regs.A, regs.X, regs.Y, regs.SR, regs.SP, emu.cpu->cycles);
+                    nes::draw_text( picture, 1, 19, "EMU %d%%", (int)(emu_speed*100));
+                    nes::draw_text( picture, 1, 28, "AUD %dMS P99 %dMS UR %u FILL %d%%",
+                        (int)audio->stats.latency_ms.percentile(0.5f), (int)audio->stats.latency_ms.percentile(0.99f),
+                        (uint32_t)audio->stats.underruns.load(), (int)audio->stats.ring_fill.percentile(0.5f));
+                    if (run_ahead_frames > 0)
+                    {
+                        nes::draw_text( picture, 1, 46, "RUN %u %dUS AHEAD %dUS",
+                            run_ahead_frames, (int)run_ahead.frame_us(), (int)run_ahead.ahead_us());
+                    }
+                    if (history.enabled())
+                    {
+                        nes::rewind_stats_t rewind_stats = history.stats();
+                        nes::draw_text( picture, 1, 37, "RWD %uS %uKB ENC %dUS PUSH %dUS",
+                            rewind_stats.frames / 60, (uint32_t)(rewind_stats.stored_bytes / 1024),
+                            (int)rewind_stats.encode_us, (int)rewind_stats.push_us);
+                    }
+                    nes::draw_text( picture, 30, NES_HEIGHT - 10, 
                         "A%c B%c SE%c ST%c U%c D%c L%c R%c",
                         DEBUG_DRAW_INPUT(emu.memory->gamepad[0].A),
                         DEBUG_DRAW_INPUT(emu.memory->gamepad[0].B),
@@ -223,9 +1012,23 @@ int main(int argc, char *argv[])
                     if ( mfb_update_ex( nt_window, nes::nt_window_buffer, NES_WIDTH * 2, NES_HEIGHT * 2) < 0 ) break;
                 }
 
-                if ( mfb_update_ex( window, emu.front_buffer, NES_WIDTH, NES_HEIGHT ) < 0 ) break;
+                if ( mfb_update_ex( window, picture, NES_WIDTH, NES_HEIGHT ) < 0 ) break;
             } while (mfb_wait_sync( window ));
             mfb_close( window );
+
+            if (movie_record_filepath)
+            {
+                movie.detach();
+                if (!movie.save(movie_record_filepath)) ret = nes::RESULT_ERROR;
+            }
+            if (history.enabled())
+            {
+                nes::rewind_stats_t rewind_stats = history.stats();
+                printf("Rewind: %u frames (%u keyframes) in %zu of %zu KB, push %.1f us (%.0f bytes), encode %.1f us (max %.1f), step back %.1f us (max %.1f), %u skipped\n",
+                    rewind_stats.frames, rewind_stats.keyframes, rewind_stats.stored_bytes / 1024, rewind_stats.memory_bytes / 1024,
+                    rewind_stats.push_us, rewind_stats.push_bytes, rewind_stats.encode_us, rewind_stats.encode_max_us,
+                    rewind_stats.step_back_us, rewind_stats.step_back_max_us, (uint32_t)rewind_stats.skipped);
+            }
             printf("Exiting gracefully...\n");
         }
     }
@@ -235,6 +1038,8 @@ int main(int argc, char *argv[])
     }
 
     printf("--- Shutting Down ---\n");
+    write_audio_stats(audio, false);
+    if (audio) delete audio;
 
     printf("Exiting with code %d %s\n", ret, RESULT_to_string(ret));
     return ret;
@@ -1,69 +1,187 @@
 #include "mappers.hpp"
 #include "logging.hpp"
+#include "savestate.hpp"
 #include <memory>
+#include <new>
 #include <cstring>
 
 namespace nes
 {
 
-mapper_t* mappers_lut[256] = { nullptr };
+mapper_factory_t mappers_lut[MAPPER_COUNT] = { nullptr };
 
-void instantiate_mappers()
+namespace
 {
-    mappers_lut[0]   = new mapper_nrom_t();
-    mappers_lut[1]   = new mapper_mmc1b_t();
-    mappers_lut[2]   = new mapper_uxrom_t();
-    mappers_lut[7]   = new mapper_axrom_t();
-    mappers_lut[94]  = new mapper_un1rom_t();
-    mappers_lut[180] = new mapper_unrom_configured_t();
+template<typename T, typename... Args>
+mapper_t* construct( void* storage, Args... args )
+{
+    static_assert( sizeof(T) <= MAPPER_STORAGE_SIZE, "Mapper does not fit MAPPER_STORAGE_SIZE" );
+    return new (storage) T( args... );
+}
+
+template<typename T>
+mapper_t* create( void* storage )
+{
+    return construct<T>( storage );
+}
+} // anonymous
 
-    uint8_t mappers_instantiated = 0;
-    for (uint16_t i = 0; i < 256; ++i) {
-        if (mappers_lut[i]) ++mappers_instantiated;
+void register_mappers()
+{
+    mappers_lut[0]   = &create<mapper_nrom_t>;
+    mappers_lut[1]   = &create<mapper_mmc1b_t>;
+    mappers_lut[2]   = &create<mapper_uxrom_t>;
+    mappers_lut[3]   = &create<mapper_cnrom_t>;
+    mappers_lut[4]   = &create<mapper_mmc3_t>;
+    mappers_lut[7]   = &create<mapper_axrom_t>;
+    mappers_lut[9]   = &create<mapper_mmc2_t>;
+    mappers_lut[10]  = &create<mapper_mmc4_t>;
+    mappers_lut[11]  = &create<mapper_color_dreams_t>;
+    mappers_lut[21]  = []( void* at ) -> mapper_t* { return construct<mapper_vrc_t>( at, (uint16_t)21 ); }; // VRC4a / VRC4c
+    mappers_lut[22]  = []( void* at ) -> mapper_t* { return construct<mapper_vrc_t>( at, (uint16_t)22 ); }; // VRC2a
+    mappers_lut[23]  = []( void* at ) -> mapper_t* { return construct<mapper_vrc_t>( at, (uint16_t)23 ); }; // VRC2b / VRC4e / VRC4f
+    mappers_lut[25]  = []( void* at ) -> mapper_t* { return construct<mapper_vrc_t>( at, (uint16_t)25 ); }; // VRC2c / VRC4b / VRC4d
+    mappers_lut[34]  = &create<mapper_bnrom_t>;
+    mappers_lut[66]  = &create<mapper_gxrom_t>;
+    mappers_lut[71]  = &create<mapper_camerica_t>;
+    mappers_lut[94]  = &create<mapper_un1rom_t>;
+    mappers_lut[180] = &create<mapper_unrom_configured_t>;
+
+    uint16_t mappers_registered = 0;
+    for (uint16_t i = 0; i < MAPPER_COUNT; ++i) {
+        if (mappers_lut[i]) ++mappers_registered;
     }
-    LOG_I("%u mappers instantiated", mappers_instantiated);
+    LOG_I("%u mappers registered", mappers_registered);
+}
+
+mapper_t* create_mapper( uint16_t identifier, void* storage )
+{
+    if (identifier >= MAPPER_COUNT) return nullptr;
+    return mappers_lut[identifier] ? mappers_lut[identifier]( storage ) : nullptr;
 }
 
 //////// mapper basic behaviour
 void mapper_t::init( mem_t* memory_ref ) {
     memory = memory_ref;
-    uint8_t prg_banks = memory->ines_rom->header.prg_size;
-    uint8_t chr_banks = memory->ines_rom->header.chr_size;
+    const uint32_t chr_rom_size = memory->ines_rom->chr_rom_size;
 
-    LOG_D("PRG Banks: %u (%u KB)", prg_banks, prg_banks*16);
-    LOG_D("CHR Banks: %u (%u KB)", chr_banks, chr_banks*8);
+    LOG_D("PRG Banks: %u (%u KB)", prg_16kb_banks(), memory->ines_rom->prg_rom_size / 1024);
+    LOG_D("CHR Banks: %u (%u KB)", chr_rom_size / CHR_8KB_SIZE, chr_rom_size / 1024);
 
-    // Map PRG ROM
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[0];
-    memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[prg_banks-1];
+    // Map PRG ROM, first and last 16KB
+    map_prg_16kb( 0, 0 );
+    map_prg_16kb( 1, prg_16kb_banks() - 1 );
 
-    // Map CHR ROM
-    if (chr_banks > 0) 
-    { // Cartridge contains CHR ROM
-        memcpy(memory->cartridge_mem.chr_rom.chr_bank_8kb, memory->ines_rom->chr_pages[0], CHR_8KB_SIZE);
-    }
+    // Map CHR ROM, or CHR RAM if the cartridge has none
+    memory->cartridge_mem.chr_writable = chr_rom_size == 0;
+    map_chr_8kb( 0 );
 }
 
 uint8_t mapper_t::cpu_read( uint16_t address ) {
-    if ( address < 0x6000 ) return memory->cartridge_mem.expansion_rom[ address - 0x4020 ];
-    if ( address < 0x8000 ) return memory->cartridge_mem.sram[ address  - 0x6000 ];
-    if ( address < 0xC000 ) return memory->cartridge_mem.prg_lower_bank[ address - 0x8000 ];
-    else return memory->cartridge_mem.prg_upper_bank[ address - 0xC000 ];
+    if ( address < 0x6000 ) return 0x00; // Nothing mapped
+    if ( address < 0x8000 ) return memory->cartridge_mem.read_sram( address - 0x6000 );
+    return memory->cartridge_mem.prg_banks[ (address - 0x8000) >> 13 ][ address & 0x1FFF ];
 }
 
 uint8_t mapper_t::ppu_read( uint16_t address ) {
-    return memory->cartridge_mem.chr_rom.chr_bank_8kb[ address ];
+    return memory->cartridge_mem.chr_banks[ address >> 10 ][ address & 0x3FF ];
 }
 
 void mapper_t::cpu_write( uint16_t address, uint8_t value ) {
     if ( address >= 0x6000 && address < 0x8000 )
     { // SRAM $6000 - $7FFF
-        memory->cartridge_mem.sram[ address - 0x6000 ] = value;
+        cartridge_mem_t& cart = memory->cartridge_mem;
+        cart.write_sram( address - 0x6000, value );
+        memory->dirty.mark( &cart.sram[ (address - 0x6000) & cart.sram_mask ] ); // Ignored for the battery file
     }
 }
 
 void mapper_t::ppu_write( uint16_t address, uint8_t value ) {
-    memory->cartridge_mem.chr_rom.chr_bank_8kb[ address ] = value;
+    if ( !memory->cartridge_mem.chr_writable ) return; // CHR ROM
+    uint8_t* ref = &memory->cartridge_mem.chr_banks[ address >> 10 ][ address & 0x3FF ];
+    *ref = value;
+    memory->dirty.mark( ref );
+}
+
+uint8_t mapper_t::ppu_snoop() const {
+    return SNOOP_NONE;
+}
+
+void mapper_t::ppu_a12_rise() {
+}
+
+void mapper_t::ppu_pattern_fetch( uint16_t address ) {
+}
+
+bool mapper_t::cpu_clocked() const {
+    return false;
+}
+
+void mapper_t::cpu_clock() {
+}
+
+void mapper_t::state_fields( state_section_t& section ) {
+}
+
+uint32_t mapper_t::prg_8kb_banks() const {
+    const uint32_t banks = memory->ines_rom->prg_rom_size / PRG_8KB_SIZE;
+    return banks ? banks : 1;
+}
+
+uint32_t mapper_t::prg_16kb_banks() const {
+    const uint32_t banks = memory->ines_rom->prg_rom_size / PRG_16KB_SIZE;
+    return banks ? banks : 1;
+}
+
+void mapper_t::map_prg_8kb( uint8_t window, uint32_t bank ) {
+    bank %= prg_8kb_banks();
+    memory->cartridge_mem.prg_banks[ window ] = memory->ines_rom->prg_pages[ bank / 2 ] + (bank % 2) * PRG_8KB_SIZE;
+}
+
+void mapper_t::map_prg_16kb( uint8_t window, uint32_t bank ) {
+    map_prg_8kb( window * 2,     bank * 2 );
+    map_prg_8kb( window * 2 + 1, bank * 2 + 1 );
+}
+
+void mapper_t::map_prg_32kb( uint32_t bank ) {
+    map_prg_16kb( 0, bank * 2 );
+    map_prg_16kb( 1, bank * 2 + 1 );
+}
+
+uint32_t mapper_t::chr_1kb_banks() const {
+    if ( memory->cartridge_mem.chr_writable || memory->ines_rom == nullptr ) {
+        return memory->cartridge_mem.chr_ram_size / CHR_1KB_SIZE;
+    }
+    return memory->ines_rom->chr_rom_size / CHR_1KB_SIZE;
+}
+
+void mapper_t::map_chr_1kb( uint8_t window, uint32_t bank ) {
+    bank %= chr_1kb_banks();
+    uint8_t* source;
+    if ( memory->cartridge_mem.chr_writable || memory->ines_rom == nullptr ) {
+        source = &memory->cartridge_mem.chr_ram[ bank * CHR_1KB_SIZE ];
+    } else {
+        // Never written through, ppu_write checks chr_writable
+        source = const_cast<uint8_t*>( memory->ines_rom->chr_pages[ bank / 8 ] ) + (bank % 8) * CHR_1KB_SIZE;
+    }
+    memory->cartridge_mem.chr_banks[ window ] = source;
+}
+
+void mapper_t::map_chr_2kb( uint8_t window, uint32_t bank ) {
+    map_chr_1kb( window * 2,     bank * 2 );
+    map_chr_1kb( window * 2 + 1, bank * 2 + 1 );
+}
+
+void mapper_t::map_chr_4kb( uint8_t window, uint32_t bank ) {
+    for (uint8_t i = 0; i < 4; ++i) {
+        map_chr_1kb( window * 4 + i, bank * 4 + i );
+    }
+}
+
+void mapper_t::map_chr_8kb( uint32_t bank ) {
+    for (uint8_t i = 0; i < 8; ++i) {
+        map_chr_1kb( i, bank * 8 + i );
+    }
 }
 
 //////// mapper 001 - MMC1B
@@ -75,7 +193,7 @@ void mapper_mmc1b_t::cpu_write( uint16_t address, uint8_t value ) {
     { // Clear
         sr = 0b10000;
         write = 0;
-        memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[memory->ines_rom->header.prg_size - 1];
+        map_prg_16kb( 1, prg_16kb_banks() - 1 );
         prg_bank_mode = 3;
     } else 
     { // Shift
@@ -108,26 +226,19 @@ void mapper_mmc1b_t::cpu_write( uint16_t address, uint8_t value ) {
                 chr_bank_mode = (pb & 0b10000) >> 4;
             } else if ( address < 0xC000 )
             { // CHR Bank 0
-                uint32_t size = chr_bank_mode == 0 ? CHR_8KB_SIZE : CHR_4KB_SIZE;
-                uint32_t  offset = chr_bank_mode == 0 ? 0 : (pb & 0b1 ? CHR_4KB_SIZE : 0);
-                uint8_t   bank = (pb & 0b11110) >> 1;
-                uint8_t** src = memory->ines_rom->chr_pages;
-                if (memory->ines_rom->header.chr_size == 0) 
-                { // CHR RAM
-                    src = memory->ines_rom->prg_pages;
+                if (chr_bank_mode == 0)
+                { // 8KB mode, low bit ignored
+                    map_chr_8kb( pb >> 1 );
+                } else
+                {
+                    map_chr_4kb( 0, pb );
                 }
-                memcpy(memory->cartridge_mem.chr_rom.chr_bank_8kb, src[bank] + offset, size);
-                
             } else if ( address < 0xE000 )
-            { // CHR Bank 1
-                uint8_t** src = memory->ines_rom->chr_pages;
-                uint32_t  offset = chr_bank_mode == 0 ? 0 : (pb & 0b1 ? CHR_4KB_SIZE : 0);
-                uint8_t   bank = (pb & 0b11110) >> 1;
-                if (memory->ines_rom->header.chr_size == 0) 
-                { // CHR RAM
-                    src = memory->ines_rom->prg_pages;
+            { // CHR Bank 1 (ignored in 8KB mode)
+                if (chr_bank_mode == 1)
+                {
+                    map_chr_4kb( 1, pb );
                 }
-                memcpy(memory->cartridge_mem.chr_rom.chr_bank_4kb_upper, src[bank] + offset, CHR_4KB_SIZE);
             } else
             { // PRG bank
                 switch (prg_bank_mode)
@@ -136,18 +247,18 @@ void mapper_mmc1b_t::cpu_write( uint16_t address, uint8_t value ) {
                     case 1:
                     { // 32KB mode
                         uint8_t bank = (pb & 0b1110) >> 1;
-                        memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[bank];
-                        memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[bank+1];
+                        map_prg_16kb( 0, bank );
+                        map_prg_16kb( 1, bank+1 );
                     } break;
                     case 2: 
                     { // 16KB mode - fixed first bank at low bank
-                        memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[0];
-                        memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[pb & 0b1111];
+                        map_prg_16kb( 0, 0 );
+                        map_prg_16kb( 1, pb & 0b1111 );
                     } break;
                     case 3: 
                     { // 16KB mode - fixed last bank at high bank
-                        memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[pb & 0b1111];
-                        memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[memory->ines_rom->header.prg_size - 1];
+                        map_prg_16kb( 0, pb & 0b1111 );
+                        map_prg_16kb( 1, prg_16kb_banks() - 1 );
                     } break;
                 }
             }
@@ -155,51 +266,517 @@ void mapper_mmc1b_t::cpu_write( uint16_t address, uint8_t value ) {
     }
 }
 
+void mapper_mmc1b_t::state_fields( state_section_t& section ) {
+    section.add( STATE_TAG('P','M','O','D'), prg_bank_mode );
+    section.add( STATE_TAG('C','M','O','D'), chr_bank_mode );
+    section.add( STATE_TAG('W','R','I','T'), write );
+    section.add( STATE_TAG('S','R',' ',' '), sr );
+    section.add( STATE_TAG('P','B',' ',' '), pb );
+}
+
 
 //////// mapper 002 - UxROM
 void mapper_uxrom_t::cpu_write( uint16_t address, uint8_t value ) {
     uint8_t bank = value & 0b00000111;
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[bank];
+    map_prg_16kb( 0, bank );
+}
+
+//////// mapper 003 - CNROM
+void mapper_cnrom_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0x8000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+    map_chr_8kb( value );
+}
+
+//////// mapper 004 - MMC3
+void mapper_mmc3_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+
+    bank_select = 0;
+    const uint8_t power_on[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+    memcpy( registers, power_on, sizeof(registers) );
+    prg_ram_enabled = true;
+    prg_ram_write_protect = false;
+    irq_latch = 0;
+    irq_counter = 0;
+    irq_reload = false;
+    irq_enabled = false;
+    update_banks();
+}
+
+uint8_t mapper_mmc3_t::ppu_snoop() const {
+    return SNOOP_A12; // Scanline counter
+}
+
+void mapper_mmc3_t::update_banks() {
+    const uint32_t second_last = prg_8kb_banks() - 2;
+    if ( bank_select & 0x40 )
+    { // $C000 swappable, $8000 fixed to the second last bank
+        map_prg_8kb( 0, second_last );
+        map_prg_8kb( 2, registers[6] & 0x3F );
+    } else
+    {
+        map_prg_8kb( 0, registers[6] & 0x3F );
+        map_prg_8kb( 2, second_last );
+    }
+    map_prg_8kb( 1, registers[7] & 0x3F );
+    map_prg_8kb( 3, second_last + 1 );
+
+    // R0/R1 select 2KB banks and R2-R5 1KB banks, A12 inversion swaps the halves
+    const uint8_t inversion = (bank_select & 0x80) ? 4 : 0;
+    map_chr_2kb( (0 ^ inversion) / 2, registers[0] >> 1 );
+    map_chr_2kb( (2 ^ inversion) / 2, registers[1] >> 1 );
+    map_chr_1kb( 4 ^ inversion, registers[2] );
+    map_chr_1kb( 5 ^ inversion, registers[3] );
+    map_chr_1kb( 6 ^ inversion, registers[4] );
+    map_chr_1kb( 7 ^ inversion, registers[5] );
+}
+
+uint8_t mapper_mmc3_t::cpu_read( uint16_t address ) {
+    if ( address >= 0x6000 && address < 0x8000 && !prg_ram_enabled ) return memory->cpu_bus.open_bus();
+    return mapper_t::cpu_read( address );
 }
 
 void mapper_mmc3_t::cpu_write( uint16_t address, uint8_t value ) {
-    // TODO
+    if ( address < 0x8000 )
+    {
+        if ( prg_ram_enabled && !prg_ram_write_protect ) mapper_t::cpu_write( address, value );
+        return;
+    }
+
+    const bool even = (address & 0x1) == 0;
+    switch ( address & 0xE000 )
+    {
+        case 0x8000:
+        { // Bank select / bank data
+            if ( even ) bank_select = value;
+            else registers[ bank_select & 0x7 ] = value;
+            update_banks();
+        } break;
+        case 0xA000:
+        { // Mirroring / PRG RAM protect
+            if ( even )
+            {
+                if ( BIT_CHECK_LO(memory->ines_rom->header.flags_6, 3) )
+                { // Ignored with four-screen VRAM
+                    memory->ppu_mem.nt_mirroring = (value & 0x1) ?
+                        ppu_mem_t::nametable_mirroring::horizontal :
+                        ppu_mem_t::nametable_mirroring::vertical;
+                }
+            }
+            else
+            {
+                prg_ram_enabled = value & 0x80;
+                prg_ram_write_protect = value & 0x40;
+            }
+        } break;
+        case 0xC000:
+        { // IRQ latch / IRQ reload
+            if ( even ) irq_latch = value;
+            else
+            {
+                irq_counter = 0;
+                irq_reload = true;
+            }
+        } break;
+        case 0xE000:
+        { // IRQ disable (and acknowledge) / IRQ enable
+            irq_enabled = !even;
+            if ( even ) memory->cartridge_irq = false;
+        } break;
+    }
+}
+
+void mapper_mmc3_t::ppu_a12_rise() {
+    if ( irq_counter == 0 || irq_reload )
+    {
+        irq_counter = irq_latch;
+        irq_reload = false;
+    } else
+    {
+        irq_counter--;
+    }
+
+    if ( irq_counter == 0 && irq_enabled )
+    {
+        memory->cartridge_irq = true;
+    }
+}
+
+void mapper_mmc3_t::state_fields( state_section_t& section ) {
+    section.add( STATE_TAG('B','S','E','L'), bank_select );
+    section.add( STATE_TAG('R','E','G','S'), registers );
+    section.add( STATE_TAG('R','A','M','E'), prg_ram_enabled );
+    section.add( STATE_TAG('R','A','M','P'), prg_ram_write_protect );
+    section.add( STATE_TAG('I','L','A','T'), irq_latch );
+    section.add( STATE_TAG('I','C','N','T'), irq_counter );
+    section.add( STATE_TAG('I','R','E','L'), irq_reload );
+    section.add( STATE_TAG('I','E','N','A'), irq_enabled );
 }
 
 //////// mapper 007 - AxROM
 void mapper_axrom_t::init( mem_t* memory_ref ) {
     mapper_t::init( memory_ref );
     // ReMap PRG banks
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[0];
-    memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[1];
+    map_prg_32kb( 0 );
 }
 
 void mapper_axrom_t::cpu_write( uint16_t address, uint8_t value ) {
     uint8_t prg_bank = (value & 0b00000111);
     uint8_t vram_page = (value & 0b00010000) >> 4;
     memory->ppu_mem.nt_mirroring = (ppu_mem_t::nametable_mirroring)(2 + vram_page);
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[(prg_bank*2)];
-    memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[(prg_bank*2)+1];
+    map_prg_32kb( prg_bank );
+}
+
+//////// mapper 009 - MMC2
+void mapper_mmc2_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+    memset( chr_registers, 0, sizeof(chr_registers) );
+    latch[0] = latch[1] = 1;
+
+    // $A000 - $FFFF fixed to the last three 8KB banks
+    const uint32_t last = prg_8kb_banks() - 1;
+    map_prg_8kb( 0, 0 );
+    map_prg_8kb( 1, last - 2 );
+    map_prg_8kb( 2, last - 1 );
+    map_prg_8kb( 3, last );
+    update_chr();
+}
+
+uint8_t mapper_mmc2_t::ppu_snoop() const {
+    return SNOOP_PATTERN; // CHR latches
+}
+
+void mapper_mmc2_t::map_prg( uint8_t value ) {
+    map_prg_8kb( 0, value & 0x0F );
+}
+
+void mapper_mmc2_t::update_chr() {
+    map_chr_4kb( 0, chr_registers[ 0 + latch[0] ] );
+    map_chr_4kb( 1, chr_registers[ 2 + latch[1] ] );
+}
+
+void mapper_mmc2_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0xA000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+
+    switch ( address & 0xF000 )
+    {
+        case 0xA000: map_prg( value ); break;
+        case 0xB000: chr_registers[0] = value & 0x1F; update_chr(); break; // $0000 FD
+        case 0xC000: chr_registers[1] = value & 0x1F; update_chr(); break; // $0000 FE
+        case 0xD000: chr_registers[2] = value & 0x1F; update_chr(); break; // $1000 FD
+        case 0xE000: chr_registers[3] = value & 0x1F; update_chr(); break; // $1000 FE
+        case 0xF000:
+        {
+            memory->ppu_mem.nt_mirroring = (value & 0x1) ?
+                ppu_mem_t::nametable_mirroring::horizontal :
+                ppu_mem_t::nametable_mirroring::vertical;
+        } break;
+    }
+}
+
+void mapper_mmc2_t::ppu_pattern_fetch( uint16_t address ) {
+    // Tiles $FD and $FE flip the latch of their pattern table once fetched
+    const uint16_t tile_row = address & 0x0FF8;
+    if ( tile_row != 0x0FD8 && tile_row != 0x0FE8 ) return;
+
+    const uint8_t table = address >> 12;
+    if ( table == 0 && exact_lower_latch && (address & 0x7) != 0 ) return; // MMC2 only reacts to $0FD8 / $0FE8
+
+    const uint8_t value = tile_row == 0x0FE8 ? 1 : 0;
+    if ( latch[table] == value ) return;
+    latch[table] = value;
+    update_chr();
+}
+
+void mapper_mmc2_t::state_fields( state_section_t& section ) {
+    section.add( STATE_TAG('C','R','E','G'), chr_registers );
+    section.add( STATE_TAG('L','T','C','H'), latch );
+}
+
+//////// mapper 010 - MMC4
+void mapper_mmc4_t::init( mem_t* memory_ref ) {
+    exact_lower_latch = false;
+    mapper_mmc2_t::init( memory_ref );
+    map_prg_16kb( 0, 0 );
+    map_prg_16kb( 1, prg_16kb_banks() - 1 );
+}
+
+void mapper_mmc4_t::map_prg( uint8_t value ) {
+    map_prg_16kb( 0, value & 0x0F );
+}
+
+//////// mapper 011 - Color Dreams
+void mapper_color_dreams_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+    map_prg_32kb( 0 );
+}
+
+void mapper_color_dreams_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0x8000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+    map_prg_32kb( value & 0x03 );
+    map_chr_8kb( value >> 4 );
+}
+
+//////// mapper 021, 022, 023, 025 - VRC2 / VRC4
+mapper_vrc_t::mapper_vrc_t( uint16_t mapper_number ) :
+    number( mapper_number ) { }
+
+void mapper_vrc_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+
+    // iNES numbers cover several boards, OR their select lines together
+    // unless a NES 2.0 submapper names the exact one
+    chr_shift = false;
+    vrc2 = false;
+    switch ( number )
+    {
+        case 21:
+        {
+            a0_lines = submapper == 1 ? 0x0002 : submapper == 2 ? 0x0040 : 0x0002 | 0x0040; // 1 VRC4a, 2 VRC4c
+            a1_lines = submapper == 1 ? 0x0004 : submapper == 2 ? 0x0080 : 0x0004 | 0x0080;
+        } break;
+        case 22:
+        { // VRC2a
+            a0_lines = 0x0002;
+            a1_lines = 0x0001;
+            chr_shift = true;
+            vrc2 = true;
+        } break;
+        case 23:
+        {
+            a0_lines = submapper == 2 ? 0x0004 : submapper ? 0x0001 : 0x0001 | 0x0004; // 1/3 VRC4f / VRC2b, 2 VRC4e
+            a1_lines = submapper == 2 ? 0x0008 : submapper ? 0x0002 : 0x0002 | 0x0008;
+            vrc2 = submapper == 3;
+        } break;
+        case 25:
+        {
+            a0_lines = submapper == 2 ? 0x0008 : submapper ? 0x0002 : 0x0002 | 0x0008; // 1/3 VRC4b / VRC2c, 2 VRC4d
+            a1_lines = submapper == 2 ? 0x0004 : submapper ? 0x0001 : 0x0001 | 0x0004;
+            vrc2 = submapper == 3;
+        } break;
+    }
+
+    memset( prg_registers, 0, sizeof(prg_registers) );
+    memset( chr_registers, 0, sizeof(chr_registers) );
+    prg_swap = false;
+    irq_latch = 0;
+    irq_counter = 0;
+    irq_prescaler = 341;
+    irq_enabled = false;
+    irq_enable_after_ack = false;
+    irq_cycle_mode = false;
+    update_banks();
+}
+
+void mapper_vrc_t::update_banks() {
+    const uint32_t second_last = prg_8kb_banks() - 2;
+    map_prg_8kb( prg_swap ? 2 : 0, prg_registers[0] );
+    map_prg_8kb( prg_swap ? 0 : 2, second_last );
+    map_prg_8kb( 1, prg_registers[1] );
+    map_prg_8kb( 3, second_last + 1 );
+
+    for (uint8_t i = 0; i < 8; ++i) {
+        map_chr_1kb( i, chr_shift ? chr_registers[i] >> 1 : chr_registers[i] );
+    }
+}
+
+void mapper_vrc_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0x8000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+
+    // Normalize the board specific select lines to registers 0 - 3
+    const uint8_t reg = ((address & a0_lines) ? 1 : 0) | ((address & a1_lines) ? 2 : 0);
+    switch ( address & 0xF000 )
+    {
+        case 0x8000: prg_registers[0] = value & 0x1F; update_banks(); break;
+        case 0xA000: prg_registers[1] = value & 0x1F; update_banks(); break;
+        case 0x9000:
+        {
+            if ( vrc2 )
+            { // Mirroring on the whole range, only the lowest bit is decoded
+                memory->ppu_mem.nt_mirroring = (value & 0x1) ? ppu_mem_t::nametable_mirroring::horizontal
+                                                             : ppu_mem_t::nametable_mirroring::vertical;
+            } else if ( reg == 0 )
+            { // Mirroring
+                switch ( value & 0x3 )
+                {
+                    case 0: memory->ppu_mem.nt_mirroring = ppu_mem_t::nametable_mirroring::vertical; break;
+                    case 1: memory->ppu_mem.nt_mirroring = ppu_mem_t::nametable_mirroring::horizontal; break;
+                    case 2: memory->ppu_mem.nt_mirroring = ppu_mem_t::nametable_mirroring::single_screen_lower; break;
+                    case 3: memory->ppu_mem.nt_mirroring = ppu_mem_t::nametable_mirroring::single_screen_higher; break;
+                }
+            } else if ( reg == 2 )
+            { // VRC4 PRG swap mode
+                prg_swap = value & 0x2;
+                update_banks();
+            }
+        } break;
+        case 0xB000:
+        case 0xC000:
+        case 0xD000:
+        case 0xE000:
+        { // Two 4 bit halves per 1KB CHR bank
+            uint16_t& bank = chr_registers[ ((address >> 12) - 0xB) * 2 + (reg >> 1) ];
+            if ( reg & 0x1 ) bank = (bank & 0x000F) | ((value & 0x1F) << 4);
+            else             bank = (bank & 0x01F0) | (value & 0x0F);
+            update_banks();
+        } break;
+        case 0xF000:
+        { // VRC4 IRQ
+            if ( vrc2 ) break;
+            switch ( reg )
+            {
+                case 0: irq_latch = (irq_latch & 0xF0) | (value & 0x0F); break;
+                case 1: irq_latch = (irq_latch & 0x0F) | (value << 4); break;
+                case 2:
+                {
+                    irq_enable_after_ack = value & 0x1;
+                    irq_enabled = value & 0x2;
+                    irq_cycle_mode = value & 0x4;
+                    if ( irq_enabled )
+                    {
+                        irq_counter = irq_latch;
+                        irq_prescaler = 341;
+                    }
+                    memory->cartridge_irq = false;
+                } break;
+                case 3:
+                {
+                    irq_enabled = irq_enable_after_ack;
+                    memory->cartridge_irq = false;
+                } break;
+            }
+        } break;
+    }
+}
+
+bool mapper_vrc_t::cpu_clocked() const {
+    return !vrc2;
+}
+
+void mapper_vrc_t::cpu_clock() {
+    if ( !irq_enabled ) return;
+
+    if ( !irq_cycle_mode )
+    { // Scanline mode, the prescaler divides CPU cycles by 113.667
+        irq_prescaler -= 3;
+        if ( irq_prescaler > 0 ) return;
+        irq_prescaler += 341;
+    }
+
+    if ( irq_counter == 0xFF )
+    {
+        irq_counter = irq_latch;
+        memory->cartridge_irq = true;
+    } else
+    {
+        irq_counter++;
+    }
+}
+
+void mapper_vrc_t::state_fields( state_section_t& section ) {
+    section.add( STATE_TAG('P','R','E','G'), prg_registers );
+    section.add( STATE_TAG('C','R','E','G'), chr_registers );
+    section.add( STATE_TAG('P','S','W','P'), prg_swap );
+    section.add( STATE_TAG('I','L','A','T'), irq_latch );
+    section.add( STATE_TAG('I','C','N','T'), irq_counter );
+    section.add( STATE_TAG('I','P','R','E'), irq_prescaler );
+    section.add( STATE_TAG('I','E','N','A'), irq_enabled );
+    section.add( STATE_TAG('I','A','C','K'), irq_enable_after_ack );
+    section.add( STATE_TAG('I','M','O','D'), irq_cycle_mode );
+}
+
+//////// mapper 034 - BNROM / NINA-001
+void mapper_bnrom_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+    map_prg_32kb( 0 );
+}
+
+void mapper_bnrom_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address >= 0x8000 )
+    { // BNROM
+        map_prg_32kb( value );
+        return;
+    }
+
+    mapper_t::cpu_write( address, value );
+    if ( memory->ines_rom->chr_rom_size <= CHR_8KB_SIZE ) return; // NINA-001 is the one with switchable CHR ROM
+
+    switch ( address )
+    {
+        case 0x7FFD: map_prg_32kb( value & 0x1 ); break;
+        case 0x7FFE: map_chr_4kb( 0, value & 0xF ); break;
+        case 0x7FFF: map_chr_4kb( 1, value & 0xF ); break;
+    }
+}
+
+//////// mapper 066 - GxROM
+void mapper_gxrom_t::init( mem_t* memory_ref ) {
+    mapper_t::init( memory_ref );
+    map_prg_32kb( 0 );
+}
+
+void mapper_gxrom_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0x8000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+    map_prg_32kb( (value >> 4) & 0x03 );
+    map_chr_8kb( value & 0x03 );
+}
+
+//////// mapper 071 - Camerica
+void mapper_camerica_t::cpu_write( uint16_t address, uint8_t value ) {
+    if ( address < 0x8000 )
+    {
+        mapper_t::cpu_write( address, value );
+        return;
+    }
+
+    if ( address >= 0xC000 )
+    {
+        map_prg_16kb( 0, value & 0x0F );
+    } else if ( address >= 0x9000 && address < 0xA000 )
+    { // Fire Hawk single screen select
+        memory->ppu_mem.nt_mirroring = (value & 0x10) ?
+            ppu_mem_t::nametable_mirroring::single_screen_higher :
+            ppu_mem_t::nametable_mirroring::single_screen_lower;
+    }
 }
 
 //////// mapper 094 - UN1ROM
 void mapper_un1rom_t::cpu_write( uint16_t address, uint8_t value ) {
     uint8_t bank = (value & 0b00011100) >> 2;
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[bank];
+    map_prg_16kb( 0, bank );
 }
 
 //////// mapper 180 - Configured UNROM
 void mapper_unrom_configured_t::init( mem_t* memory_ref ) {
     mapper_t::init( memory_ref );
     // ReMap PRG banks
-    uint8_t prg_banks = memory->ines_rom->header.prg_size;
-    memory->cartridge_mem.prg_lower_bank = memory->ines_rom->prg_pages[prg_banks-1];
-    memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[0];
+    map_prg_16kb( 0, prg_16kb_banks() - 1 );
+    map_prg_16kb( 1, 0 );
 }
 
 void mapper_unrom_configured_t::cpu_write( uint16_t address, uint8_t value ) {
     uint8_t bank = value & 0b00000111;
-    memory->cartridge_mem.prg_upper_bank = memory->ines_rom->prg_pages[bank];
+    map_prg_16kb( 1, bank );
 }
 
 } // nes
\ No newline at end of file
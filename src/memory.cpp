@@ -1,32 +1,157 @@
 #include "nes.hpp"
 #include "logging.hpp"
 #include "mappers.hpp"
+#include "battery.hpp"
+#include "movie.hpp"
 #include <memory>
 #include <cstring>
 
 namespace nes
 {
 
-void mem_t::init( ines_rom_t &rom )
+mem_t::~mem_t()
+{
+    delete battery; // Final flush
+    if (owned_mapper) owned_mapper->~mapper_t(); // Storage belongs to the arena
+}
+
+void mem_t::flush_battery( uint32_t pages )
+{
+    if (cartridge_mem.sram != battery->data)
+    { // Shadowed, the file gets a copy of the pages
+        const uint32_t page_size = 1u << BATTERY_PAGE_SHIFT;
+        for (uint32_t offset = 0; offset < cartridge_mem.prg_ram_size; offset += page_size)
+        {
+            if (!(pages & (1u << (offset >> BATTERY_PAGE_SHIFT)))) continue;
+            const uint32_t bytes = cartridge_mem.prg_ram_size - offset < page_size ? cartridge_mem.prg_ram_size - offset : page_size;
+            memcpy( &battery->data[offset], &cartridge_mem.prg_ram[offset], bytes );
+        }
+    }
+    battery->flush( pages );
+}
+
+void mem_t::shadow_battery()
+{ // The file is up to date at frame boundaries
+    if (!battery || cartridge_mem.sram != battery->data) return;
+    memcpy( cartridge_mem.prg_ram, battery->data, cartridge_mem.prg_ram_size );
+    dirty.mark( cartridge_mem.prg_ram, cartridge_mem.prg_ram_size );
+    cartridge_mem.map_sram( cartridge_mem.prg_ram );
+}
+
+void mem_t::detach_battery()
+{
+    if (!battery) return;
+    shadow_battery();
+    delete battery;
+    battery = nullptr;
+}
+
+namespace
+{
+// Cartridge RAM sized from the header, CHR-RAM is assumed when there is no CHR at all.
+// Without a header (NSF) both are 8KB like the common boards.
+uint32_t prg_ram_bytes( const ines_rom_t* rom )
+{
+    return rom ? rom->prg_ram_size + rom->prg_nvram_size : 0x2000;
+}
+
+uint32_t chr_ram_bytes( const ines_rom_t* rom )
+{
+    if (!rom) return 0x2000;
+    uint32_t bytes = rom->chr_ram_size + rom->chr_nvram_size;
+    if (rom->chr_rom_size == 0 && bytes == 0) bytes = 0x2000;
+    return (bytes + 0x3FF) & ~0x3FFu; // CHR is banked in 1KB windows
+}
+} // anonymous
+
+void cartridge_mem_t::allocate( arena_t& arena, uint32_t prg_ram_bytes, uint32_t chr_ram_bytes )
+{
+    // The arena is zeroed on commit
+    prg_ram = prg_ram_bytes ? (uint8_t*)arena.allocate( prg_ram_bytes ) : nullptr;
+    prg_ram_size = prg_ram_bytes;
+    chr_ram = chr_ram_bytes ? (uint8_t*)arena.allocate( chr_ram_bytes ) : nullptr;
+    chr_ram_size = chr_ram_bytes;
+    map_sram( prg_ram );
+}
+
+size_t mem_t::arena_bytes( const ines_rom_t* rom )
+{
+    const uint32_t prg = prg_ram_bytes( rom );
+    const uint32_t chr = chr_ram_bytes( rom );
+    return (rom ? arena_t::align( MAPPER_STORAGE_SIZE ) : 0) +
+           (prg ? arena_t::align( prg ) : 0) +
+           (chr ? arena_t::align( chr ) : 0);
+}
+
+void cartridge_mem_t::map_sram( uint8_t* ram )
+{
+    sram_dirty = 0;
+    if (!ram || prg_ram_size == 0)
+    { // No RAM, reads and writes go nowhere
+        sram = &scratch;
+        sram_mask = 0;
+        return;
+    }
+
+    // The $6000 - $7FFF window mirrors RAM smaller than 8KB
+    uint32_t window = 0x2000;
+    while (window > prg_ram_size) window >>= 1;
+    sram = ram;
+    sram_mask = window - 1;
+}
+
+void mem_t::init( const ines_rom_t &rom, arena_t& arena, bool save_file )
 {
     ines_rom = &rom;
-    memset(cpu_mem.internal_ram, 0x00, sizeof(cpu_mem.internal_ram));
-    for (size_t i = 0; i < sizeof(cpu_mem.ram); ++i)
+
+    // Each instance gets its own mapper registers
+    LOG_D("Mapper: %u.%u", ines_rom->mapper, ines_rom->submapper);
+    owned_mapper = create_mapper( ines_rom->mapper, arena.allocate( MAPPER_STORAGE_SIZE ) );
+    if (!owned_mapper) {
+        LOG_E("Mapper %u unimplemented", ines_rom->mapper);
+        throw RESULT_ERROR;
+    }
+    owned_mapper->submapper = ines_rom->submapper;
+
+    if (ines_rom->timing == ines_rom_t::TIMING_PAL || ines_rom->timing == ines_rom_t::TIMING_DENDY)
     {
-        //cpu_mem.ram[i] = rand() * 0xFF;
+        LOG_W("PAL/Dendy timing not supported, running as NTSC");
     }
 
-    // Mapper (0-255 only)
-    uint8_t mapper_identifier = ((ines_rom->header.flags_7 & 0xF0) | ((ines_rom->header.flags_6 & 0xF0) >> 4) % 256);
-    mapper = mappers_lut[mapper_identifier];
-    LOG_D("Mapper: %u", mapper_identifier);
-    if (!mapper) {
-        LOG_E("Mapper unimplemented");
-        throw RESULT_ERROR;
+    delete battery;
+    battery = nullptr;
+    cartridge_mem.allocate( arena, prg_ram_bytes( ines_rom ), chr_ram_bytes( ines_rom ) );
+
+    // Battery-backed PRG-RAM, saved next to the ROM with any work RAM before it (see battery.hpp)
+    if (ines_rom->prg_nvram_size > 0 && !ines_rom->filepath.empty())
+    {
+        std::string sav_path = ines_rom->filepath;
+        size_t extension = sav_path.find_last_of('.');
+        if (extension != std::string::npos && sav_path.find_first_of("/\\", extension) == std::string::npos)
+        {
+            sav_path.erase(extension);
+        }
+        sav_path += ".sav";
+
+        battery = save_file ? new battery_ram_t() : nullptr;
+        if (battery && battery->open( sav_path.c_str(), cartridge_mem.prg_ram_size ))
+        {
+            cartridge_mem.map_sram( battery->data );
+        } else
+        { // Another instance owns the file or there's none to write, start from what was saved last
+            delete battery;
+            battery = nullptr;
+            battery_ram_t::read_copy( sav_path.c_str(), cartridge_mem.prg_ram, cartridge_mem.prg_ram_size );
+        }
+    }
+
+    if (ines_rom->trainer && cartridge_mem.prg_ram_size >= 512)
+    { // $7000 - $71FF, loaded on every power on like the copiers did, over the save file too
+        for (uint16_t i = 0; i < 512; ++i) cartridge_mem.write_sram( 0x1000 + i, ines_rom->trainer[i] );
     }
 
     // Map PRG ROM and CHR ROM/RAM
-    mapper->init( this );
+    attach_mapper( owned_mapper );
 
     // Mirroring
     if (BIT_CHECK_HI(ines_rom->header.flags_6, 0))
@@ -37,13 +162,34 @@ void mem_t::init( ines_rom_t &rom )
         LOG_D("Horizontal mirroring (vertical arrangement)");
     }
 
-    // Persistent memory on cartridge
-    if (BIT_CHECK_HI(ines_rom->header.flags_6, 1))
+    LOG_I("Memory layout initiated successfully");
+}
+
+void mem_t::init( mapper_t* cartridge_mapper, arena_t& arena )
+{
+    cartridge_mem.allocate( arena, prg_ram_bytes( nullptr ), chr_ram_bytes( nullptr ) );
+    attach_mapper( cartridge_mapper );
+}
+
+void mem_t::attach_mapper( mapper_t* cartridge_mapper )
+{
+    memset(cpu_mem.internal_ram, 0x00, sizeof(cpu_mem.internal_ram));
+    for (size_t i = 0; i < sizeof(cpu_mem.ram); ++i)
     {
-        LOG_W("Cartridge contains some kind of persistent memory (unimplemented)");
+        //cpu_mem.ram[i] = rand() * 0xFF;
     }
 
-    LOG_I("Memory layout initiated successfully");
+    cartridge_irq = false;
+    ppu_a12 = false;
+
+    mapper = cartridge_mapper;
+    mapper->init( this );
+
+    // Resolve PPU snooping once, the fetch path only tests for nullptr
+    const uint8_t snoop = mapper->ppu_snoop();
+    a12_mapper     = (snoop & mapper_t::SNOOP_A12)     ? mapper : nullptr;
+    pattern_mapper = (snoop & mapper_t::SNOOP_PATTERN) ? mapper : nullptr;
+    clocked_mapper = mapper->cpu_clocked() ? mapper : nullptr;
 }
 
 uint8_t mem_t::memory_read( MEMORY_BUS bus, uint16_t address, bool peek )
@@ -55,9 +201,7 @@ uint8_t mem_t::memory_read( MEMORY_BUS bus, uint16_t address, bool peek )
         case PPU: data = ppu_memory_read( address, peek ); break;
         case APU: break;
     }
-    cpu_mem.activity.address = address;
-    cpu_mem.activity.value = data;
-    cpu_mem.activity.read = true;
+    if (!peek) cpu_bus.record( cpu_cycles, address, data, true );
     return data;
 }
 
@@ -69,9 +213,7 @@ void mem_t::memory_write( MEMORY_BUS bus, uint8_t value, uint16_t address )
         case PPU: ppu_memory_write( value, address ); break;
         case APU: break;
     }
-    cpu_mem.activity.address = address;
-    cpu_mem.activity.value = value;
-    cpu_mem.activity.read = false;
+    cpu_bus.record( cpu_cycles, address, value, false );
 }
 
 ///////////////////////////// CPU
@@ -89,22 +231,24 @@ uint8_t* mem_t::fetch_byte_ref( uint16_t address )
         LOG_E("Trying to fetch unmapped reference (%04x)", address);
     }
     else if ( address < 0x6000 )
-    { // expansion rom
-        ref = &cartridge_mem.expansion_rom[ address - 0x4020 ];
+    { // expansion area, nothing mapped
+        cartridge_mem.scratch = 0x00;
+        ref = &cartridge_mem.scratch;
     }
     else if ( address < 0x8000 )
     { // sram
-        ref = &cartridge_mem.sram[ address - 0x6000 ];
-    }
-    else if ( address < 0xC000 )
-    { // prg lower
-        ref = &cartridge_mem.prg_lower_bank[ address - 0x8000 ];
+        const uint16_t offset = (address - 0x6000) & cartridge_mem.sram_mask;
+        ref = &cartridge_mem.sram[ offset ];
+        cartridge_mem.sram_dirty |= 1u << (offset >> BATTERY_PAGE_SHIFT);
     }
-    else if ( address <= 0xFFFF )
-    { // prg upper
-        ref = &cartridge_mem.prg_upper_bank[ address - 0xC000 ];
+    else
+    { // prg rom, writes land in a scratch byte
+        const uint8_t* window = cartridge_mem.prg_banks[ (address - 0x8000) >> 13 ];
+        cartridge_mem.scratch = window ? window[ address & 0x1FFF ] : mapper->cpu_read( address );
+        ref = &cartridge_mem.scratch;
     }
-    
+    dirty.mark( ref ); // Written back by the instruction
+
     return ref;
 }
 
@@ -236,7 +380,9 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
 {
     if ( address < 0x2000 )
     { // internal ram
-        cpu_mem.internal_ram[ address % 0x0800 ] = value;
+        uint8_t* ref = &cpu_mem.internal_ram[ address % 0x0800 ];
+        *ref = value;
+        dirty.mark( ref );
         return;
     }
 
@@ -279,7 +425,8 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
             { // OAMDATA <> read/write
                 ppu->regs.OAMDATA = value;
                 uint8_t addr = ppu->regs.OAMADDR;
-                ppu_mem.oam.data[addr++] = value;
+                ppu_mem.oam.data[addr] = value;
+                dirty.mark( &ppu_mem.oam.data[addr++] );
                 ppu->regs.OAMADDR = addr;
                 ppu_mem.write_latch = value;
             } break;
@@ -325,6 +472,7 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
                     ppu_mem.t.data |= value;
                     ppu_mem.v.data = ppu_mem.t.data;
                     ppu_mem.w = 0;
+                    if (a12_mapper) track_ppu_a12( ppu_mem.v.data );
                 }
                 ppu_mem.write_latch = value;
 
@@ -358,7 +506,8 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
     { // OAMDMA > write
         // oam addr is 0xXX00 where XX is data
         uint16_t source_addr = (value << 8);
-        uint8_t* source = nullptr;
+        const uint8_t* source = nullptr;
+        uint8_t page[256];
         if ( source_addr < 0x4000 )
         {
             source = &cpu_mem.internal_ram[ source_addr % 0x0800 ];
@@ -373,13 +522,17 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
             // TODO Fix save RAM read
             LOG_E("Save RAM not implemented (%04X)", source_addr);
         } 
-        else if (source_addr < 0xC000) 
-        {
-            source = &cartridge_mem.prg_lower_bank[ source_addr - 0x8000 ]; 
-        } 
         else 
-        {
-            source = &cartridge_mem.prg_upper_bank[ source_addr - 0xC000 ];
+        { // Pages never straddle an 8KB window
+            const uint8_t* window = cartridge_mem.prg_banks[ (source_addr - 0x8000) >> 13 ];
+            if (window)
+            {
+                source = &window[ source_addr & 0x1FFF ];
+            } else
+            { // Banked finer than the windows
+                for (uint32_t i = 0; i < 256; ++i) page[i] = mapper->cpu_read( source_addr + i );
+                source = page;
+            }
         }
 
         if (!source)
@@ -391,6 +544,7 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
         // The CPU is suspended during the transfer, which will take 513 or 514 cycles after the $4014 write tick.
         // (1 wait state cycle while waiting for writes to complete, +1 if on an odd CPU cycle, then 256 alternating read/write cycles.)
         memcpy( ppu_mem.oam.data, source, 256 );
+        dirty.mark( ppu_mem.oam.data, 256 );
         uint32_t wait_cycles = 515 + (cpu->cycles % 2);
         cpu->dma_halt_cycles = wait_cycles;
         return;
@@ -484,6 +638,7 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
             gamepad_strobe = value & 0x1;
             if (old_strobe == 1 && gamepad_strobe == 0)
             {
+                if (movie) movie->latch( gamepad );
                 gamepad[0].latch = gamepad[0].data;
                 gamepad[1].latch = gamepad[1].data;
             }
@@ -508,10 +663,13 @@ void mem_t::cpu_memory_write( uint8_t value, uint16_t address )
 
 uint8_t mem_t::ppu_memory_read( uint16_t address, bool peek )
 {
-    (void) peek;
+    if (a12_mapper && !peek) track_ppu_a12( address );
+
     if ( address < 0x2000 )
     { // patterntables
-        return mapper->ppu_read( address );
+        uint8_t data = cartridge_mem.chr_banks[ address >> 10 ][ address & 0x3FF ];
+        if (pattern_mapper && !peek) pattern_mapper->ppu_pattern_fetch( address );
+        return data;
     }
 
     else if ( address < 0x3F00 )
@@ -562,22 +720,14 @@ uint8_t mem_t::ppu_memory_read( uint16_t address, bool peek )
         return ppu_mem.palette[ wrapped_addr ];
     }
 
-    else if ( address < 0x6000 )
-    { // expansion rom?
-        return cartridge_mem.expansion_rom[ address - 0x4020 ];
-    }
-
-    else if ( address < 0x8000 )
-    { // sram?
-        return cartridge_mem.sram[ address - 0x6000 ];
-    }
-    
     LOG_E("PPU memory read on weird address (%04X)", address );
     throw RESULT_ERROR;
 }
 
 void mem_t::ppu_memory_write( uint8_t value, uint16_t address )
 { // Writing to VRAM
+    if (a12_mapper) track_ppu_a12( address );
+
     if ( address < 0x2000 )
     { // pattern tables
         mapper->ppu_write( address, value );
@@ -616,6 +766,7 @@ void mem_t::ppu_memory_write( uint8_t value, uint16_t address )
             } break;
         }
         ppu_mem.vram[ t_addr ] = value;
+        dirty.mark( &ppu_mem.vram[ t_addr ] );
         return;
     } 
 
@@ -631,6 +782,7 @@ void mem_t::ppu_memory_write( uint8_t value, uint16_t address )
         }
 
         ppu_mem.palette[ wrapped_addr ] = value;
+        dirty.mark( &ppu_mem.palette[ wrapped_addr ] );
         return;
     }
 
@@ -0,0 +1,359 @@
+#include "movie.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace nes
+{
+
+namespace
+{
+constexpr uint32_t MOVIE_MAGIC   = 0x4D53454E; // "NESM"
+constexpr uint16_t MOVIE_VERSION = 1;
+constexpr uint32_t MOVIE_PER_FRAME = 0x1;      // Flag, one input for all latches of a frame
+
+struct movie_header_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t mapper;
+    uint32_t crc32;
+    uint32_t frames;
+    uint32_t runs;
+    uint32_t states;
+    uint32_t flags;
+};
+
+void write_varint( std::vector<uint8_t>& out, uint32_t value )
+{
+    while (value >= 0x80)
+    {
+        out.push_back( (uint8_t)(value | 0x80) );
+        value >>= 7;
+    }
+    out.push_back( (uint8_t)value );
+}
+
+bool read_varint( const uint8_t*& in, const uint8_t* end, uint32_t& value )
+{
+    value = 0;
+    for (uint32_t shift = 0; in < end && shift < 32; shift += 7)
+    {
+        const uint8_t byte = *in++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// FM2 pads are "RLDUTSBA", anything but '.' or ' ' is pressed
+uint8_t parse_fm2_pad( const std::string& field )
+{
+    uint8_t pad = 0;
+    for (uint32_t i = 0; i < 8 && i < field.size(); ++i)
+    {
+        if (field[i] != '.' && field[i] != ' ') pad |= 0x80 >> i;
+    }
+    return pad;
+}
+
+} // anonymous
+
+movie_t::~movie_t()
+{
+    detach();
+}
+
+void movie_t::record( emu_t& instance )
+{
+    detach();
+    if (!instance.memory || !instance.memory->ines_rom)
+    {
+        LOG_E("Movies need an iNES ROM");
+        throw RESULT_ERROR;
+    }
+    mapper = instance.memory->ines_rom->mapper;
+    crc32 = instance.memory->ines_rom->crc32;
+    recording = true;
+    per_frame = false;
+    latches.clear();
+    frame_start.assign( 1, 0 );
+    states.clear();
+    frame = 0;
+    cursor = 0;
+    desyncs = 0;
+
+    emu = &instance;
+    capture_state();
+    emu->memory->movie = this;
+}
+
+void movie_t::play( emu_t& instance )
+{
+    detach();
+    if (!instance.memory || !instance.memory->ines_rom)
+    {
+        LOG_E("Movies need an iNES ROM");
+        throw RESULT_ERROR;
+    }
+    if (crc32 != 0 && (crc32 != instance.memory->ines_rom->crc32 || mapper != instance.memory->ines_rom->mapper))
+    {
+        LOG_E("Movie was recorded with another ROM");
+        throw RESULT_ERROR;
+    }
+    recording = false;
+    frame = 0;
+    cursor = 0;
+    desyncs = 0;
+
+    emu = &instance;
+    if (states.empty() || states.front().frame != 0)
+    { // Movies without a starting state begin at power on
+        states.insert( states.begin(), state_t{ 0, {} } );
+        states.front().data.resize( emu->save_state_size() );
+        emu->save_state( states.front().data.data() );
+    }
+    emu->load_state( states.front().data.data(), states.front().data.size() );
+    emu->memory->movie = this;
+}
+
+void movie_t::seek( uint32_t target_frame )
+{
+    if (!emu || recording) return;
+    if (target_frame > frames()) target_frame = frames();
+
+    uint32_t nearest = 0;
+    for (uint32_t i = 0; i < states.size() && states[i].frame <= target_frame; ++i) nearest = i;
+
+    // Going forward from where the movie is beats loading an older state
+    if (frame > target_frame || frame < states[nearest].frame)
+    {
+        emu->load_state( states[nearest].data.data(), states[nearest].data.size() );
+        frame = states[nearest].frame;
+        cursor = 0;
+    }
+    while (frame < target_frame) emu->step_vblank();
+}
+
+void movie_t::detach()
+{
+    if (emu && emu->memory && emu->memory->movie == this) emu->memory->movie = nullptr;
+    emu = nullptr;
+}
+
+void movie_t::latch( gamepad_t* pads )
+{
+    if (recording)
+    {
+        latches.push_back( pads[0].data );
+        latches.push_back( pads[1].data );
+        ++cursor;
+        return;
+    }
+    if (finished()) return;
+
+    const uint32_t first = frame_start[frame];
+    const uint32_t count = frame_start[frame + 1] - first;
+    if (count > 0)
+    { // Extra latches get the last input of the frame, only expected with per frame input
+        const uint32_t index = first + (cursor < count ? cursor : count - 1);
+        pads[0].data = latches[index * 2];
+        pads[1].data = latches[index * 2 + 1];
+    }
+    ++cursor;
+}
+
+void movie_t::end_frame()
+{
+    if (recording)
+    {
+        frame_start.push_back( (uint32_t)(latches.size() / 2) );
+    }
+    else if (!finished() && !per_frame && cursor != frame_start[frame + 1] - frame_start[frame])
+    {
+        if (desyncs++ == 0) LOG_W("Movie desync at frame %u, %u latches instead of %u", frame, cursor, frame_start[frame + 1] - frame_start[frame]);
+    }
+    ++frame;
+    cursor = 0;
+
+    if (frame % STATE_INTERVAL == 0 && frame <= frames() && states.back().frame < frame) capture_state();
+}
+
+void movie_t::capture_state()
+{
+    states.push_back( state_t{ frame, {} } );
+    states.back().data.resize( emu->save_state_size() );
+    emu->save_state( states.back().data.data() );
+}
+
+bool movie_t::save( const char* filepath ) const
+{
+    std::vector<uint8_t> out( sizeof(movie_header_t) );
+    uint32_t runs = 0;
+    for (uint32_t run_start = 0; run_start < frames(); ++runs)
+    { // Consecutive frames with the same latches
+        const uint32_t first = frame_start[run_start];
+        const uint32_t count = frame_start[run_start + 1] - first;
+        uint32_t run_end = run_start + 1;
+        while (run_end < frames() &&
+            frame_start[run_end + 1] - frame_start[run_end] == count &&
+            memcmp( &latches[frame_start[run_end] * 2], &latches[first * 2], count * 2 ) == 0) ++run_end;
+
+        write_varint( out, run_end - run_start );
+        write_varint( out, count );
+        out.insert( out.end(), latches.begin() + first * 2, latches.begin() + (first + count) * 2 );
+        run_start = run_end;
+    }
+    for (const state_t& state : states)
+    {
+        const uint32_t state_header[2] = { state.frame, (uint32_t)state.data.size() };
+        const uint8_t* bytes = (const uint8_t*)state_header;
+        out.insert( out.end(), bytes, bytes + sizeof(state_header) );
+        out.insert( out.end(), state.data.begin(), state.data.end() );
+    }
+
+    const movie_header_t header = { MOVIE_MAGIC, MOVIE_VERSION, mapper, crc32, frames(), runs,
+        (uint32_t)states.size(), per_frame ? MOVIE_PER_FRAME : 0 };
+    memcpy( out.data(), &header, sizeof(header) );
+
+    std::ofstream file;
+    file.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open() || !file.write((const char*)out.data(), out.size()))
+    {
+        LOG_E("Failed to write movie '%s'", filepath);
+        return false;
+    }
+    LOG_I("Movie '%s': %u frames, %u latches, %zu states, %zu KB", filepath, frames(),
+        (uint32_t)(latches.size() / 2), states.size(), out.size() / 1024);
+    return true;
+}
+
+bool movie_t::load( const char* filepath )
+{
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate );
+    if (!file.is_open())
+    {
+        LOG_E("Failed to open movie '%s'", filepath);
+        return false;
+    }
+    std::vector<uint8_t> data( (size_t)file.tellg() );
+    file.seekg(0, file.beg);
+    file.read((char*)data.data(), data.size());
+
+    detach();
+    recording = false;
+    latches.clear();
+    frame_start.assign( 1, 0 );
+    states.clear();
+    frame = 0;
+    cursor = 0;
+
+    static const char fm2_start[] = "version ";
+    const bool fm2 = data.size() > sizeof(fm2_start) && memcmp( data.data(), fm2_start, sizeof(fm2_start) - 1 ) == 0;
+    if (!(fm2 ? parse_fm2( (const char*)data.data(), data.size() ) : parse( data.data(), data.size() )))
+    {
+        LOG_E("Movie '%s' is not valid", filepath);
+        latches.clear();
+        frame_start.assign( 1, 0 );
+        states.clear();
+        return false;
+    }
+    LOG_I("Movie '%s' (%u frames, %zu states) loaded successfully.", filepath, frames(), states.size());
+    return true;
+}
+
+bool movie_t::parse( const uint8_t* data, size_t size )
+{
+    movie_header_t header;
+    if (size < sizeof(header)) return false;
+    memcpy( &header, data, sizeof(header) );
+    if (header.magic != MOVIE_MAGIC || header.version != MOVIE_VERSION) return false;
+    mapper = header.mapper;
+    crc32 = header.crc32;
+    per_frame = (header.flags & MOVIE_PER_FRAME) != 0;
+
+    const uint8_t* in = data + sizeof(header);
+    const uint8_t* end = data + size;
+    for (uint32_t run = 0; run < header.runs; ++run)
+    {
+        uint32_t run_frames, count;
+        if (!read_varint( in, end, run_frames ) || !read_varint( in, end, count )) return false;
+        if (run_frames == 0 || run_frames > header.frames - frames() || (size_t)(end - in) < (size_t)count * 2) return false;
+        for (uint32_t i = 0; i < run_frames; ++i)
+        {
+            latches.insert( latches.end(), in, in + count * 2 );
+            frame_start.push_back( frame_start.back() + count );
+        }
+        in += count * 2;
+    }
+    if (frames() != header.frames) return false;
+
+    for (uint32_t i = 0; i < header.states; ++i)
+    {
+        uint32_t state_header[2];
+        if ((size_t)(end - in) < sizeof(state_header)) return false;
+        memcpy( state_header, in, sizeof(state_header) );
+        in += sizeof(state_header);
+        if ((size_t)(end - in) < state_header[1] || state_header[0] > header.frames) return false;
+        if (!states.empty() && states.back().frame >= state_header[0]) return false;
+        states.push_back( state_t{ state_header[0], std::vector<uint8_t>( in, in + state_header[1] ) } );
+        in += state_header[1];
+    }
+    return true;
+}
+
+bool movie_t::parse_fm2( const char* text, size_t size )
+{ // Header lines are "key value", input lines "|commands|port0|port1|port2|"
+    mapper = 0;
+    crc32 = 0; // FM2 has an MD5 of the ROM, not checked
+    per_frame = true;
+    bool warned_reset = false;
+
+    size_t position = 0;
+    while (position < size)
+    {
+        size_t line_end = position;
+        while (line_end < size && text[line_end] != '\n') ++line_end;
+        std::string line( text + position, line_end - position );
+        position = line_end + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        if (line[0] != '|')
+        {
+            const std::string key = line.substr( 0, line.find( ' ' ) );
+            const std::string value = line.size() > key.size() ? line.substr( key.size() + 1 ) : "";
+            if ((key == "binary" && value != "0") || (key == "fourscore" && value != "0") ||
+                ((key == "port0" || key == "port1") && value != "0" && value != "1") ||
+                (key == "savestate" && !value.empty()))
+            {
+                LOG_E("FM2 '%s %s' isn't supported", key.c_str(), value.c_str());
+                return false;
+            }
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        for (size_t start = 1, bar; (bar = line.find( '|', start )) != std::string::npos; start = bar + 1)
+        {
+            fields.push_back( line.substr( start, bar - start ) );
+        }
+        if (fields.size() < 3) return false;
+
+        if ((atoi( fields[0].c_str() ) & 0x3) && frames() > 0 && !warned_reset)
+        {
+            LOG_W("FM2 resets aren't supported, first one at frame %u", frames());
+            warned_reset = true;
+        }
+        latches.push_back( parse_fm2_pad( fields[1] ) );
+        latches.push_back( parse_fm2_pad( fields[2] ) );
+        frame_start.push_back( frame_start.back() + 1 );
+    }
+    return frames() > 0;
+}
+
+} // nes
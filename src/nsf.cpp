@@ -0,0 +1,276 @@
+#include "nsf.hpp"
+#include "nes.hpp"
+#include "logging.hpp"
+
+#include <fstream>
+#include <cstring>
+
+/*
+* NSF file format and player behaviour
+* https://www.nesdev.org/wiki/NSF
+*/
+
+namespace nes
+{
+
+namespace
+{
+constexpr char NSF_MAGIC[5] = { 'N', 'E', 'S', 'M', 0x1A };
+constexpr uint32_t NSF_HEADER_SIZE = 0x80;
+
+// Routines return here, the CPU never executes it
+constexpr uint16_t NSF_RETURN_ADDRESS = 0x4100;
+constexpr uint32_t NSF_INIT_MAX_CYCLES = 1789773; // One second
+} // anonymous
+
+nsf_t::~nsf_t()
+{
+    clear_contents();
+}
+
+void nsf_t::clear_contents()
+{
+    if (banks) delete[] banks;
+    banks = nullptr;
+    bank_count = 0;
+    bankswitched = false;
+    memset(&header, 0, NSF_HEADER_SIZE);
+}
+
+bool nsf_t::is_nsf_file(const char* filepath)
+{
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary);
+    char magic[5]{0};
+    file.read(magic, 5);
+    return file.good() && strncmp(magic, NSF_MAGIC, 5) == 0;
+}
+
+void nsf_t::load_from_file(const char* filepath)
+{
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate );
+    const uint32_t file_size = file.tellg();
+    file.seekg(0, file.beg);
+
+    if (!file.good() || file_size == 0 || !file.is_open())
+    {
+        LOG_E("Failed to open '%s'", filepath);
+        throw RESULT_ERROR;
+    }
+
+    uint8_t* data = new uint8_t[file_size];
+    file.read((char*)data, file_size);
+    file.close();
+
+    try
+    {
+        load_from_data(data, file_size);
+    }
+    catch(const RESULT& e)
+    {
+        delete[] data;
+        throw e;
+    }
+    delete[] data;
+
+    LOG_I("NSF '%s' (%u bytes) loaded successfully.", filepath, file_size);
+    LOG_I("  %.32s - %.32s (%.32s)", header.song_name, header.artist, header.copyright);
+    LOG_I("  %u songs, load $%04X init $%04X play $%04X%s", header.total_songs, header.load_address,
+        header.init_address, header.play_address, bankswitched ? " (bankswitched)" : "");
+}
+
+void nsf_t::load_from_data(const uint8_t* data, const uint32_t size)
+{
+    if (size <= NSF_HEADER_SIZE)
+    {
+        LOG_E("Size too small to contain NSF header and data.");
+        throw RESULT_INVALID_NSF_HEADER;
+    }
+
+    clear_contents();
+    memcpy(&header, data, NSF_HEADER_SIZE);
+
+    if (strncmp((const char*)header.magic, NSF_MAGIC, 5) != 0)
+    {
+        LOG_E("NSF header magic not valid.");
+        throw RESULT_INVALID_NSF_HEADER;
+    }
+
+    if (header.load_address < 0x8000 || header.total_songs == 0)
+    {
+        LOG_E("NSF header describes an unsupported layout (load $%04X, %u songs).", header.load_address, header.total_songs);
+        throw RESULT_INVALID_NSF_HEADER;
+    }
+
+    if (header.extra_sound_chip != 0)
+    {
+        LOG_W("NSF uses expansion audio (0x%02X), which is not emulated.", header.extra_sound_chip);
+    }
+
+    for (auto i = 0; i < 8; ++i)
+    {
+        if (header.bankswitch_init[i] != 0) bankswitched = true;
+    }
+
+    // Banked data is aligned to the low 12 bits of the load address,
+    // otherwise it is placed at the load address of a fixed 32KB image.
+    const uint32_t data_size = size - NSF_HEADER_SIZE;
+    const uint32_t padding = bankswitched ? (header.load_address & 0x0FFF) : (header.load_address - 0x8000);
+    bank_count = (padding + data_size + NSF_BANK_SIZE - 1) / NSF_BANK_SIZE;
+    if (!bankswitched)
+    {
+        bank_count = 8;
+    }
+
+    banks = new uint8_t[bank_count * NSF_BANK_SIZE]{0};
+    const uint32_t image_size = bank_count * NSF_BANK_SIZE;
+    memcpy(&banks[padding], &data[NSF_HEADER_SIZE], data_size < image_size - padding ? data_size : image_size - padding);
+
+    for (auto i = 0; i < 8; ++i)
+    {
+        bank_init[i] = bankswitched ? header.bankswitch_init[i] : i;
+    }
+}
+
+///////////////////////////// Mapper
+//////////////////////////////////////////////////////////
+
+void mapper_nsf_t::init( mem_t* memory_ref )
+{
+    memory = memory_ref;
+    reset_banks();
+
+    // No pattern data, but keep the PPU pointed at valid memory
+    memory->cartridge_mem.chr_writable = true;
+    map_chr_8kb( 0 );
+}
+
+void mapper_nsf_t::reset_banks()
+{
+    for (auto i = 0; i < 8; ++i)
+    {
+        prg_banks[i] = &nsf->banks[ (nsf->bank_init[i] % nsf->bank_count) * NSF_BANK_SIZE ];
+    }
+    // 4KB banks don't fit the 8KB windows, direct access (OAM DMA,
+    // read-modify-write) goes through cpu_read instead
+    for (auto i = 0; i < 4; ++i)
+    {
+        memory->cartridge_mem.prg_banks[i] = nullptr;
+    }
+}
+
+uint8_t mapper_nsf_t::cpu_read( uint16_t address )
+{
+    if ( address < 0x6000 ) return 0x00;
+    if ( address < 0x8000 ) return memory->cartridge_mem.read_sram( address - 0x6000 );
+    return prg_banks[ (address - 0x8000) >> 12 ][ address & 0x0FFF ];
+}
+
+void mapper_nsf_t::cpu_write( uint16_t address, uint8_t value )
+{
+    if ( address >= 0x5FF8 && address <= 0x5FFF )
+    { // Bank select
+        prg_banks[ address - 0x5FF8 ] = &nsf->banks[ (value % nsf->bank_count) * NSF_BANK_SIZE ];
+        return;
+    }
+    mapper_t::cpu_write( address, value );
+}
+
+///////////////////////////// Player
+//////////////////////////////////////////////////////////
+
+void nsf_player_t::init( emu_t* emu_ref, nsf_t* nsf_ref, audio_t* audio )
+{
+    emu = emu_ref;
+    nsf = nsf_ref;
+    mapper.nsf = nsf;
+    emu->init_nsf( &mapper, audio );
+
+    // Speed is given in microseconds, the CPU runs at 1.789773 MHz (NTSC)
+    uint16_t speed = nsf->header.ntsc_speed ? nsf->header.ntsc_speed : 16639;
+    play_period = (uint32_t)((uint64_t)speed * 1789773 / 1000000);
+    LOG_D("NSF play period: %u cycles", play_period);
+}
+
+void nsf_player_t::start_track( uint8_t track_index )
+{
+    track = track_index % nsf->header.total_songs;
+    mem_t* memory = emu->memory;
+
+    memset(memory->cpu_mem.internal_ram, 0x00, sizeof(memory->cpu_mem.internal_ram));
+    memset(memory->cartridge_mem.prg_ram, 0x00, memory->cartridge_mem.prg_ram_size);
+    memory->dirty.mark_all();
+    mapper.reset_banks();
+
+    // Silence the APU, enable all channels and inhibit the frame IRQ
+    for (uint16_t address = 0x4000; address <= 0x4013; ++address)
+    {
+        if (address == 0x4009 || address == 0x400D) continue; // Unused
+        memory->memory_write( mem_t::CPU, 0x00, address );
+    }
+    memory->memory_write( mem_t::CPU, 0x00, 0x4015 );
+    memory->memory_write( mem_t::CPU, 0x0F, 0x4015 );
+    memory->memory_write( mem_t::CPU, 0x40, 0x4017 );
+
+    cpu_t& cpu = *emu->cpu;
+    cpu.regs.A  = track;
+    cpu.regs.X  = 0x00; // NTSC
+    cpu.regs.Y  = 0x00;
+    cpu.regs.SP = 0xFD;
+    cpu.regs.SR = 0x24; // Interrupts disabled
+    cpu.trapped = false;
+
+    call_routine( nsf->header.init_address, NSF_INIT_MAX_CYCLES );
+    LOG_D("NSF track %u/%u started", track + 1, nsf->header.total_songs);
+}
+
+void nsf_player_t::play_frame()
+{
+    uint32_t cycles = call_routine( nsf->header.play_address, play_period );
+    if (cycles < play_period)
+    { // Idle until the next PLAY call
+        emu->cpu->tick_clock( play_period - cycles );
+    }
+}
+
+uint64_t nsf_player_t::render( uint32_t seconds )
+{
+    const uint64_t total_cycles = (uint64_t)seconds * 1789773;
+    uint64_t cycles = 0;
+    while (cycles < total_cycles)
+    {
+        play_frame();
+        cycles += play_period;
+    }
+    return cycles;
+}
+
+uint32_t nsf_player_t::call_routine( uint16_t address, uint32_t max_cycles )
+{
+    cpu_t& cpu = *emu->cpu;
+
+    // JSR-like entry, RTS lands on NSF_RETURN_ADDRESS
+    const uint16_t ret = NSF_RETURN_ADDRESS - 1;
+    cpu.push_byte_to_stack( (0xFF00 & ret) >> 8 );
+    cpu.push_byte_to_stack( 0x00FF & ret );
+    cpu.regs.PC = address;
+    cpu.regs.I  = 1;
+    cpu.irq_inhibit = true;
+
+    uint32_t cycles = 0;
+    while (cpu.regs.PC != NSF_RETURN_ADDRESS && !cpu.trapped && cycles < max_cycles)
+    {
+        cycles += cpu.execute();
+    }
+
+    if (cpu.regs.PC != NSF_RETURN_ADDRESS)
+    { // Routine didn't return in time, abandon it
+        LOG_W("NSF routine $%04X did not return within %u cycles", address, max_cycles);
+        cpu.regs.SP = 0xFD;
+        cpu.trapped = false;
+    }
+    return cycles;
+}
+
+} // nes
@@ -86,18 +86,10 @@ inline uint8_t palette_id_to_blue(uint32_t id)
     return color_2c02[id*3+2];
 }
 
-static bool old_nmi_enable = false;
-static bool allow_nmi = false;
-
 constexpr uint8_t render_enable_lagg = 1;
-static uint8_t ppumask_history[8]{0x00};
-static uint8_t ppumask_history_index = 0;
-static uint8_t nmi_unstable = 0;
 
 } // anonymous
 
-uint32_t window_buffer[NES_WIDTH * NES_HEIGHT * 4];
-
 void ppu_t::init(mem_t* mem, uint32_t* &out)
 {
     memory = mem;
@@ -604,15 +596,22 @@ void ppu_t::sp_evaluation( uint16_t dot, uint16_t scanline )
                         }
                     }
 
-                    uint8_t y_offset = (scanline - sprite_y);
+                    // Unused slots (and the pre-render line) still fetch, keep the
+                    // address inside the pattern table as mappers watch the bus
+                    uint8_t height = is_8x16 ? 16 : 8;
+                    uint8_t y_offset = (scanline - sprite_y) & (height - 1);
                     if (flip_y) 
                     {
-                        y_offset = 7 - y_offset;
+                        y_offset = (height - 1) - y_offset;
+                    }
+                    if (y_offset >= 8)
+                    { // Bottom tile of 8x16 sprites
+                        y_offset += 8;
                     }
 
-                    uint8_t* chr_data = (uint8_t*)memory->cartridge_mem.chr_rom.chr_bank_8kb + (sprite_tile*16) + chr_offset + y_offset;
-                    uint8_t lo = *chr_data;
-                    uint8_t hi = *(chr_data+8);
+                    uint16_t chr_address = (sprite_tile*16) + chr_offset + y_offset;
+                    uint8_t lo = memory->ppu_memory_read( chr_address, false );
+                    uint8_t hi = memory->ppu_memory_read( chr_address + 8, false );
 
                     // Fill shift-registers..
                     if (flip_x)
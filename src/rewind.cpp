@@ -0,0 +1,342 @@
+#include "rewind.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace nes
+{
+
+namespace
+{
+typedef std::chrono::high_resolution_clock clock;
+
+inline uint64_t elapsed_ns( clock::time_point start )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+}
+
+inline uint8_t* write_varint( uint8_t* out, size_t value )
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+inline size_t read_varint( const uint8_t*& in )
+{
+    size_t value = 0;
+    for (uint32_t shift = 0; ; shift += 7)
+    {
+        const uint8_t byte = *in++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// Worst case, every other word changed
+inline size_t encoded_bound( size_t words )
+{
+    return words * sizeof(uint64_t) + (words + 1) * 10;
+}
+
+size_t encode( const uint64_t* state, const uint64_t* previous, size_t words, uint8_t* out )
+{ // Tokens of (unchanged words, changed words, XOR of the changed words). Without previous the state is stored as-is
+    auto difference = [&]( size_t i ) { return previous ? state[i] ^ previous[i] : state[i]; };
+
+    uint8_t* start = out;
+    size_t word = 0;
+    while (word < words)
+    {
+        size_t changed = word;
+        while (changed < words && difference( changed ) == 0) ++changed;
+        size_t unchanged = changed;
+        while (unchanged < words && difference( unchanged ) != 0) ++unchanged;
+
+        out = write_varint( out, changed - word );
+        out = write_varint( out, unchanged - changed );
+        for (size_t i = changed; i < unchanged; ++i)
+        {
+            const uint64_t value = difference( i );
+            memcpy( out, &value, sizeof(value) );
+            out += sizeof(value);
+        }
+        word = unchanged;
+    }
+    return out - start;
+}
+
+} // anonymous
+
+rewind_t::~rewind_t()
+{
+    close();
+}
+
+bool rewind_t::open( emu_t& emu, size_t capacity_bytes )
+{
+    close();
+    words = (emu.snapshot_size() + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    scratch.resize( encoded_bound( words ) );
+    if (capacity_bytes < scratch.size() * 4)
+    {
+        LOG_E("Rewind buffer of %zu KB is too small, at least %zu KB needed", capacity_bytes / 1024, scratch.size() * 4 / 1024);
+        return false;
+    }
+
+    ring = (uint8_t*)malloc(capacity_bytes);
+    if (ring == nullptr)
+    {
+        LOG_E("Failed to allocate memory for the rewind buffer.");
+        return false;
+    }
+    capacity = capacity_bytes;
+    emu.memory->shadow_battery();
+
+    free_slots.clear();
+    pending.clear();
+    for (uint32_t i = 0; i < SLOTS + 1; ++i)
+    {
+        buffers[i].assign( words, 0 );
+        pages[i].assign( emu.dirty_page_words(), 0 );
+        free_slots.push_back( i );
+    }
+    has_latest = false;
+    full_push = true;
+    entries.clear();
+    stored_bytes = 0;
+    since_keyframe = 0;
+    skipped = pushes = push_ns = push_bytes = 0;
+    encodes = encode_ns = encode_max_ns = 0;
+    step_backs = step_back_ns = step_back_max_ns = 0;
+
+    stop = false;
+    busy = false;
+    worker = std::thread(&rewind_t::worker_loop, this);
+
+    LOG_I("Rewind buffer: %zu KB, %zu byte states", capacity / 1024, emu.snapshot_size());
+    return true;
+}
+
+void rewind_t::close()
+{
+    if (!ring) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_one();
+    if (worker.joinable()) worker.join();
+
+    free(ring);
+    ring = nullptr;
+    capacity = 0;
+    entries.clear();
+}
+
+void rewind_t::push( emu_t& emu )
+{
+    if (!ring) return;
+
+    auto start = clock::now();
+    uint32_t slot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_slots.empty())
+        { // Worker is behind, the emulation thread doesn't wait for it
+            ++skipped;
+            return;
+        }
+        slot = free_slots.front();
+        free_slots.pop_front();
+    }
+
+    // Pages written since the last push, a skipped frame leaves its pages dirty
+    if (full_push) emu.memory->dirty.mark_all();
+    full_push = false;
+    emu.snapshot_dirty( (uint8_t*)buffers[slot].data(), pages[slot].data() );
+    size_t copied = 0;
+    for (uint64_t bits : pages[slot]) copied += __builtin_popcountll( bits );
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back( slot );
+        ++pushes;
+        push_ns += elapsed_ns( start );
+        push_bytes += copied * dirty_pages_t::PAGE_SIZE;
+    }
+    wake.notify_one();
+}
+
+bool rewind_t::step_back( emu_t& emu )
+{
+    if (!ring) return false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return pending.empty() && !busy; });
+    if (entries.size() < 2) return false;
+
+    auto start = clock::now();
+    uint64_t* state = buffers[latest].data();
+    if (!entries.back().keyframe)
+    {
+        apply( entries.back(), state );
+    }
+    else
+    { // Replay the group before the keyframe, the oldest entry is always a keyframe
+        size_t first = entries.size() - 2;
+        while (!entries[first].keyframe) --first;
+        memset( state, 0, words * sizeof(uint64_t) );
+        for (size_t i = first; i < entries.size() - 1; ++i) apply( entries[i], state );
+    }
+    stored_bytes -= entries.back().size;
+    entries.pop_back();
+    full_push = true; // The instance no longer matches the pages pushed so far
+
+    since_keyframe = 0;
+    for (size_t i = entries.size() - 1; !entries[i].keyframe; --i) ++since_keyframe;
+
+    emu.restore( (const uint8_t*)state );
+    if (emu.memory->battery) emu.memory->flush_battery( ~0u ); // The save file is rewound too
+
+    const uint64_t ns = elapsed_ns( start );
+    ++step_backs;
+    step_back_ns += ns;
+    if (ns > step_back_max_ns) step_back_max_ns = ns;
+    return true;
+}
+
+rewind_stats_t rewind_t::stats()
+{
+    rewind_stats_t out{};
+    std::lock_guard<std::mutex> lock(mutex);
+    out.frames = (uint32_t)entries.size();
+    for (const entry_t& entry : entries) out.keyframes += entry.keyframe ? 1 : 0;
+    out.stored_bytes = stored_bytes;
+    out.memory_bytes = capacity + (SLOTS + 1) * words * sizeof(uint64_t) + scratch.size();
+    out.skipped = skipped;
+    out.push_us = pushes ? push_ns / 1000.0 / pushes : 0.0;
+    out.push_bytes = pushes ? (double)push_bytes / pushes : 0.0;
+    out.encode_us = encodes ? encode_ns / 1000.0 / encodes : 0.0;
+    out.encode_max_us = encode_max_ns / 1000.0;
+    out.step_back_us = step_backs ? step_back_ns / 1000.0 / step_backs : 0.0;
+    out.step_back_max_us = step_back_max_ns / 1000.0;
+    return out;
+}
+
+void rewind_t::worker_loop()
+{
+    while (true)
+    {
+        uint32_t slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return !pending.empty() || stop; });
+            if (stop) return;
+            slot = pending.front();
+            pending.pop_front();
+            busy = true;
+        }
+        store( slot );
+        idle.notify_all();
+    }
+}
+
+void rewind_t::store( uint32_t slot )
+{ // step_back() waits while busy, the newest state and keyframe count are the worker's here
+    auto start = clock::now();
+    if (has_latest) fill_clean_pages( slot );
+
+    bool keyframe = !has_latest || since_keyframe + 1 >= KEYFRAME_INTERVAL;
+    size_t size = encode( buffers[slot].data(), keyframe ? nullptr : buffers[latest].data(), words, scratch.data() );
+
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t offset = reserve( size );
+    if (entries.empty() && !keyframe)
+    { // The whole history went to make room, a delta has nothing to go on
+        keyframe = true;
+        size = encode( buffers[slot].data(), nullptr, words, scratch.data() );
+        offset = 0;
+    }
+    memcpy( &ring[offset], scratch.data(), size );
+    entries.push_back( { offset, size, keyframe } );
+    stored_bytes += size;
+    since_keyframe = keyframe ? 0 : since_keyframe + 1;
+
+    if (has_latest) free_slots.push_back( latest );
+    latest = slot;
+    has_latest = true;
+
+    const uint64_t ns = elapsed_ns( start );
+    ++encodes;
+    encode_ns += ns;
+    if (ns > encode_max_ns) encode_max_ns = ns;
+    busy = false;
+}
+
+void rewind_t::fill_clean_pages( uint32_t slot )
+{ // Pages push() didn't copy are as they were in the state before
+    const size_t page_words = dirty_pages_t::PAGE_SIZE / sizeof(uint64_t);
+    for (size_t page = 0; page * page_words < words; ++page)
+    {
+        if (pages[slot][page / 64] & (1ull << (page % 64))) continue;
+        const size_t first = page * page_words;
+        const size_t count = words - first < page_words ? words - first : page_words;
+        memcpy( &buffers[slot][first], &buffers[latest][first], count * sizeof(uint64_t) );
+    }
+}
+
+size_t rewind_t::reserve( size_t bytes )
+{ // Entries are contiguous, the ring wraps to the start when the end has no room
+    while (!entries.empty())
+    {
+        const size_t tail = entries.front().offset;
+        const size_t head = entries.back().offset + entries.back().size;
+        if (head > tail)
+        {
+            if (capacity - head >= bytes) return head;
+            if (tail >= bytes) return 0;
+        }
+        else if (tail - head >= bytes)
+        {
+            return head;
+        }
+        drop_oldest();
+    }
+    return 0;
+}
+
+void rewind_t::drop_oldest()
+{ // Deltas are useless without their keyframe, the whole group goes
+    do
+    {
+        stored_bytes -= entries.front().size;
+        entries.pop_front();
+    } while (!entries.empty() && !entries.front().keyframe);
+}
+
+void rewind_t::apply( const entry_t& entry, uint64_t* state ) const
+{
+    const uint8_t* in = &ring[entry.offset];
+    const uint8_t* end = in + entry.size;
+    size_t word = 0;
+    while (in < end)
+    {
+        word += read_varint( in );
+        for (size_t changed = read_varint( in ); changed > 0; --changed)
+        {
+            uint64_t value;
+            memcpy( &value, in, sizeof(value) );
+            state[word++] ^= value;
+            in += sizeof(value);
+        }
+    }
+}
+
+} // nes
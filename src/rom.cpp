@@ -1,8 +1,22 @@
 #include "nes.hpp"
 #include "logging.hpp"
+#include "rom_db.hpp"
+#include "archive.hpp"
 
 #include <fstream>
+#include <cstdlib>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#if !defined(_WIN32)
+#define ROM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace nes
 {
@@ -11,6 +25,94 @@ namespace
 {
 constexpr char INES_MAGIC[4] = { 'N', 'E', 'S', 0x1A };
 constexpr uint32_t INES_HEADER_SIZE = 16u;
+constexpr uint32_t TRAINER_SIZE = 512u;
+
+uint32_t rom_size( uint8_t lsb, uint8_t msb, uint32_t unit )
+{ // NES 2.0, MSB nibble $F selects exponent-multiplier notation
+    if (msb == 0x0F)
+    {
+        const uint32_t exponent = lsb >> 2;
+        const uint32_t multiplier = (lsb & 0x03) * 2 + 1;
+        return exponent < 32 ? (1u << exponent) * multiplier : 0;
+    }
+    return (((uint32_t)msb << 8) | lsb) * unit;
+}
+
+uint32_t ram_size( uint8_t shift )
+{ // NES 2.0, 64 << shift bytes, 0 means none
+    return shift ? 64u << shift : 0;
+}
+
+// Loaded images by path, entries expire with their last reference
+std::mutex shared_roms_mutex;
+std::map<std::string, std::weak_ptr<const ines_rom_t>> shared_roms;
+
+bool file_exists( const char* path )
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    return file.is_open();
+}
+
+// Read-only and private, the pages stay shared with every other mapping of the file
+bool map_file( const char* path, uint8_t*& data, uint32_t& size, bool& mapped )
+{
+#if defined(ROM_MMAP)
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        if (fd >= 0) close(fd);
+        LOG_E("Failed to open '%s'", path);
+        return false;
+    }
+
+    const uint32_t file_size = (uint32_t)file_stat.st_size;
+    void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_E("Failed to map '%s'", path);
+        return false;
+    }
+    data = (uint8_t*)mapping;
+    size = file_size;
+    mapped = true;
+#else
+    std::ifstream file;
+    file.open(path, std::ios::in | std::ios::binary | std::ios::ate );
+    const uint32_t file_size = file.tellg();
+    file.seekg(0, file.beg);
+
+    if (!file.good() || file_size == 0 || !file.is_open())
+    {
+        LOG_E("Failed to open '%s'", path);
+        return false;
+    }
+
+    data = (uint8_t*)malloc(file_size * sizeof(uint8_t));
+    if (data == nullptr) // Check if malloc failed
+    {
+        LOG_E("Failed to allocate memory for ROM data.");
+        return false;
+    }
+    size = file_size;
+    mapped = false;
+
+    file.read((char*)data, file_size);
+    file.close();
+#endif
+    return true;
+}
+
+void unmap_file( uint8_t* data, uint32_t size, bool mapped )
+{
+    if (!data) return;
+#if defined(ROM_MMAP)
+    if (mapped) munmap(data, size);
+    else
+#endif
+    free(data);
+}
 } // anonymous
 
 ines_rom_t::~ines_rom_t()
@@ -20,136 +122,289 @@ ines_rom_t::~ines_rom_t()
 
 void ines_rom_t::clear_contents()
 {
-    if (prg_pages)
+    delete[] prg_pages;
+    prg_pages = nullptr;
+    delete[] chr_pages;
+    chr_pages = nullptr;
+
+    unmap_file(image, image_size, image_mapped);
+    image = nullptr;
+    image_size = 0;
+    image_mapped = false;
+    filepath.clear();
+
+    memset(&header, 0, INES_HEADER_SIZE);
+}
+
+void ines_rom_t::load_from_file(const char* path)
+{
+    clear_contents();
+
+    // "roms.zip#Game.nes" picks one entry out of a zip, unless the whole path is a file
+    std::string file = path;
+    std::string entry_name;
+    const size_t separator = file.rfind('#');
+    if (separator != std::string::npos && !file_exists(path))
     {
-        for (auto i = 0; i < header.prg_size; ++i)
-        {
-            delete prg_pages[i];
-            prg_pages[i] = nullptr;
-        }
-        delete[] prg_pages;
-        prg_pages = nullptr;
+        entry_name = file.substr(separator + 1);
+        file.erase(separator);
+    }
+
+    uint32_t file_size = 0;
+    if (!map_file(file.c_str(), image, file_size, image_mapped))
+    {
+        throw RESULT_ERROR;
     }
+    image_size = file_size;
 
-    if (chr_pages)
+    try
     {
-        for (auto i = 0; i < header.chr_size; ++i)
+        if (archive_t::detect(image, image_size) != archive_t::FORMAT_NONE)
         {
-            delete chr_pages[i];
-            chr_pages[i] = nullptr;
+            extract_archive(file, entry_name.c_str());
         }
-        delete[] chr_pages;
-        chr_pages = nullptr;
+        else
+        {
+            filepath = file;
+        }
+        map_pages();
+    }
+    catch(const RESULT& e)
+    {
+        clear_contents();
+        throw e;
     }
 
-    memset(&header, 0, INES_HEADER_SIZE);
+    LOG_I("ROM '%s' (%u bytes) loaded successfully.", path, file_size);
 }
 
-void ines_rom_t::load_from_file(const char* filepath)
+void ines_rom_t::extract_archive(const std::string& archive_path, const char* entry_name)
 {
-    std::ifstream file;
-    file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate );
-    const uint32_t file_size = file.tellg();
-    file.seekg(0, file.beg);
-    
-    if (!file.good() || file_size == 0 || !file.is_open())
+    archive_t archive;
+    const archive_entry_t* entry = archive.open(image, image_size) ? archive.find(entry_name) : nullptr;
+    if (!entry)
     {
-        LOG_E("Failed to open '%s'", filepath);
+        LOG_E("No %s%s%s in '%s'", entry_name[0] ? "entry '" : ".nes entry", entry_name,
+            entry_name[0] ? "'" : "", archive_path.c_str());
+        for (const archive_entry_t& listed : archive.entries) LOG_I("  %s", listed.name.c_str());
         throw RESULT_ERROR;
     }
 
-    uint8_t* data = (uint8_t*)malloc(file_size * sizeof(uint8_t));
-    if (data == nullptr) // Check if malloc failed
+    // Inflate straight into the image, the archive mapping goes away afterwards
+    uint8_t* inflated = (uint8_t*)malloc(entry->size ? entry->size : 1);
+    if (inflated == nullptr)
     {
         LOG_E("Failed to allocate memory for ROM data.");
         throw RESULT_ERROR;
     }
+    if (!archive.extract(*entry, inflated))
+    {
+        free(inflated);
+        throw RESULT_ERROR;
+    }
+    LOG_I("Inflated '%s' (%u -> %u bytes)", entry->name.c_str(), entry->compressed_size, entry->size);
 
-    file.read((char*)data, file_size);
-    file.close();
+    // Save files are named after the entry and live next to the archive
+    std::string name = entry->name;
+    const size_t directory = name.find_last_of('/');
+    if (directory != std::string::npos) name.erase(0, directory + 1);
+    if (archive.format == archive_t::FORMAT_GZIP)
+    { // The stored name is optional, the file name minus .gz is what the user sees
+        name = archive_path.substr(archive_path.find_last_of("/\\") + 1);
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) name.erase(name.size() - 3);
+    }
+    const size_t archive_directory = archive_path.find_last_of("/\\");
+    filepath = (archive_directory != std::string::npos ? archive_path.substr(0, archive_directory + 1) : std::string()) + name;
+
+    unmap_file(image, image_size, image_mapped);
+    image = inflated;
+    image_size = entry->size;
+    image_mapped = false;
+}
+
+void ines_rom_t::load_from_data(const uint8_t* data, const uint32_t size)
+{
+    // Initialize ROM
+    clear_contents();
+
+    // Keep a single private copy, pages are views into it
+    image = (uint8_t*)malloc(size);
+    if (image == nullptr)
+    {
+        LOG_E("Failed to allocate memory for ROM data.");
+        throw RESULT_ERROR;
+    }
+    memcpy(image, data, size);
+    image_size = size;
 
     try
     {
-        load_from_data(data, file_size);
+        map_pages();
     }
     catch(const RESULT& e)
     {
-        free(data);
+        clear_contents();
         throw e;
     }
-    free(data);
-
-    LOG_I("ROM '%s' (%u bytes) loaded successfully.", filepath, file_size);
 }
 
-void ines_rom_t::load_from_data(const uint8_t* data, const uint32_t size)
+void ines_rom_t::map_pages()
 {
-    if (size < INES_HEADER_SIZE)
+    if (image_size < INES_HEADER_SIZE)
     {
         LOG_E("Size too small to contain iNES header.");
         throw RESULT_INVALID_INES_HEADER;
     }
 
-    // Initialize ROM
-    clear_contents();
-
-    // Copy iNES header
-    memcpy(&header, data, INES_HEADER_SIZE);
-
-    if (strncmp((const char*)header.magic, INES_MAGIC, 4) != 0)
+    // Validate the header in place
+    if (strncmp((const char*)image, INES_MAGIC, 4) != 0)
     {
         LOG_E("iNES header magic not valid.");
         throw RESULT_INVALID_INES_HEADER;
     }
+    memcpy(&header, image, INES_HEADER_SIZE);
 
     LOG_D("iNES header.flags_6: 0x%02X", header.flags_6);
     LOG_D("iNES header.flags_7: 0x%02X", header.flags_7);
 
-    prg_pages = new uint8_t*[header.prg_size];
-    chr_pages = new uint8_t*[header.chr_size];
+    parse_header();
 
-    // Copy PRG pages
-    const uint8_t* data_ptr = &data[INES_HEADER_SIZE];
-    for (auto i = 0; i < header.prg_size; ++i)
+    const uint32_t trainer_size = BIT_CHECK_HI(header.flags_6, 2) ? TRAINER_SIZE : 0;
+    const uint64_t required_size = (uint64_t)INES_HEADER_SIZE + trainer_size + prg_rom_size + chr_rom_size;
+    if (prg_rom_size == 0 || image_size < required_size)
     {
-        prg_pages[i] = new uint8_t[PRG_PAGE_SIZE];
-        memcpy(prg_pages[i], data_ptr, PRG_PAGE_SIZE);
-        data_ptr += PRG_PAGE_SIZE;
+        LOG_E("Written data not the same as specified.");
+        throw RESULT_ERROR;
     }
+    if (image_size > required_size)
+    { // PlayChoice-10 hint screen, NES 2.0 miscellaneous ROMs, or junk
+        LOG_D("%u bytes after CHR ROM ignored", (uint32_t)(image_size - required_size));
+    }
+
+    const uint32_t prg_page_count = (prg_rom_size + PRG_PAGE_SIZE - 1) / PRG_PAGE_SIZE;
+    const uint32_t chr_page_count = (chr_rom_size + CHR_PAGE_SIZE - 1) / CHR_PAGE_SIZE;
+    prg_pages = new const uint8_t*[prg_page_count];
+    chr_pages = new const uint8_t*[chr_page_count];
 
-    // Copy CHR pages
-    for (auto i = 0; i < header.chr_size; ++i)
+    const uint8_t* data_ptr = &image[INES_HEADER_SIZE];
+    trainer = trainer_size ? data_ptr : nullptr;
+    data_ptr += trainer_size;
+    for (uint32_t i = 0; i < prg_page_count; ++i)
     {
-        chr_pages[i] = new uint8_t[CHR_PAGE_SIZE];
-        memcpy(chr_pages[i], data_ptr, CHR_PAGE_SIZE);
-        data_ptr += CHR_PAGE_SIZE;
+        prg_pages[i] = data_ptr + i * PRG_PAGE_SIZE;
     }
+    data_ptr += prg_rom_size;
+    for (uint32_t i = 0; i < chr_page_count; ++i)
+    {
+        chr_pages[i] = data_ptr + i * CHR_PAGE_SIZE;
+    }
+
+    apply_db_overrides();
+}
 
-    // Flags7.1 = PlayChoice-10 (8 KB of Hint Screen data stored after CHR data)
-    const auto extra_size = (header.flags_7 & 0b10) > 0 ? 0x2000 : 0x0;
-    
-    const auto loaded_data_size = data_ptr - &data[INES_HEADER_SIZE];
-    const auto expected_data_size = size - INES_HEADER_SIZE - extra_size;
-    if (loaded_data_size != expected_data_size)
+void ines_rom_t::parse_header()
+{
+    nes2 = (header.flags_7 & 0x0C) == 0x08;
+    mapper = (header.flags_7 & 0xF0) | (header.flags_6 >> 4);
+
+    if (nes2)
     {
-        LOG_E("Written data not the same as specified.");
-        throw RESULT_ERROR;
+        mapper        |= (uint16_t)(header.flags_8 & 0x0F) << 8;
+        submapper      = header.flags_8 >> 4;
+        prg_rom_size   = rom_size(header.prg_size, header.flags_9 & 0x0F, PRG_PAGE_SIZE);
+        chr_rom_size   = rom_size(header.chr_size, header.flags_9 >> 4, CHR_PAGE_SIZE);
+        prg_ram_size   = ram_size(header.flags_10 & 0x0F);
+        prg_nvram_size = ram_size(header.flags_10 >> 4);
+        chr_ram_size   = ram_size(header.flags_11 & 0x0F);
+        chr_nvram_size = ram_size(header.flags_11 >> 4);
+        timing         = header.flags_12 & 0x03;
+    }
+    else
+    {
+        // Old dumps carry junk like "DiskDude!" in bytes 7 - 15, bytes 12 - 15
+        // are zero in any header written with the upper mapper nibble in mind
+        const bool dirty = header.flags_12 || header.padding[0] || header.padding[1] || header.padding[2];
+        if (dirty)
+        {
+            LOG_W("iNES header bytes 7 - 15 not clean, ignoring them");
+            mapper = header.flags_6 >> 4;
+        }
+
+        // iNES 1.0 boards are assumed to have 8KB PRG-RAM, battery-backed if flagged
+        const bool battery = BIT_CHECK_HI(header.flags_6, 1);
+        const uint32_t ram = (!dirty && header.flags_8 > 1) ? header.flags_8 * 0x2000 : 0x2000;
+        submapper      = 0;
+        prg_rom_size   = header.prg_size * PRG_PAGE_SIZE;
+        chr_rom_size   = header.chr_size * CHR_PAGE_SIZE;
+        prg_ram_size   = battery ? 0 : ram;
+        prg_nvram_size = battery ? ram : 0;
+        chr_ram_size   = header.chr_size == 0 ? 0x2000 : 0;
+        chr_nvram_size = 0;
+        timing         = (!dirty && (header.flags_9 & 0x01)) ? TIMING_PAL : TIMING_NTSC;
     }
+
+    LOG_D("%s mapper %u.%u, PRG ROM %u KB, CHR ROM %u KB, PRG-RAM %u+%u KB, CHR-RAM %u+%u KB",
+        nes2 ? "NES 2.0" : "iNES", mapper, submapper, prg_rom_size / 1024, chr_rom_size / 1024,
+        prg_ram_size / 1024, prg_nvram_size / 1024, chr_ram_size / 1024, chr_nvram_size / 1024);
+}
+
+void ines_rom_t::apply_db_overrides()
+{
+    const uint8_t* data = prg_pages[0];
+    const uint32_t size = prg_rom_size + chr_rom_size;
+    crc32 = hash_crc32(data, size);
+
+    const rom_db_entry_t* entry = rom_db.find(crc32, data, size);
+    db_match = entry != nullptr;
+    if (!entry) return;
+
+    // Rewrite the header as NES 2.0 so every field the database knows is expressible
+    const uint8_t region = (entry->flags & ROM_DB_REGION_MASK) >> ROM_DB_REGION_SHIFT;
+    header.flags_6  = (uint8_t)((entry->mapper & 0x0F) << 4) | (header.flags_6 & 0b0100);
+    if (entry->flags & ROM_DB_VERTICAL)    header.flags_6 |= 0b0001;
+    if (entry->flags & ROM_DB_BATTERY)     header.flags_6 |= 0b0010;
+    if (entry->flags & ROM_DB_FOUR_SCREEN) header.flags_6 |= 0b1000;
+    header.flags_7  = (uint8_t)(entry->mapper & 0xF0) | 0b1000;
+    header.flags_8  = (uint8_t)(entry->submapper << 4) | ((entry->mapper >> 8) & 0x0F);
+    if (!nes2) header.flags_9 = 0; // PRG/CHR size MSBs
+    header.flags_10 = (uint8_t)((entry->prg_nvram_shift << 4) | (entry->prg_ram_shift & 0x0F));
+    header.flags_11 = entry->chr_ram_shift & 0x0F;
+    header.flags_12 = region;
+    parse_header();
+
+    LOG_I("ROM database match (CRC32 %08X): mapper %u, %s mirroring", crc32, entry->mapper,
+        (entry->flags & ROM_DB_FOUR_SCREEN) ? "four-screen" : (entry->flags & ROM_DB_VERTICAL) ? "vertical" : "horizontal");
 }
 
 void ines_rom_t::construct_empty()
 {
     clear_contents();
-    memcpy(header.magic, INES_MAGIC, 4);
-    header.prg_size = 2;
-    prg_pages = new uint8_t*[header.prg_size];
-    for (auto i = 0; i < header.prg_size; ++i)
+
+    const uint8_t prg_size = 2;
+    image_size = INES_HEADER_SIZE + prg_size * PRG_PAGE_SIZE;
+    image = (uint8_t*)calloc(image_size, 1);
+    if (image == nullptr)
     {
-        prg_pages[i] = new uint8_t[PRG_PAGE_SIZE];
-        memset(prg_pages[i], 0u, PRG_PAGE_SIZE);
+        LOG_E("Failed to allocate memory for ROM data.");
+        throw RESULT_ERROR;
     }
+    memcpy(image, INES_MAGIC, 4);
+    image[4] = prg_size;
+    map_pages();
 }
 
+shared_rom_t load_shared_rom( const char* filepath )
+{
+    std::lock_guard<std::mutex> lock(shared_roms_mutex);
+
+    shared_rom_t rom = shared_roms[filepath].lock();
+    if (rom) return rom;
 
+    std::shared_ptr<ines_rom_t> loaded = std::make_shared<ines_rom_t>();
+    loaded->load_from_file(filepath);
+    rom = loaded;
+    shared_roms[filepath] = rom;
+    return rom;
+}
 
 } // nes
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "rom_db.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+
+#if !defined(_WIN32)
+#define ROM_DB_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace nes
+{
+
+rom_db_t rom_db{};
+
+namespace
+{
+
+uint32_t crc32_table[256];
+bool     crc32_table_ready = false;
+
+inline uint32_t rotate_left( uint32_t value, uint32_t bits )
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+void sha1_block( uint32_t state[5], const uint8_t* block )
+{
+    uint32_t w[80];
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (uint32_t i = 16; i < 80; ++i)
+    {
+        w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (uint32_t i = 0; i < 80; ++i)
+    {
+        uint32_t f, k;
+        if      (i < 20) { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+        uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotate_left(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+} // anonymous
+
+uint32_t hash_crc32( const uint8_t* data, uint32_t size, uint32_t crc )
+{
+    if (!crc32_table_ready)
+    { // Reflected polynomial 0xEDB88320, same as zip and No-Intro
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for (uint32_t bit = 0; bit < 8; ++bit)
+            {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320 : value >> 1;
+            }
+            crc32_table[i] = value;
+        }
+        crc32_table_ready = true;
+    }
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void hash_sha1( const uint8_t* data, uint32_t size, uint8_t digest[20] )
+{
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    uint32_t offset = 0;
+    for (; offset + 64 <= size; offset += 64)
+    {
+        sha1_block(state, &data[offset]);
+    }
+
+    // Pad with 0x80, zeroes and the message length in bits
+    uint8_t tail[128] = { 0 };
+    const uint32_t remaining = size - offset;
+    memcpy(tail, &data[offset], remaining);
+    tail[remaining] = 0x80;
+    const uint32_t tail_size = remaining < 56 ? 64 : 128;
+    const uint64_t bits = (uint64_t)size * 8;
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+        tail[tail_size - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    sha1_block(state, tail);
+    if (tail_size == 128) sha1_block(state, &tail[64]);
+
+    for (uint32_t i = 0; i < 5; ++i)
+    {
+        digest[i * 4]     = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)(state[i]);
+    }
+}
+
+rom_db_t::~rom_db_t()
+{
+    close();
+}
+
+bool rom_db_t::open( const char* filepath )
+{
+    close();
+
+#if defined(ROM_DB_MMAP)
+    int fd = ::open(filepath, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        if (fd >= 0) ::close(fd);
+        LOG_E("Failed to open ROM database '%s'", filepath);
+        return false;
+    }
+    image_size = (uint32_t)file_stat.st_size;
+    void* mapping = image_size > 0 ? mmap(nullptr, image_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_E("Failed to map ROM database '%s'", filepath);
+        image_size = 0;
+        return false;
+    }
+    image = (uint8_t*)mapping;
+    image_mapped = true;
+#else
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate );
+    if (!file.is_open())
+    {
+        LOG_E("Failed to open ROM database '%s'", filepath);
+        return false;
+    }
+    image_size = file.tellg();
+    file.seekg(0, file.beg);
+    image = (uint8_t*)malloc(image_size);
+    if (image == nullptr)
+    {
+        LOG_E("Failed to allocate memory for ROM database.");
+        image_size = 0;
+        return false;
+    }
+    file.read((char*)image, image_size);
+#endif
+
+    // The table is used in place, only the header is checked
+    const rom_db_header_t* header = (const rom_db_header_t*)image;
+    if (image_size < sizeof(rom_db_header_t) ||
+        memcmp(header->magic, ROM_DB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ROM_DB_VERSION ||
+        image_size < sizeof(rom_db_header_t) + (uint64_t)header->count * sizeof(rom_db_entry_t))
+    {
+        LOG_E("ROM database '%s' is not valid", filepath);
+        close();
+        return false;
+    }
+
+    entries = (const rom_db_entry_t*)(image + sizeof(rom_db_header_t));
+    count = header->count;
+    LOG_I("ROM database '%s' (%u entries) loaded successfully.", filepath, count);
+    return true;
+}
+
+void rom_db_t::close()
+{
+    if (image)
+    {
+#if defined(ROM_DB_MMAP)
+        if (image_mapped) munmap(image, image_size);
+        else
+#endif
+        free(image);
+    }
+    image = nullptr;
+    image_size = 0;
+    image_mapped = false;
+    entries = nullptr;
+    count = 0;
+}
+
+const rom_db_entry_t* rom_db_t::find( uint32_t crc32, const uint8_t* data, uint32_t size ) const
+{
+    if (count == 0) return nullptr;
+
+    const rom_db_entry_t* end = entries + count;
+    const rom_db_entry_t* entry = std::lower_bound(entries, end, crc32,
+        [](const rom_db_entry_t& e, uint32_t crc) { return e.crc32 < crc; });
+
+    static const uint8_t wildcard[20] = { 0 };
+    uint8_t digest[20];
+    bool hashed = false;
+    for (; entry != end && entry->crc32 == crc32; ++entry)
+    {
+        if (memcmp(entry->sha1, wildcard, sizeof(wildcard)) == 0) return entry;
+        if (!hashed)
+        {
+            hash_sha1(data, size, digest);
+            hashed = true;
+        }
+        if (memcmp(entry->sha1, digest, sizeof(digest)) == 0) return entry;
+    }
+    return nullptr;
+}
+
+} // nes
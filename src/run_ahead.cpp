@@ -0,0 +1,78 @@
+#include "run_ahead.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+
+namespace nes
+{
+
+void run_ahead_t::init( emu_t& instance, uint32_t ahead_frames, bool second_instance )
+{
+    if (!instance.memory || !instance.memory->ines_rom)
+    {
+        LOG_E("Run-ahead needs an iNES ROM");
+        throw RESULT_ERROR;
+    }
+    emu = &instance;
+    frames = ahead_frames;
+    use_second = second_instance && frames > 0;
+    picture = emu->front_buffer;
+    frames_run = total_ns = ahead_ns = 0;
+
+    if (use_second)
+    { // Without audio or a save file of its own
+        second.save_file = false;
+        if (emu->rom) second.init( emu->rom, nullptr );
+        else          second.init( *emu->memory->ines_rom, nullptr );
+        state.resize( emu->save_state_size() );
+    }
+    else
+    {
+        second.release();
+        state.resize( emu->snapshot_size() );
+    }
+    LOG_I("Run-ahead %u frames (%s)", frames, use_second ? "second instance" : "single instance");
+}
+
+void run_ahead_t::frame()
+{
+    typedef std::chrono::high_resolution_clock clock;
+    auto start = clock::now();
+
+    emu->step_vblank(); // Committed
+    picture = emu->front_buffer;
+    auto ahead_start = clock::now();
+
+    if (frames > 0 && use_second)
+    {
+        const size_t size = emu->save_state( state.data() );
+        second.load_state( state.data(), size );
+        for (uint32_t i = 0; i < frames; ++i) second.step_vblank();
+        picture = second.front_buffer;
+    }
+    else if (frames > 0)
+    {
+        mem_t* memory = emu->memory;
+        emu->snapshot( state.data() );
+
+        // Battery RAM runs from prg_ram, restoring the snapshot maps the
+        // save file back and brings the battery and movie back
+        audio_t* audio = emu->audio;
+        emu->audio = nullptr;
+        memory->shadow_battery();
+        memory->battery = nullptr;
+        memory->movie = nullptr;
+        for (uint32_t i = 0; i < frames; ++i) emu->step_vblank();
+        picture = emu->front_buffer;
+
+        emu->restore( state.data() );
+        emu->audio = audio;
+    }
+
+    auto end = clock::now();
+    ++frames_run;
+    total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    ahead_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - ahead_start).count();
+}
+
+} // nes
@@ -0,0 +1,453 @@
+#include "savestate.hpp"
+#include "nes.hpp"
+#include "apu.hpp"
+#include "logging.hpp"
+
+#include <cstring>
+
+namespace nes
+{
+
+namespace
+{
+constexpr uint32_t CHR_RAM_BANK = 0x80000000; // Bank offset flag, CHR-RAM rather than CHR ROM
+constexpr uint32_t BANK_1KB = 0x400;
+constexpr uint32_t BANK_8KB = 0x2000;
+
+struct header_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t mapper;
+    uint32_t crc32;
+    uint32_t sections;
+};
+
+struct chunk_t
+{ // Section and field header
+    uint32_t tag;
+    uint32_t size;
+};
+
+void cpu_fields( cpu_t& cpu, state_section_t& section )
+{
+    section.add( STATE_TAG('R','E','G','S'), cpu.regs );
+    section.add( STATE_TAG('V','E','C','T'), cpu.vectors );
+    section.add( STATE_TAG('I','N','S',' '), cpu.cur_ins );
+    section.add( STATE_TAG('C','Y','C',' '), cpu.cycles );
+    section.add( STATE_TAG('D','C','Y','C'), cpu.delta_cycles );
+    section.add( STATE_TAG('D','M','A','H'), cpu.dma_halt_cycles );
+    section.add( STATE_TAG('T','R','A','P'), cpu.trapped );
+    section.add( STATE_TAG('N','M','I','P'), cpu.nmi_pending );
+    section.add( STATE_TAG('N','M','I','T'), cpu.nmi_trigger );
+    section.add( STATE_TAG('I','R','Q','P'), cpu.irq_pending );
+    section.add( STATE_TAG('I','R','Q','T'), cpu.irq_trigger );
+    section.add( STATE_TAG('I','R','Q','I'), cpu.irq_inhibit );
+    section.add( STATE_TAG('P','A','G','E'), cpu.page_crossed );
+}
+
+void ppu_fields( ppu_t& ppu, ppu_mem_t& ppu_mem, state_section_t& section )
+{
+    section.add( STATE_TAG('R','E','G','S'), ppu.regs );
+    section.add( STATE_TAG('S','H','F','T'), ppu.shift_regs );
+    section.add( STATE_TAG('L','T','C','H'), ppu.latches );
+    section.add( STATE_TAG('X',' ',' ',' '), ppu.x );
+    section.add( STATE_TAG('Y',' ',' ',' '), ppu.y );
+    section.add( STATE_TAG('V','M','U','X'), ppu.vram_address_multiplexer );
+    section.add( STATE_TAG('C','Y','C',' '), ppu.cycles );
+    section.add( STATE_TAG('O','A','M','N'), ppu.oam_n );
+    section.add( STATE_TAG('O','A','M','M'), ppu.oam_m );
+    section.add( STATE_TAG('O','A','M','B'), ppu.oam_read_buffer );
+    section.add( STATE_TAG('S','O','A','C'), ppu.soam_counter );
+    section.add( STATE_TAG('S','P','F','E'), ppu.sprite_fetch );
+    section.add( STATE_TAG('S','P','C','T'), ppu.sprite_counters );
+    section.add( STATE_TAG('R','E','N',' '), ppu.render_enable );
+    section.add( STATE_TAG('R','B','G',' '), ppu.render_bg );
+    section.add( STATE_TAG('R','B','G','L'), ppu.render_bg_leftmost );
+    section.add( STATE_TAG('R','S','P',' '), ppu.render_sp );
+    section.add( STATE_TAG('R','S','P','L'), ppu.render_sp_leftmost );
+    section.add( STATE_TAG('P','W','O','N'), ppu.recently_power_on );
+    section.add( STATE_TAG('V','B','S','P'), ppu.vblank_suppression );
+    section.add( STATE_TAG('O','N','M','I'), ppu.old_nmi_enable );
+    section.add( STATE_TAG('A','N','M','I'), ppu.allow_nmi );
+    section.add( STATE_TAG('U','N','M','I'), ppu.nmi_unstable );
+    section.add( STATE_TAG('M','S','K','H'), ppu.ppumask_history );
+    section.add( STATE_TAG('M','S','K','I'), ppu.ppumask_history_index );
+    section.add( STATE_TAG('R','S','T','A'), ppu.render_state );
+    section.add( STATE_TAG('F','R','A','M'), ppu.frame_num );
+    section.add( STATE_TAG('S','P','I','N'), ppu.sprite_indices_next_scanline );
+    section.add( STATE_TAG('S','P','I','C'), ppu.sprite_indices_current_scanline );
+
+    // PPU memory and the loopy registers
+    section.add( STATE_TAG('P','A','L',' '), ppu_mem.palette );
+    section.add( STATE_TAG('V','R','A','M'), ppu_mem.vram );
+    section.add( STATE_TAG('O','A','M',' '), ppu_mem.oam );
+    section.add( STATE_TAG('S','O','A','M'), ppu_mem.soam );
+    section.add( STATE_TAG('V',' ',' ',' '), ppu_mem.v.data );
+    section.add( STATE_TAG('T',' ',' ',' '), ppu_mem.t.data );
+    section.add( STATE_TAG('F','I','N','X'), ppu_mem.fine_x );
+    section.add( STATE_TAG('W',' ',' ',' '), ppu_mem.w );
+    section.add( STATE_TAG('W','L','A','T'), ppu_mem.write_latch );
+    section.add( STATE_TAG('R','D','B','F'), ppu_mem.ppudata_read_buffer );
+    section.add( STATE_TAG('M','I','R','R'), ppu_mem.nt_mirroring );
+}
+
+void apu_fields( apu_t& apu, state_section_t& section )
+{ // Mixer settings belong to the user, not to the state
+    section.add( STATE_TAG('P','U','L','1'), apu.pulse_1 );
+    section.add( STATE_TAG('P','U','L','2'), apu.pulse_2 );
+    section.add( STATE_TAG('T','R','I',' '), apu.triangle );
+    section.add( STATE_TAG('N','O','I','S'), apu.noise );
+
+    apu_t::dmc_t& dmc = apu.dmc;
+    section.add( STATE_TAG('D','C','T','L'), dmc.control.data );
+    section.add( STATE_TAG('D','L','O','D'), dmc.direct_load.data );
+    section.add( STATE_TAG('D','A','D','R'), dmc.sample_address );
+    section.add( STATE_TAG('D','L','E','N'), dmc.sample_length );
+    section.add( STATE_TAG('D','O','U','T'), dmc.output_level );
+    section.add( STATE_TAG('D','B','I','T'), dmc.bits_shift_register );
+    section.add( STATE_TAG('D','R','E','M'), dmc.bits_remaining_register );
+    section.add( STATE_TAG('D','S','I','L'), dmc.silence );
+    section.add( STATE_TAG('D','B','U','F'), dmc.sample_buffer );
+    section.add( STATE_TAG('D','R','A','C'), dmc.memory_reader.address_counter );
+    section.add( STATE_TAG('D','R','B','C'), dmc.memory_reader.bytes_remaining_counter );
+    section.add( STATE_TAG('D','R','T','M'), dmc.memory_reader.tmp_data );
+    section.add( STATE_TAG('D','R','L','D'), dmc.memory_reader.data_loaded );
+    section.add( STATE_TAG('D','G','E','T'), dmc.get_cycle );
+    section.add( STATE_TAG('D','P','U','T'), dmc.put_cycle );
+    section.add( STATE_TAG('D','I','R','Q'), dmc.interrupt_flag );
+    section.add( STATE_TAG('D','P','L','Y'), dmc.play );
+    section.add( STATE_TAG('D','P','L','G'), dmc.playing );
+    section.add( STATE_TAG('D','P','E','R'), dmc.period );
+    section.add( STATE_TAG('D','T','I','M'), dmc.timer );
+    section.add( STATE_TAG('D','A','M','P'), dmc.amplitude );
+
+    section.add( STATE_TAG('S','T','A','T'), apu.status.data );
+    section.add( STATE_TAG('F','C','N','T'), apu.frame_counter.data );
+    section.add( STATE_TAG('O','U','T',' '), apu.output );
+    section.add( STATE_TAG('C','Y','C',' '), apu.cycle );
+    section.add( STATE_TAG('R','F','C','N'), apu.reset_frame_counter );
+    section.add( STATE_TAG('F','I','R','Q'), apu.frame_interrupt );
+    section.add( STATE_TAG('I','R','Q','L'), apu.irq_lag );
+    section.add( STATE_TAG('I','R','Q','X'), apu.irq_lag_index );
+}
+
+void mem_fields( mem_t& memory, state_section_t& section )
+{
+    section.add( STATE_TAG('R','A','M',' '), memory.cpu_mem.internal_ram );
+    section.add( STATE_TAG('P','A','D','S'), memory.gamepad );
+    section.add( STATE_TAG('S','T','R','B'), memory.gamepad_strobe );
+    section.add( STATE_TAG('C','Y','C',' '), memory.cpu_cycles );
+    section.add( STATE_TAG('B','U','S',' '), memory.cpu_bus.data_bus );
+    section.add( STATE_TAG('C','I','R','Q'), memory.cartridge_irq );
+    section.add( STATE_TAG('A','1','2',' '), memory.ppu_a12 );
+    section.add( STATE_TAG('A','1','2','L'), memory.ppu_a12_low_cycle );
+}
+
+void cart_fields( mem_t& memory, bank_offsets_t& banks, state_section_t& section )
+{
+    cartridge_mem_t& cart = memory.cartridge_mem;
+    section.add( STATE_TAG('B','A','N','K'), banks );
+    if (cart.prg_ram_size)
+    { // sram is the battery save file when there is one
+        section.add( STATE_TAG('P','R','A','M'), cart.sram, cart.prg_ram_size, memory.battery ? &cart.sram_dirty : nullptr );
+    }
+    if (cart.chr_ram_size)
+    {
+        section.add( STATE_TAG('C','R','A','M'), cart.chr_ram, cart.chr_ram_size );
+    }
+}
+
+void collect( emu_t& emu, state_sections_t& sections )
+{
+    if (!emu.memory || !emu.memory->ines_rom)
+    {
+        LOG_E("Save states need an iNES cartridge");
+        throw RESULT_ERROR;
+    }
+
+    sections.section[SECTION_CPU]    = state_section_t( STATE_TAG('C','P','U',' ') );
+    sections.section[SECTION_PPU]    = state_section_t( STATE_TAG('P','P','U',' ') );
+    sections.section[SECTION_APU]    = state_section_t( STATE_TAG('A','P','U',' ') );
+    sections.section[SECTION_MEM]    = state_section_t( STATE_TAG('M','E','M',' ') );
+    sections.section[SECTION_CART]   = state_section_t( STATE_TAG('C','A','R','T') );
+    sections.section[SECTION_MAPPER] = state_section_t( STATE_TAG('M','A','P','R') );
+
+    cpu_fields( *emu.cpu, sections.section[SECTION_CPU] );
+    ppu_fields( *emu.ppu, emu.memory->ppu_mem, sections.section[SECTION_PPU] );
+    apu_fields( *emu.apu, sections.section[SECTION_APU] );
+    mem_fields( *emu.memory, sections.section[SECTION_MEM] );
+    cart_fields( *emu.memory, sections.banks, sections.section[SECTION_CART] );
+    emu.memory->mapper->state_fields( sections.section[SECTION_MAPPER] );
+}
+
+void save_banks( const mem_t& memory, bank_offsets_t& banks )
+{
+    const cartridge_mem_t& cart = memory.cartridge_mem;
+    const ines_rom_t& rom = *memory.ines_rom;
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        banks.prg[i] = (uint32_t)(cart.prg_banks[i] - rom.prg_pages[0]);
+    }
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        const uint8_t* bank = cart.chr_banks[i];
+        if (cart.chr_ram && bank >= cart.chr_ram && bank < cart.chr_ram + cart.chr_ram_size)
+        {
+            banks.chr[i] = CHR_RAM_BANK | (uint32_t)(bank - cart.chr_ram);
+        } else
+        {
+            banks.chr[i] = (uint32_t)(bank - rom.chr_pages[0]);
+        }
+    }
+}
+
+// Walks the tag/size chunks of data, false if they overrun it. Fields must fill
+// their section exactly, count sections may be followed by trailing bytes.
+// length is where the chunks end.
+bool valid_chunks( const uint8_t* data, uint32_t size, uint32_t count, bool fields, uint32_t& length )
+{
+    uint32_t position = 0;
+    uint32_t field_length = 0;
+    for (uint32_t i = 0; fields ? position < size : i < count; ++i)
+    {
+        chunk_t chunk;
+        if (size - position < sizeof(chunk)) return false;
+        memcpy( &chunk, &data[position], sizeof(chunk) );
+        position += sizeof(chunk);
+        if (chunk.size > size - position) return false;
+        if (!fields && !valid_chunks( &data[position], chunk.size, 0, true, field_length )) return false;
+        position += chunk.size;
+    }
+    length = position;
+    return true;
+}
+
+// The chunk tagged tag in a valid chunk list, nullptr if there is none
+const uint8_t* find_chunk( const uint8_t* data, uint32_t size, uint32_t tag, uint32_t& chunk_size )
+{
+    uint32_t position = 0;
+    while (size - position >= sizeof(chunk_t))
+    {
+        chunk_t chunk;
+        memcpy( &chunk, &data[position], sizeof(chunk) );
+        position += sizeof(chunk);
+        if (chunk.size > size - position) break;
+        if (chunk.tag == tag)
+        {
+            chunk_size = chunk.size;
+            return &data[position];
+        }
+        position += chunk.size;
+    }
+    return nullptr;
+}
+
+bool valid_banks( const mem_t& memory, const bank_offsets_t& banks )
+{
+    const cartridge_mem_t& cart = memory.cartridge_mem;
+    const ines_rom_t& rom = *memory.ines_rom;
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        if ((uint64_t)banks.prg[i] + BANK_8KB > rom.prg_rom_size) return false;
+    }
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        const uint32_t offset = banks.chr[i] & ~CHR_RAM_BANK;
+        const uint32_t size = (banks.chr[i] & CHR_RAM_BANK) ? cart.chr_ram_size : rom.chr_rom_size;
+        if ((uint64_t)offset + BANK_1KB > size) return false;
+    }
+    return true;
+}
+
+void load_banks( mem_t& memory, const bank_offsets_t& banks )
+{
+    cartridge_mem_t& cart = memory.cartridge_mem;
+    const ines_rom_t& rom = *memory.ines_rom;
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        cart.prg_banks[i] = rom.prg_pages[0] + banks.prg[i];
+    }
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        const uint32_t offset = banks.chr[i] & ~CHR_RAM_BANK;
+        cart.chr_banks[i] = (banks.chr[i] & CHR_RAM_BANK) ? cart.chr_ram + offset
+                                                          : const_cast<uint8_t*>( rom.chr_pages[0] ) + offset;
+    }
+}
+
+void load_field( const state_field_t& field, const uint8_t* data, uint32_t size )
+{
+    size = size < field.size ? size : field.size;
+    if (!field.dirty)
+    {
+        memcpy( field.data, data, size );
+        return;
+    }
+
+    // Only pages that differ are handed to the battery writer
+    uint8_t* ram = (uint8_t*)field.data;
+    const uint32_t page_size = 1u << BATTERY_PAGE_SHIFT;
+    for (uint32_t offset = 0; offset < size; offset += page_size)
+    {
+        const uint32_t bytes = size - offset < page_size ? size - offset : page_size;
+        if (memcmp( &ram[offset], &data[offset], bytes ) == 0) continue;
+        memcpy( &ram[offset], &data[offset], bytes );
+        *field.dirty |= 1u << (offset >> BATTERY_PAGE_SHIFT);
+    }
+}
+
+void load_section( const state_section_t& section, const uint8_t* data, uint32_t size )
+{
+    uint32_t position = 0;
+    uint32_t hint = 0; // Fields normally come in the order they are listed
+    while (position < size)
+    {
+        chunk_t chunk;
+        memcpy( &chunk, &data[position], sizeof(chunk) );
+        position += sizeof(chunk);
+
+        for (uint32_t i = 0; i < section.count; ++i)
+        { // Fields this build doesn't know are skipped
+            const state_field_t& field = section.fields[ (hint + i) % section.count ];
+            if (field.tag != chunk.tag) continue;
+            load_field( field, &data[position], chunk.size );
+            hint = (hint + i + 1) % section.count;
+            break;
+        }
+        position += chunk.size;
+    }
+}
+} // anonymous
+
+void collect_state( const emu_t& emu, state_sections_t& sections )
+{
+    collect( const_cast<emu_t&>( emu ), sections );
+    save_banks( *emu.memory, sections.banks );
+}
+
+size_t emu_t::save_state_size() const
+{
+    state_sections_t sections;
+    collect( const_cast<emu_t&>( *this ), sections );
+
+    size_t size = sizeof(header_t);
+    for (const state_section_t& section : sections.section)
+    {
+        size += sizeof(chunk_t);
+        for (uint32_t i = 0; i < section.count; ++i)
+        {
+            size += sizeof(chunk_t) + section.fields[i].size;
+        }
+    }
+    return size;
+}
+
+size_t emu_t::save_state( uint8_t* out ) const
+{
+    state_sections_t sections;
+    collect_state( *this, sections );
+
+    header_t header;
+    header.magic = SAVESTATE_MAGIC;
+    header.version = SAVESTATE_VERSION;
+    header.mapper = memory->ines_rom->mapper;
+    header.crc32 = memory->ines_rom->crc32;
+    header.sections = SECTION_COUNT;
+    memcpy( out, &header, sizeof(header) );
+    size_t position = sizeof(header);
+
+    for (const state_section_t& section : sections.section)
+    {
+        const size_t section_start = position;
+        position += sizeof(chunk_t);
+        for (uint32_t i = 0; i < section.count; ++i)
+        {
+            const state_field_t& field = section.fields[i];
+            const chunk_t chunk = { field.tag, field.size };
+            memcpy( &out[position], &chunk, sizeof(chunk) );
+            memcpy( &out[position + sizeof(chunk)], field.data, field.size );
+            position += sizeof(chunk) + field.size;
+        }
+        const chunk_t chunk = { section.tag, (uint32_t)(position - section_start - sizeof(chunk_t)) };
+        memcpy( &out[section_start], &chunk, sizeof(chunk) );
+    }
+    return position;
+}
+
+void emu_t::load_state( const uint8_t* in, size_t size )
+{
+    header_t header;
+    if (size < sizeof(header) || size > UINT32_MAX)
+    {
+        LOG_E("Not a save state");
+        throw RESULT_ERROR;
+    }
+    memcpy( &header, in, sizeof(header) );
+    if (header.magic != SAVESTATE_MAGIC || header.version == 0)
+    {
+        LOG_E("Not a save state");
+        throw RESULT_ERROR;
+    }
+    if (!memory || !memory->ines_rom || header.crc32 != memory->ines_rom->crc32 || header.mapper != memory->ines_rom->mapper)
+    {
+        LOG_E("Save state belongs to another ROM");
+        throw RESULT_ERROR;
+    }
+
+    // Everything is checked before the instance is touched
+    const uint8_t* data = &in[sizeof(header)];
+    uint32_t data_size = 0;
+    if (!valid_chunks( data, (uint32_t)(size - sizeof(header)), header.sections, false, data_size ))
+    {
+        LOG_E("Save state is corrupt");
+        throw RESULT_ERROR;
+    }
+
+    state_sections_t sections;
+    collect_state( *this, sections ); // Windows stay as they are if the state has none
+
+    uint32_t cart_size = 0;
+    uint32_t banks_size = 0;
+    const uint8_t* cart = find_chunk( data, data_size, sections.section[SECTION_CART].tag, cart_size );
+    const uint8_t* banks = cart ? find_chunk( cart, cart_size, STATE_TAG('B','A','N','K'), banks_size ) : nullptr;
+    if (banks)
+    {
+        memcpy( &sections.banks, banks, banks_size < sizeof(bank_offsets_t) ? banks_size : sizeof(bank_offsets_t) );
+        if (!valid_banks( *memory, sections.banks ))
+        {
+            LOG_E("Save state bank windows are out of range");
+            throw RESULT_ERROR;
+        }
+    }
+
+    uint32_t position = 0;
+    for (uint32_t i = 0; i < header.sections; ++i)
+    {
+        chunk_t chunk;
+        memcpy( &chunk, &data[position], sizeof(chunk) );
+        position += sizeof(chunk);
+        for (const state_section_t& section : sections.section)
+        { // Sections this build doesn't know are skipped
+            if (section.tag != chunk.tag) continue;
+            load_section( section, &data[position], chunk.size );
+            break;
+        }
+        position += chunk.size;
+    }
+
+    load_banks( *memory, sections.banks );
+    memory->dirty.mark_all();
+
+    // Counters used as array indices before they wrap, kept in range for damaged states
+    ppu->ppumask_history_index &= 7;
+    ppu->oam_n = ppu->oam_n > 64 ? 64 : ppu->oam_n;
+    ppu->soam_counter = ppu->soam_counter > 8 ? 8 : ppu->soam_counter;
+    ppu->sprite_fetch &= 7;
+    apu->irq_lag_index %= 3;
+    apu->pulse_1.duty_index &= 7;
+    apu->pulse_2.duty_index &= 7;
+    apu->triangle.period_index &= 31;
+}
+
+} // nes
@@ -0,0 +1,426 @@
+#include "state_hash.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define HASH_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HASH_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nes
+{
+
+namespace
+{
+constexpr uint32_t HASH_MAGIC   = STATE_TAG('N', 'E', 'S', 'H');
+constexpr uint16_t HASH_VERSION = 2;
+
+constexpr uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+// One key per lane of a 64 byte stripe, advanced by PRIME_5 every stripe
+constexpr size_t   STRIPE_SIZE = 64;
+constexpr uint64_t STRIPE_KEYS[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+struct hash_header_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    uint32_t count;
+};
+
+struct record_header_t
+{
+    uint32_t index;
+    uint16_t pc;
+    uint16_t reserved;
+};
+
+inline uint64_t rotl( uint64_t value, uint32_t bits )
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t read64( const uint8_t* p )
+{
+    uint64_t value;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+inline uint32_t read32( const uint8_t* p )
+{
+    uint32_t value;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+inline uint64_t xxh_round( uint64_t acc, uint64_t input )
+{
+    acc += input * PRIME_2;
+    return rotl( acc, 31 ) * PRIME_1;
+}
+
+inline uint64_t merge( uint64_t acc, uint64_t lane )
+{
+    acc ^= xxh_round( 0, lane );
+    return acc * PRIME_1 + PRIME_4;
+}
+
+// Every lane adds the product of the halves of its keyed data and the data
+// of the lane next to it. The vector paths give the same sums as the scalar one.
+#if defined(HASH_SSE2)
+inline void stripe_pair( __m128i& lanes, __m128i& keys, const __m128i step, const uint8_t* p )
+{
+    const __m128i data = _mm_loadu_si128( (const __m128i*)p );
+    const __m128i keyed = _mm_xor_si128( data, keys );
+    const __m128i product = _mm_mul_epu32( keyed, _mm_shuffle_epi32( keyed, _MM_SHUFFLE(3, 3, 1, 1) ) );
+    lanes = _mm_add_epi64( lanes, _mm_shuffle_epi32( data, _MM_SHUFFLE(1, 0, 3, 2) ) );
+    lanes = _mm_add_epi64( lanes, product );
+    keys = _mm_add_epi64( keys, step );
+}
+#elif defined(HASH_NEON)
+inline void stripe_pair( uint64x2_t& lanes, uint64x2_t& keys, const uint64x2_t step, const uint8_t* p )
+{
+    const uint64x2_t data = vreinterpretq_u64_u8( vld1q_u8( p ) );
+    const uint64x2_t keyed = veorq_u64( data, keys );
+    const uint64x2_t product = vmull_u32( vmovn_u64( keyed ), vshrn_n_u64( keyed, 32 ) );
+    lanes = vaddq_u64( lanes, vextq_u64( data, data, 1 ) );
+    lanes = vaddq_u64( lanes, product );
+    keys = vaddq_u64( keys, step );
+}
+#endif
+
+void accumulate( uint64_t* acc, const uint8_t* p, size_t stripes, uint64_t seed )
+{
+#if defined(HASH_SSE2)
+    // Spelled out per register pair, arrays of vectors end up on the stack at -O2
+    const __m128i step = _mm_set1_epi64x( (long long)PRIME_5 );
+    const __m128i seeds = _mm_set1_epi64x( (long long)seed );
+    __m128i lanes_0 = _mm_loadu_si128( (const __m128i*)&acc[0] );
+    __m128i lanes_1 = _mm_loadu_si128( (const __m128i*)&acc[2] );
+    __m128i lanes_2 = _mm_loadu_si128( (const __m128i*)&acc[4] );
+    __m128i lanes_3 = _mm_loadu_si128( (const __m128i*)&acc[6] );
+    __m128i keys_0 = _mm_add_epi64( _mm_loadu_si128( (const __m128i*)&STRIPE_KEYS[0] ), seeds );
+    __m128i keys_1 = _mm_add_epi64( _mm_loadu_si128( (const __m128i*)&STRIPE_KEYS[2] ), seeds );
+    __m128i keys_2 = _mm_add_epi64( _mm_loadu_si128( (const __m128i*)&STRIPE_KEYS[4] ), seeds );
+    __m128i keys_3 = _mm_add_epi64( _mm_loadu_si128( (const __m128i*)&STRIPE_KEYS[6] ), seeds );
+    for (; stripes > 0; --stripes, p += STRIPE_SIZE)
+    {
+        stripe_pair( lanes_0, keys_0, step, p );
+        stripe_pair( lanes_1, keys_1, step, p + 16 );
+        stripe_pair( lanes_2, keys_2, step, p + 32 );
+        stripe_pair( lanes_3, keys_3, step, p + 48 );
+    }
+    _mm_storeu_si128( (__m128i*)&acc[0], lanes_0 );
+    _mm_storeu_si128( (__m128i*)&acc[2], lanes_1 );
+    _mm_storeu_si128( (__m128i*)&acc[4], lanes_2 );
+    _mm_storeu_si128( (__m128i*)&acc[6], lanes_3 );
+#elif defined(HASH_NEON)
+    const uint64x2_t step = vdupq_n_u64( PRIME_5 );
+    const uint64x2_t seeds = vdupq_n_u64( seed );
+    uint64x2_t lanes_0 = vld1q_u64( &acc[0] );
+    uint64x2_t lanes_1 = vld1q_u64( &acc[2] );
+    uint64x2_t lanes_2 = vld1q_u64( &acc[4] );
+    uint64x2_t lanes_3 = vld1q_u64( &acc[6] );
+    uint64x2_t keys_0 = vaddq_u64( vld1q_u64( &STRIPE_KEYS[0] ), seeds );
+    uint64x2_t keys_1 = vaddq_u64( vld1q_u64( &STRIPE_KEYS[2] ), seeds );
+    uint64x2_t keys_2 = vaddq_u64( vld1q_u64( &STRIPE_KEYS[4] ), seeds );
+    uint64x2_t keys_3 = vaddq_u64( vld1q_u64( &STRIPE_KEYS[6] ), seeds );
+    for (; stripes > 0; --stripes, p += STRIPE_SIZE)
+    {
+        stripe_pair( lanes_0, keys_0, step, p );
+        stripe_pair( lanes_1, keys_1, step, p + 16 );
+        stripe_pair( lanes_2, keys_2, step, p + 32 );
+        stripe_pair( lanes_3, keys_3, step, p + 48 );
+    }
+    vst1q_u64( &acc[0], lanes_0 );
+    vst1q_u64( &acc[2], lanes_1 );
+    vst1q_u64( &acc[4], lanes_2 );
+    vst1q_u64( &acc[6], lanes_3 );
+#else
+    for (uint64_t offset = seed; stripes > 0; --stripes, p += STRIPE_SIZE, offset += PRIME_5)
+    {
+        for (uint32_t i = 0; i < 8; i += 2)
+        {
+            const uint64_t data_0 = read64( p + i * 8 );
+            const uint64_t data_1 = read64( p + i * 8 + 8 );
+            const uint64_t keyed_0 = data_0 ^ (STRIPE_KEYS[i] + offset);
+            const uint64_t keyed_1 = data_1 ^ (STRIPE_KEYS[i + 1] + offset);
+            acc[i] += data_1 + (keyed_0 & 0xFFFFFFFFULL) * (keyed_0 >> 32);
+            acc[i + 1] += data_0 + (keyed_1 & 0xFFFFFFFFULL) * (keyed_1 >> 32);
+        }
+    }
+#endif
+}
+
+// Tags are four characters, trailing spaces dropped
+void tag_name( uint32_t tag, char* out )
+{
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < 4; ++i) out[i] = (char)(tag >> (i * 8));
+    for (uint32_t i = 0; i < 4; ++i) if (out[i] != ' ' && out[i] != 0) length = i + 1;
+    out[length] = 0;
+}
+
+struct stream_t
+{
+    hash_header_t header;
+    std::vector<uint64_t> tags;
+    std::vector<uint8_t> data;
+    size_t record_size;
+
+    size_t records() const { return data.size() / record_size; }
+    const uint8_t* record( size_t i ) const { return &data[i * record_size]; }
+};
+
+bool read_stream( const char* filepath, stream_t& stream )
+{
+    std::ifstream file;
+    file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate );
+    if (!file.is_open())
+    {
+        LOG_E("Failed to open state hashes '%s'", filepath);
+        return false;
+    }
+    const size_t size = (size_t)file.tellg();
+    file.seekg(0, file.beg);
+    if (size < sizeof(hash_header_t) || !file.read((char*)&stream.header, sizeof(hash_header_t)) ||
+        stream.header.magic != HASH_MAGIC || stream.header.version != HASH_VERSION ||
+        size < sizeof(hash_header_t) + stream.header.count * sizeof(uint64_t))
+    {
+        LOG_E("'%s' is not a state hash stream", filepath);
+        return false;
+    }
+    stream.tags.resize( stream.header.count );
+    file.read((char*)stream.tags.data(), stream.tags.size() * sizeof(uint64_t));
+    stream.record_size = sizeof(record_header_t) + stream.header.count * sizeof(uint64_t);
+    stream.data.resize( size - sizeof(hash_header_t) - stream.tags.size() * sizeof(uint64_t) );
+    file.read((char*)stream.data.data(), stream.data.size());
+    stream.data.resize( stream.records() * stream.record_size ); // A run that crashed leaves half a record
+    return true;
+}
+
+} // anonymous
+
+uint64_t hash64( const void* data, size_t size, uint64_t seed )
+{ // Eight lanes over 64 byte stripes, the rest and the finish like XXH64
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint64_t hash = seed + PRIME_5;
+
+    if (size >= STRIPE_SIZE)
+    {
+        uint64_t lane[8] = { 0 };
+        const size_t stripes = size / STRIPE_SIZE;
+        accumulate( lane, p, stripes, seed );
+        p += stripes * STRIPE_SIZE;
+        for (uint32_t i = 0; i < 8; ++i) hash = merge( hash, lane[i] );
+    }
+    hash += (uint64_t)size;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        hash ^= xxh_round( 0, read64( p ) );
+        hash = rotl( hash, 27 ) * PRIME_1 + PRIME_4;
+    }
+    if (p + 4 <= end)
+    {
+        hash ^= (uint64_t)read32( p ) * PRIME_1;
+        hash = rotl( hash, 23 ) * PRIME_2 + PRIME_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        hash ^= (*p) * PRIME_5;
+        hash = rotl( hash, 11 ) * PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+state_hash_stream_t::~state_hash_stream_t()
+{
+    close();
+}
+
+bool state_hash_stream_t::open( const char* filepath, const emu_t& emu, KIND stream_kind )
+{
+    close();
+    state_sections_t sections;
+    collect_state( emu, sections );
+
+    std::vector<uint64_t> tags;
+    for (const state_section_t& section : sections.section)
+    {
+        if (stream_kind == KIND_FRAMES)
+        {
+            tags.push_back( (uint64_t)section.tag << 32 );
+            continue;
+        }
+        for (uint32_t i = 0; i < section.count; ++i)
+        {
+            tags.push_back( ((uint64_t)section.tag << 32) | section.fields[i].tag );
+        }
+    }
+
+    file.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+    const hash_header_t header = { HASH_MAGIC, HASH_VERSION, stream_kind, (uint32_t)tags.size() };
+    if (!file.is_open() || !file.write((const char*)&header, sizeof(header)) ||
+        !file.write((const char*)tags.data(), tags.size() * sizeof(uint64_t)))
+    {
+        LOG_E("Failed to write state hashes '%s'", filepath);
+        file.close();
+        return false;
+    }
+    kind = stream_kind;
+    count = header.count;
+    buffer.resize( sizeof(record_header_t) + count * sizeof(uint64_t) );
+    records = hash_ns = 0;
+    return true;
+}
+
+void state_hash_stream_t::close()
+{
+    if (file.is_open()) file.close();
+}
+
+void state_hash_stream_t::record( const emu_t& emu, uint32_t index )
+{
+    if (!file.is_open()) return;
+    typedef std::chrono::high_resolution_clock clock;
+    auto start = clock::now();
+
+    state_sections_t sections;
+    collect_state( emu, sections );
+
+    const record_header_t header = { index, emu.cpu->regs.PC, 0 };
+    memcpy( buffer.data(), &header, sizeof(header) );
+    uint64_t* hashes = (uint64_t*)&buffer[sizeof(header)];
+    uint32_t n = 0;
+    for (const state_section_t& section : sections.section)
+    {
+        uint64_t chained = section.tag;
+        for (uint32_t i = 0; i < section.count && n < count; ++i)
+        {
+            const state_field_t& field = section.fields[i];
+            if (kind == KIND_FRAMES) chained = hash64( field.data, field.size, chained );
+            else hashes[n++] = hash64( field.data, field.size, field.tag );
+        }
+        if (kind == KIND_FRAMES && n < count) hashes[n++] = chained;
+    }
+    while (n < count) hashes[n++] = 0; // The mapper lists fewer fields than when the stream was opened
+
+    file.write((const char*)buffer.data(), buffer.size());
+    ++records;
+    hash_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+}
+
+bool compare_state_hashes( const char* filepath_a, const char* filepath_b )
+{
+    stream_t a, b;
+    if (!read_stream( filepath_a, a ) || !read_stream( filepath_b, b )) return false;
+    if (a.header.kind != b.header.kind)
+    {
+        LOG_E("One stream has frames, the other instructions");
+        return false;
+    }
+    const bool frames = a.header.kind == state_hash_stream_t::KIND_FRAMES;
+
+    // Hashes are matched by tag, fields only one build has are left out
+    std::vector<uint32_t> pairs;
+    for (uint32_t i = 0; i < a.header.count; ++i)
+    {
+        for (uint32_t j = 0; j < b.header.count; ++j)
+        {
+            if (a.tags[i] != b.tags[j]) continue;
+            pairs.push_back( i );
+            pairs.push_back( j );
+            break;
+        }
+    }
+    if (pairs.size() / 2 != a.header.count || pairs.size() / 2 != b.header.count)
+    {
+        LOG_W("Streams hash different fields, comparing the %zu they share", pairs.size() / 2);
+    }
+
+    const size_t records = a.records() < b.records() ? a.records() : b.records();
+    for (size_t r = 0; r < records; ++r)
+    {
+        const uint8_t* record_a = a.record( r );
+        const uint8_t* record_b = b.record( r );
+        record_header_t header_a, header_b;
+        memcpy( &header_a, record_a, sizeof(header_a) );
+        memcpy( &header_b, record_b, sizeof(header_b) );
+        if (header_a.index != header_b.index)
+        {
+            printf("Streams don't line up, record %zu is %s %u in one and %u in the other\n", r,
+                frames ? "frame" : "instruction", header_a.index, header_b.index);
+            return false;
+        }
+
+        bool differs = false;
+        for (size_t p = 0; p < pairs.size(); p += 2)
+        {
+            const uint64_t hash_a = read64( record_a + sizeof(header_a) + pairs[p] * sizeof(uint64_t) );
+            const uint64_t hash_b = read64( record_b + sizeof(header_b) + pairs[p + 1] * sizeof(uint64_t) );
+            if (hash_a == hash_b) continue;
+
+            if (!differs)
+            {
+                if (frames)
+                {
+                    printf("First difference after frame %u\n", header_a.index);
+                } else if (r > 0)
+                {
+                    record_header_t previous;
+                    memcpy( &previous, a.record( r - 1 ), sizeof(previous) );
+                    printf("First difference after instruction %u at $%04X, PC $%04X / $%04X\n",
+                        header_a.index, previous.pc, header_a.pc, header_b.pc);
+                } else
+                {
+                    printf("First difference before instruction %u\n", header_a.index);
+                }
+                differs = true;
+            }
+            char section[5], field[5];
+            tag_name( (uint32_t)(a.tags[pairs[p]] >> 32), section );
+            tag_name( (uint32_t)a.tags[pairs[p]], field );
+            printf("  %s%s%s\n", section, frames ? "" : ".", field);
+        }
+        if (differs)
+        {
+            if (frames) printf("Replay frame %u with --hash-frame %u on both builds to find the instruction\n", header_a.index, header_a.index);
+            return false;
+        }
+    }
+
+    if (a.records() != b.records())
+    {
+        printf("Streams match for %zu records, then one of them ends (%zu and %zu records)\n",
+            records, a.records(), b.records());
+        return false;
+    }
+    printf("Streams match, %zu records\n", records);
+    return true;
+}
+
+} // nes
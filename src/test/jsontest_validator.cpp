@@ -12,6 +12,53 @@
 namespace nes
 {
 
+namespace
+{
+// The tests list the bus every cycle, a cycle without an access of its own
+// still shows the previous one
+bool check_bus_activity( const bus_trace_t& bus, uint32_t start_cycle, const rapidjson::Value& cycles )
+{
+#if defined(BUS_TRACE)
+    bool ok = true;
+    uint32_t next = 0;
+    const bus_access_t* activity = nullptr;
+    for (rapidjson::SizeType j = 0; j < cycles.Size(); ++j)
+    {
+        while (next < bus.size() && bus[next].cycle <= start_cycle + j) activity = &bus[next++];
+        if (!activity) {
+            LOG_D("Missing bus activity!");
+            ok = false;
+            continue;
+        }
+
+        if (cycles[j][0].GetUint() != activity->address) {
+            LOG_D("CYCLE %u ADR %02X != %02X", j+1, activity->address, cycles[j][0].GetUint());
+            ok = false;
+        }
+        if (cycles[j][1].GetUint() != activity->value) {
+            LOG_D("CYCLE %u VAL %02X != %02X", j+1, activity->value, cycles[j][1].GetUint());
+            ok = false;
+        }
+        if (strcmp(cycles[j][2].GetString(), "read") == 0) {
+            if (!activity->read) {
+                LOG_D("CYCLE %u STS write != read", j+1);
+                ok = false;
+            }
+        } else {
+            if (activity->read) {
+                LOG_D("CYCLE %u STS read != write", j+1);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+#else
+    (void)bus; (void)start_cycle; (void)cycles;
+    return false;
+#endif
+}
+} // anonymous
+
 void jsontest_validator::init(emu_t* emu_ref, const char* path)
 {
     emu = emu_ref;
@@ -48,6 +95,11 @@ void jsontest_validator::init(emu_t* emu_ref, const char* path)
 
 RESULT jsontest_validator::run_tests()
 {
+#if !defined(BUS_TRACE)
+    LOG_E("JSON tests check bus activity per cycle, build with BUS_TRACE defined");
+    return RESULT::RESULT_ERROR;
+#endif
+
     std::ifstream file;
     for (std::string &path : json_list) 
     {
@@ -76,20 +128,19 @@ RESULT jsontest_validator::run_tests()
         { // Loop through tests
             
             // Reset memory
-            memset(emu->memory->memory_hook, 0, 0xFFFF);
-            bus_activities.clear();
-            emu->cpu.trapped = false;
+            memset(emu->memory->memory_hook, 0, 0x10000);
+            emu->cpu->trapped = false;
 
             // Setup CPU regs and memory
             const rapidjson::Value& initial = tests[i]["initial"];
             const rapidjson::Value& final_v = tests[i]["final"];
             const rapidjson::Value& cycles  = tests[i]["cycles"];
-            emu->cpu.regs.PC = initial["pc"].GetUint();
-            emu->cpu.regs.SP = initial["s"].GetUint();
-            emu->cpu.regs.A  = initial["a"].GetUint();
-            emu->cpu.regs.X  = initial["x"].GetUint();
-            emu->cpu.regs.Y  = initial["y"].GetUint();
-            emu->cpu.regs.SR = initial["p"].GetUint();
+            emu->cpu->regs.PC = initial["pc"].GetUint();
+            emu->cpu->regs.SP = initial["s"].GetUint();
+            emu->cpu->regs.A  = initial["a"].GetUint();
+            emu->cpu->regs.X  = initial["x"].GetUint();
+            emu->cpu->regs.Y  = initial["y"].GetUint();
+            emu->cpu->regs.SR = initial["p"].GetUint();
             const rapidjson::Value& ram = tests[i]["initial"]["ram"];
             for (rapidjson::SizeType j = 0; j < ram.Size(); ++j)
             {
@@ -97,15 +148,17 @@ RESULT jsontest_validator::run_tests()
             }
 
             // Setup CPU vectors
-            emu->cpu.vectors.NMI = emu->cpu.peek_short( 0xFFFA );
-            emu->cpu.vectors.RESET = emu->cpu.peek_short( 0xFFFC );
-            emu->cpu.vectors.IRQBRK = emu->cpu.peek_short( 0xFFFE );
+            emu->cpu->vectors.NMI = emu->cpu->peek_short( 0xFFFA );
+            emu->cpu->vectors.RESET = emu->cpu->peek_short( 0xFFFC );
+            emu->cpu->vectors.IRQBRK = emu->cpu->peek_short( 0xFFFE );
 
             // Run test
+            emu->memory->cpu_bus.clear();
+            const uint32_t start_cycle = emu->memory->cpu_cycles;
             uint16_t cycles_executed = 0;
             while (cycles_executed < cycles.Size())
             {
-                cycles_executed += emu->cpu.execute();
+                cycles_executed += emu->cpu->execute();
             }
 
             // Check results
@@ -115,65 +168,37 @@ RESULT jsontest_validator::run_tests()
                 failure = true;
             }
 
-            for (rapidjson::SizeType j = 0; j < cycles.Size(); ++j)
-            {
-                if (j >= bus_activities.size()) {
-                    LOG_D("Missing bus activity!");
-                    failure = true;
-                    continue;
-                }
-
-                cpu_mem_t::bus_activity_t &activity = bus_activities[j];
-                if (cycles[j][0].GetUint() != activity.address) {
-                    LOG_D("CYCLE %u ADR %02X != %02X", j+1, activity.address, cycles[j][0].GetUint());
-                    failure = true;
-                }
-                if (cycles[j][1].GetUint() != activity.value) {
-                    LOG_D("CYCLE %u VAL %02X != %02X", j+1, activity.value, cycles[j][1].GetUint());
-                    failure = true;
-                }
-                if (strcmp(cycles[j][2].GetString(), "read") == 0) {
-                    if (!activity.read) {
-                        LOG_D("CYCLE %u STS write != read", j+1);
-                        failure = true;
-                    }
-                } else {
-                    if (activity.read) {
-                        LOG_D("CYCLE %u STS read != write", j+1);
-                        failure = true;
-                    }
-                }
-            }
+            if (!check_bus_activity( emu->memory->cpu_bus, start_cycle, cycles )) failure = true;
 
-            if (emu->cpu.regs.PC != final_v["pc"].GetUint()) {
-                LOG_D("PC %02X != %02X", emu->cpu.regs.PC, final_v["pc"].GetUint());
+            if (emu->cpu->regs.PC != final_v["pc"].GetUint()) {
+                LOG_D("PC %02X != %02X", emu->cpu->regs.PC, final_v["pc"].GetUint());
                 failure = true;
             }
-            if (emu->cpu.regs.SP != final_v["s"].GetUint()) {
-                LOG_D("SP %02X != %02X", emu->cpu.regs.SP, final_v["s"].GetUint());
+            if (emu->cpu->regs.SP != final_v["s"].GetUint()) {
+                LOG_D("SP %02X != %02X", emu->cpu->regs.SP, final_v["s"].GetUint());
                 failure = true;
             }
-            if (emu->cpu.regs.A != final_v["a"].GetUint()) {
-                LOG_D("A %02X != %02X", emu->cpu.regs.A, final_v["a"].GetUint());
+            if (emu->cpu->regs.A != final_v["a"].GetUint()) {
+                LOG_D("A %02X != %02X", emu->cpu->regs.A, final_v["a"].GetUint());
                 failure = true;
             }
-            if (emu->cpu.regs.X != final_v["x"].GetUint()) {
-                LOG_D("X %02X != %02X", emu->cpu.regs.X, final_v["x"].GetUint());
+            if (emu->cpu->regs.X != final_v["x"].GetUint()) {
+                LOG_D("X %02X != %02X", emu->cpu->regs.X, final_v["x"].GetUint());
                 failure = true;
             }
-            if (emu->cpu.regs.Y != final_v["y"].GetUint()) {
-                LOG_D("Y %02X != %02X", emu->cpu.regs.Y, final_v["y"].GetUint());
+            if (emu->cpu->regs.Y != final_v["y"].GetUint()) {
+                LOG_D("Y %02X != %02X", emu->cpu->regs.Y, final_v["y"].GetUint());
                 failure = true;
             }
             uint8_t p = final_v["p"].GetUint();
-            if (emu->cpu.regs.SR != final_v["p"].GetUint()) {
-                LOG_D("SR %02X != %02X", emu->cpu.regs.SR, p);
+            if (emu->cpu->regs.SR != final_v["p"].GetUint()) {
+                LOG_D("SR %02X != %02X", emu->cpu->regs.SR, p);
                 LOG_D("     N V - B D I Z C");
                 LOG_D("Got: %u %u %u %u %u %u %u %u     (%02X)", 
-                    emu->cpu.regs.N, emu->cpu.regs.V, 
-                    emu->cpu.regs.B >> 1, emu->cpu.regs.B & 0x1, 
-                    emu->cpu.regs.D, emu->cpu.regs.I, 
-                    emu->cpu.regs.Z, emu->cpu.regs.C, emu->cpu.regs.SR);
+                    emu->cpu->regs.N, emu->cpu->regs.V, 
+                    emu->cpu->regs.B >> 1, emu->cpu->regs.B & 0x1, 
+                    emu->cpu->regs.D, emu->cpu->regs.I, 
+                    emu->cpu->regs.Z, emu->cpu->regs.C, emu->cpu->regs.SR);
                 LOG_D("Exp: %u %u %u %u %u %u %u %u     (%02X)", 
                     (p & 0x80) > 0, (p & 0x40) > 0, 
                     (p & 0x20) > 0, (p & 0x10) > 0, 
@@ -211,7 +236,7 @@ RESULT jsontest_validator::run_tests()
 mem_dummy_t::mem_dummy_t()
 {
     if (memory_hook) delete[] memory_hook;
-    memory_hook = new uint8_t[0xFFFF]{0};
+    memory_hook = new uint8_t[0x10000]{0};
 }
 
 mem_dummy_t::~mem_dummy_t()
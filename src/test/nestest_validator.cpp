@@ -19,24 +19,24 @@ nestest_validator::~nestest_validator()
 RESULT nestest_validator::init(emu_t* emu_ref, const char* key_path, bool validate)
 {
     emu = emu_ref;
-    emu->cpu.nestest_validation = true;
+    emu->cpu->nestest_validation = true;
     validate_log = validate;
     
-    emu->cpu.regs.SP = 0xFD;
-    emu->cpu.regs.A  = 0x0;
-    emu->cpu.regs.X  = 0x0;
-    emu->cpu.regs.Y  = 0x0;
+    emu->cpu->regs.SP = 0xFD;
+    emu->cpu->regs.A  = 0x0;
+    emu->cpu->regs.X  = 0x0;
+    emu->cpu->regs.Y  = 0x0;
     
     if (validate_log)
     {
         if (strncmp(key_path, "../data/nestest.log", 20) == 0)
         {
-            emu->cpu.cycles = 7;
-            emu->cpu.regs.PC = 0xC000;
-            emu->cpu.regs.SR = 0x24;
-            emu->ppu.cycles = 7 * 3;
-            emu->ppu.x      = 7 * 3;
-            emu->ppu.y      = 0;
+            emu->cpu->cycles = 7;
+            emu->cpu->regs.PC = 0xC000;
+            emu->cpu->regs.SR = 0x24;
+            emu->ppu->cycles = 7 * 3;
+            emu->ppu->x      = 7 * 3;
+            emu->ppu->y      = 0;
             
         }
         key.open(key_path, std::ios::in |  std::ios::ate);
@@ -58,7 +58,7 @@ RESULT nestest_validator::execute()
     if (ret != RESULT_OK) return ret;
 
     // Clear validation str
-    snprintf(emu->cpu.nestest_validation_str, 5, "    ");
+    snprintf(emu->cpu->nestest_validation_str, 5, "    ");
 
     ret = emu->step_cycles(1);
     if (ret != RESULT_OK) return ret; 
@@ -81,14 +81,14 @@ RESULT nestest_validator::construct_output_pre_line()
 {
     line_number++;
     emu_output[0] = '\0';
-    cpu_t& cpu    = emu->cpu;
+    cpu_t& cpu    = *emu->cpu;
     uint8_t inst  = cpu.peek_byte(cpu.regs.PC    );
     uint8_t data0 = cpu.peek_byte(cpu.regs.PC + 1);
     uint8_t data1 = cpu.peek_byte(cpu.regs.PC + 2);
     op_code_t op  = op_codes[inst];
     uint32_t cycles = cpu.cycles;
-    uint16_t ppu_x = emu->ppu.x;
-    uint16_t ppu_y = emu->ppu.y;
+    uint16_t ppu_x = emu->ppu->x;
+    uint16_t ppu_y = emu->ppu->y;
 
     char op_name[5];
     snprintf(op_name, 5, "%c%s", op.official == true ? ' ' : '*', op.name);
@@ -219,15 +219,15 @@ RESULT nestest_validator::construct_output_pre_line()
 RESULT nestest_validator::construct_output_post_line()
 {
     auto index = 0;
-    if (strlen(emu->cpu.nestest_validation_str) < post_fix_letters)
+    if (strlen(emu->cpu->nestest_validation_str) < post_fix_letters)
     {
-        LOG_E("-- validation str: %s : characters to fit: %u --", emu->cpu.nestest_validation_str, post_fix_letters);
+        LOG_E("-- validation str: %s : characters to fit: %u --", emu->cpu->nestest_validation_str, post_fix_letters);
         LOG_E("ERROR OCCOURED WHEN INJECTING DATA PEEK IN VALIDATION! @ line: %llu", line_number);
         return RESULT_OK;
     }
     while (post_fix_letters > 0)
     {
-        emu_output[post_fix_cursor++] = emu->cpu.nestest_validation_str[index++];
+        emu_output[post_fix_cursor++] = emu->cpu->nestest_validation_str[index++];
         post_fix_letters--;
     }
 
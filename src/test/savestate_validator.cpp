@@ -0,0 +1,130 @@
+#include "test/savestate_validator.hpp"
+#include "nes.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cstring>
+
+namespace nes
+{
+
+namespace
+{
+uint64_t hash_frame(const uint32_t* frame)
+{ // FNV-1a over the visible picture
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint32_t i = 0; i < NES_WIDTH * NES_HEIGHT; ++i)
+    {
+        hash ^= frame[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+} // anonymous
+
+void savestate_validator::record_frames(emu_t& emu, uint32_t frames, std::vector<uint64_t>& hashes)
+{
+    hashes.clear();
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        emu.step_vblank();
+        hashes.push_back( hash_frame(emu.front_buffer) );
+    }
+}
+
+bool savestate_validator::compare_frames(const char* label, const emu_t& emu, const std::vector<uint64_t>& hashes)
+{
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        if (hashes[i] != expected[i])
+        {
+            LOG_E("%s: frame %zu differs after load (%016llx != %016llx)", label, i + 1,
+                (unsigned long long)hashes[i], (unsigned long long)expected[i]);
+            return false;
+        }
+    }
+
+    // State the frames don't show, e.g. timers and IRQ counters
+    std::vector<uint8_t> state(emu.save_state_size());
+    emu.save_state(state.data());
+    if (state != expected_state)
+    {
+        LOG_E("%s: frames match but the state after them differs", label);
+        return false;
+    }
+    LOG_S("%s: %zu frames and the final state match", label, expected.size());
+    return true;
+}
+
+RESULT savestate_validator::run(const shared_rom_t& rom, uint32_t warmup_frames, uint32_t compare_frames_count)
+{
+    typedef std::chrono::high_resolution_clock clock;
+
+    // Front and back buffers swap every frame, an even count ends on the same one
+    compare_frames_count += compare_frames_count & 1;
+
+    emu_t original{};
+    original.save_file = false; // Both instances run on a copy of the game's save
+    original.init(rom, nullptr);
+    for (uint32_t i = 0; i < warmup_frames; ++i) original.step_vblank();
+
+    std::vector<uint8_t> state(original.save_state_size());
+    auto start = clock::now();
+    const size_t state_bytes = original.save_state(state.data());
+    const double save_us = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / 1000.0;
+    if (state_bytes != state.size())
+    {
+        LOG_E("Save state wrote %zu bytes, %zu expected", state_bytes, state.size());
+        return RESULT_ERROR;
+    }
+    record_frames(original, compare_frames_count, expected);
+    expected_state.resize(original.save_state_size());
+    original.save_state(expected_state.data());
+    std::vector<uint8_t> expected_snapshot(original.snapshot_size());
+    original.memory->cpu_bus = bus_trace_t(); // The bus log of BUS_TRACE builds isn't state
+    original.snapshot(expected_snapshot.data());
+
+    // Fresh instance, saving again right after the load has to give the same bytes
+    bool ok = true;
+    std::vector<uint64_t> hashes;
+    {
+        emu_t fresh{};
+        fresh.save_file = false;
+        fresh.init(rom, nullptr);
+        start = clock::now();
+        fresh.load_state(state.data(), state.size());
+        const double load_us = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / 1000.0;
+        LOG_I("Save state %zu bytes, save %.1f us, load %.1f us", state.size(), save_us, load_us);
+
+        std::vector<uint8_t> resaved(fresh.save_state_size());
+        fresh.save_state(resaved.data());
+        if (resaved != state)
+        {
+            LOG_E("Fresh instance: state saved after load differs");
+            ok = false;
+        }
+        record_frames(fresh, compare_frames_count, hashes);
+        ok &= compare_frames("Fresh instance", fresh, hashes);
+    }
+
+    // The instance that took the state, now further along
+    original.load_state(state.data(), state.size());
+    record_frames(original, compare_frames_count, hashes);
+    ok &= compare_frames("Same instance", original, hashes);
+
+    // Anything a save state misses shows up in the raw snapshot of the instance
+    std::vector<uint8_t> snapshot(original.snapshot_size());
+    original.memory->cpu_bus = bus_trace_t();
+    original.snapshot(snapshot.data());
+    if (snapshot != expected_snapshot)
+    {
+        size_t offset = 0;
+        while (snapshot[offset] == expected_snapshot[offset]) ++offset;
+        LOG_E("Same instance: state outside the save state differs at offset %zu", offset);
+        ok = false;
+    }
+
+    return ok ? RESULT_OK : RESULT_ERROR;
+}
+
+} // nes
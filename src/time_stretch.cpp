@@ -0,0 +1,167 @@
+#include "time_stretch.hpp"
+#include "logging.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define STRETCH_SSE
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define STRETCH_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nes
+{
+
+namespace
+{
+constexpr double PI = 3.14159265358979323846;
+
+float dot_product( const float* a, const float* b, size_t count )
+{
+    const size_t vector_count = count & ~(size_t)7;
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(STRETCH_SSE)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i < vector_count; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(STRETCH_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i < vector_count; i += 8)
+    {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+    for (; i < count; ++i)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+} // anonymous
+
+time_stretch_t::time_stretch_t()
+{
+    init( 48000 );
+}
+
+void time_stretch_t::init( uint32_t sample_rate )
+{
+    if (sample_rate > STRETCH_MAX_RATE) sample_rate = STRETCH_MAX_RATE;
+    hop = sample_rate / 100;
+    window_size = hop * 2;
+    tolerance = sample_rate / 200;
+    capacity = window_size * 8 + tolerance * 2;
+
+    // Periodic Hann, overlapping halves sum to exactly 1.0
+    for (size_t i = 0; i < window_size; ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * (float)PI * (float)i / (float)window_size);
+    }
+    reset();
+}
+
+void time_stretch_t::reset()
+{
+    input_count = 0;
+    analysis_position = tolerance;
+    previous_end = 0;
+    primed = false;
+    memset(overlap, 0, sizeof(overlap));
+}
+
+size_t time_stretch_t::process( const float* frames, size_t count, float speed, block_callback_t callback, void* cookie )
+{
+    if (speed < STRETCH_MIN_SPEED) speed = STRETCH_MIN_SPEED;
+    if (speed > STRETCH_MAX_SPEED) speed = STRETCH_MAX_SPEED;
+
+    if (input_count + count > capacity)
+    { // Producer got too far ahead, start over rather than drift
+        LOG_W("Time-stretch input overflow, resetting.");
+        reset();
+        if (count > capacity) count = capacity;
+    }
+    memcpy(&input[input_count], frames, count * sizeof(float));
+    input_count += count;
+
+    size_t blocks = 0;
+    while (true)
+    {
+        size_t nominal = (size_t)(analysis_position + 0.5);
+        if (nominal + tolerance + window_size > input_count) break; // Need more input
+
+        // The first segment has nothing to line up with
+        size_t segment = primed ? find_best_offset( nominal, previous_end ) : nominal;
+
+        const float* source = &input[segment];
+        for (size_t i = 0; i < hop; ++i)
+        {
+            output[i] = overlap[i] + source[i] * window[i];
+        }
+        for (size_t i = 0; i < hop; ++i)
+        {
+            overlap[i] = source[hop + i] * window[hop + i];
+        }
+        callback( cookie, output, hop );
+        blocks++;
+
+        previous_end = segment + hop;
+        primed = true;
+        analysis_position += (double)hop * speed;
+
+        // Drop input that neither the next template nor the next search can reach
+        size_t lowest = (size_t)analysis_position - tolerance;
+        size_t drop = previous_end < lowest ? previous_end : lowest;
+        if (drop > input_count) drop = input_count;
+        if (drop > 0)
+        {
+            memmove(input, &input[drop], (input_count - drop) * sizeof(float));
+            input_count -= drop;
+            analysis_position -= drop;
+            previous_end -= drop; // Never below drop
+        }
+    }
+    return blocks;
+}
+
+size_t time_stretch_t::find_best_offset( size_t nominal, size_t natural ) const
+{ // Candidate whose start best continues the previously played segment
+    const float* reference = &input[natural];
+    const size_t first = nominal - tolerance;
+    const size_t last  = nominal + tolerance;
+
+    size_t best = nominal;
+    float best_score = dot_product( reference, &input[nominal], hop );
+
+    for (size_t k = first; k <= last; k += STRETCH_COARSE)
+    {
+        float score = dot_product( reference, &input[k], hop );
+        if (score > best_score) { best_score = score; best = k; }
+    }
+
+    const size_t fine_first = best > first + STRETCH_COARSE ? best - STRETCH_COARSE + 1 : first;
+    const size_t fine_last  = best + STRETCH_COARSE - 1 < last ? best + STRETCH_COARSE - 1 : last;
+    for (size_t k = fine_first; k <= fine_last; ++k)
+    {
+        float score = dot_product( reference, &input[k], hop );
+        if (score > best_score) { best_score = score; best = k; }
+    }
+    return best;
+}
+
+} // nes